@@ -6,7 +6,7 @@
 
 /*================================================== CLIPTokenizer ===================================================*/
 
-std::pair<std::unordered_map<std::string, float>, std::string> extract_and_remove_lora(std::string text) {
+__STATIC_INLINE__ std::pair<std::unordered_map<std::string, float>, std::string> extract_and_remove_lora(std::string text) {
     std::regex re("<lora:([^:]+):([^>]+)>");
     std::smatch matches;
     std::unordered_map<std::string, float> filename2multiplier;
@@ -41,7 +41,7 @@ const int BOS_TOKEN_ID = 49406;
 const int EOS_TOKEN_ID = 49407;
 const int PAD_TOKEN_ID = 49407;
 
-std::vector<std::pair<int, std::u32string>> bytes_to_unicode() {
+__STATIC_INLINE__ std::vector<std::pair<int, std::u32string>> bytes_to_unicode() {
     std::vector<std::pair<int, std::u32string>> byte_unicode_pairs;
     std::set<int> byte_set;
     for (int b = static_cast<int>('!'); b <= static_cast<int>('~'); ++b) {
@@ -405,7 +405,7 @@ public:
 //  [', sun, ', 1.1],
 //  ['sky', 1.4641000000000006],
 //  ['.', 1.1]]
-std::vector<std::pair<std::string, float>> parse_prompt_attention(const std::string& text) {
+__STATIC_INLINE__ std::vector<std::pair<std::string, float>> parse_prompt_attention(const std::string& text) {
     std::vector<std::pair<std::string, float>> res;
     std::vector<int> round_brackets;
     std::vector<int> square_brackets;
@@ -1080,7 +1080,7 @@ struct FrozenCLIPEmbedderWithCustomWords : public GGMLModule {
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  struct ggml_tensor* input_ids,
                  struct ggml_tensor* input_ids2,
                  size_t max_token_idx,
@@ -1090,7 +1090,7 @@ struct FrozenCLIPEmbedderWithCustomWords : public GGMLModule {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_graph(input_ids, input_ids2, max_token_idx, return_pooled);
         };
-        GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
     }
 
     std::pair<std::vector<int>, std::vector<float>> tokenize(std::string text,
@@ -1385,14 +1385,14 @@ struct FrozenCLIPVisionEmbedder : public GGMLModule {
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  ggml_tensor* pixel_values,
                  ggml_tensor** output,
                  ggml_context* output_ctx) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_graph(pixel_values);
         };
-        GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
     }
 };
 
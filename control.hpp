@@ -315,6 +315,7 @@ struct ControlNet : public GGMLModule {
     std::vector<struct ggml_tensor*> controls;  // (12 input block outputs, 1 middle block output) SD 1.5
     struct ggml_tensor* guided_hint = NULL;     // guided_hint cache, for faster inference
     bool guided_hint_cached         = false;
+    int64_t control_input_ne[4]     = {0, 0, 0, 0};  // shape of x the controls are sized for
 
     ControlNet(ggml_backend_t backend,
                ggml_type wtype,
@@ -410,7 +411,7 @@ struct ControlNet : public GGMLModule {
         return gf;
     }
 
-    void compute(int n_threads,
+    bool compute(int n_threads,
                  struct ggml_tensor* x,
                  struct ggml_tensor* hint,
                  struct ggml_tensor* timesteps,
@@ -426,8 +427,19 @@ struct ControlNet : public GGMLModule {
             return build_graph(x, hint, timesteps, context, y);
         };
 
-        GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
+        // the controls have the shape of x, e.g. batch 2 while the sampler batches cond and
+        // uncond and batch 1 on the steps the CFG schedule skips the uncond pass
+        if (control_ctx != NULL && memcmp(control_input_ne, x->ne, sizeof(control_input_ne)) != 0) {
+            free_control_ctx();
+            free_compute_buffer();
+        }
+        memcpy(control_input_ne, x->ne, sizeof(control_input_ne));
+
+        if (!GGMLModule::compute(get_graph, n_threads, false, output, output_ctx)) {
+            return false;
+        }
         guided_hint_cached = true;
+        return true;
     }
 
     bool load_from_file(const std::string& file_path) {
@@ -437,7 +449,10 @@ struct ControlNet : public GGMLModule {
         control_net.get_param_tensors(tensors);
         std::set<std::string> ignore_tensors;
 
+        // original controlnet checkpoints also contain a whole sd model, only read the
+        // tensors under the top level names used by the control net
         ModelLoader model_loader;
+        model_loader.set_tensor_prefixes(get_tensor_prefixes(tensors));
         if (!model_loader.init_from_file(file_path)) {
             LOG_ERROR("init control net model loader from file failed: '%s'", file_path.c_str());
             return false;
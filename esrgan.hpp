@@ -159,7 +159,9 @@ struct ESRGAN : public GGMLModule {
         std::map<std::string, ggml_tensor*> esrgan_tensors;
         rrdb_net.get_param_tensors(esrgan_tensors);
 
+        // only read the tensors of the network, e.g. not the discriminator of a training checkpoint
         ModelLoader model_loader;
+        model_loader.set_tensor_prefixes(get_tensor_prefixes(esrgan_tensors));
         if (!model_loader.init_from_file(file_path)) {
             LOG_ERROR("init esrgan model loader from file failed: '%s'", file_path.c_str());
             return false;
@@ -184,14 +186,14 @@ struct ESRGAN : public GGMLModule {
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  struct ggml_tensor* x,
                  ggml_tensor** output,
                  ggml_context* output_ctx = NULL) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_graph(x);
         };
-        GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
     }
 };
 
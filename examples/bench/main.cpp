@@ -0,0 +1,946 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "ggml_extend.hpp"
+#include "model.h"
+#include "stable-diffusion.h"
+
+#include "clip.hpp"
+#include "esrgan.hpp"
+#include "tae.hpp"
+#include "unet.hpp"
+#include "vae.hpp"
+
+#include "json.hpp"
+
+/*
+    sd-bench: cold and warm timings of the pipeline stages and modules.
+
+    With --random-weights the modules are built directly with random params (no model file
+    needed) and every module is timed on its own. With -m the model file is loaded through
+    the library API and the stages of txt2img are timed from sd_get_metrics().
+    The first run of a configuration is the cold one (graph build, buffer allocation), the
+    --repeat following runs are the warm ones.
+*/
+
+const char* bench_names[] = {
+    "load",
+    "clip",
+    "unet_step",
+    "sample",
+    "vae_decode",
+    "vae_decode_tiled",
+    "taesd_decode",
+    "esrgan_tile",
+    "lora_apply",
+};
+
+enum BenchType {
+    BENCH_LOAD,
+    BENCH_CLIP,
+    BENCH_UNET_STEP,
+    BENCH_SAMPLE,
+    BENCH_VAE_DECODE,
+    BENCH_VAE_DECODE_TILED,
+    BENCH_TAESD_DECODE,
+    BENCH_ESRGAN_TILE,
+    BENCH_LORA_APPLY,
+    BENCH_COUNT
+};
+
+const char* random_versions_str[] = {
+    "1.x",
+    "2.x",
+    "xl",
+};
+
+struct BenchParams {
+    int repeat        = 5;
+    int steps         = 20;
+    float cfg_scale   = 7.0f;
+    int64_t seed      = 42;
+    bool random       = false;
+    SDVersion version = VERSION_1_x;  // of the random weights
+
+    std::string model_path;
+    std::string vae_path;
+    std::string taesd_path;
+    std::string esrgan_path;
+    std::string lora_model_dir;
+    std::string lora;
+    std::string output_path;
+
+    std::vector<std::pair<int, int>> resolutions = {{512, 512}};
+    std::vector<int> batch_sizes                 = {1};
+    std::vector<int> thread_counts;
+    std::vector<sd_type_t> wtypes;
+    bool enabled[BENCH_COUNT] = {};
+
+    bool verbose = false;
+};
+
+struct BenchResult {
+    BenchType bench;
+    sd_type_t wtype;
+    int width;
+    int height;
+    int batch;
+    int n_threads;
+    std::vector<float> runs_ms;  // the cold run first
+};
+
+void print_usage(int argc, const char* argv[]) {
+    printf("usage: %s [arguments]\n", argv[0]);
+    printf("\n");
+    printf("arguments:\n");
+    printf("  -h, --help                         show this help message and exit\n");
+    printf("  -m, --model [MODEL]                path to model, the txt2img stages are timed through the library API\n");
+    printf("  --random-weights [VERSION]         time each module with random weights of a 1.x, 2.x or xl model (no model file needed)\n");
+    printf("  --vae [VAE]                        path to vae\n");
+    printf("  --taesd [TAESD_PATH]               path to taesd, enables taesd_decode with -m\n");
+    printf("  --upscale-model [ESRGAN_PATH]      path to esrgan model, enables esrgan_tile with -m\n");
+    printf("  --lora-model-dir [DIR]             lora model directory\n");
+    printf("  --lora [NAME]                      lora in --lora-model-dir, enables lora_apply with -m\n");
+    printf("  -b, --bench [LIST]                 comma separated benchmarks (default: all available)\n");
+    printf("                                     load, clip, unet_step, sample, vae_decode, vae_decode_tiled, taesd_decode,\n");
+    printf("                                     esrgan_tile, lora_apply\n");
+    printf("  -r, --res [LIST]                   comma separated WxH resolutions to sweep (default: 512x512)\n");
+    printf("  --batch [LIST]                     comma separated batch sizes to sweep (default: 1)\n");
+    printf("  -t, --threads [LIST]               comma separated thread counts to sweep (default: number of physical cores)\n");
+    printf("  --type [LIST]                      comma separated weight types to sweep (f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0)\n");
+    printf("                                     (default: the type of the weight file, f16 for random weights)\n");
+    printf("  --steps STEPS                      number of sample steps of the sample benchmark (default: 20)\n");
+    printf("  --cfg-scale SCALE                  unconditional guidance scale, 1.0 skips the uncond pass (default: 7.0)\n");
+    printf("  --repeat N                         warm runs of each configuration (default: 5)\n");
+    printf("  -s SEED, --seed SEED               RNG seed (default: 42)\n");
+    printf("  -o, --output OUTPUT                path to write the JSON results to (default: stdout)\n");
+    printf("  -v, --verbose                      print extra info\n");
+}
+
+std::vector<std::string> split_list(const std::string& str) {
+    std::vector<std::string> items;
+    std::stringstream ss(str);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.size() > 0) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+bool parse_wtype(const std::string& type, sd_type_t& wtype) {
+    for (int i = 0; i < SD_TYPE_COUNT; i++) {
+        if (type == sd_type_name((sd_type_t)i)) {
+            wtype = (sd_type_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void parse_args(int argc, const char** argv, BenchParams& params) {
+    bool invalid_arg = false;
+    std::string arg;
+    std::string benches;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-m" || arg == "--model") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.model_path = argv[i];
+        } else if (arg == "--random-weights") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            const char* version_selected = argv[i];
+            int version_found            = -1;
+            for (int d = 0; d < 3; d++) {
+                if (!strcmp(version_selected, random_versions_str[d])) {
+                    version_found = d;
+                }
+            }
+            if (version_found == -1) {
+                fprintf(stderr, "error: invalid version %s, must be one of [1.x, 2.x, xl]\n", version_selected);
+                exit(1);
+            }
+            params.random  = true;
+            params.version = (SDVersion)version_found;
+        } else if (arg == "--vae") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_path = argv[i];
+        } else if (arg == "--taesd") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.taesd_path = argv[i];
+        } else if (arg == "--upscale-model") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.esrgan_path = argv[i];
+        } else if (arg == "--lora-model-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.lora_model_dir = argv[i];
+        } else if (arg == "--lora") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.lora = argv[i];
+        } else if (arg == "-b" || arg == "--bench") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            benches = argv[i];
+        } else if (arg == "-r" || arg == "--res") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.resolutions.clear();
+            for (const std::string& res : split_list(argv[i])) {
+                int width = 0, height = 0;
+                if (sscanf(res.c_str(), "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0 ||
+                    width % 64 != 0 || height % 64 != 0) {
+                    fprintf(stderr, "error: invalid resolution %s, must be WxH with multiples of 64\n", res.c_str());
+                    exit(1);
+                }
+                params.resolutions.push_back(std::make_pair(width, height));
+            }
+        } else if (arg == "--batch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.batch_sizes.clear();
+            for (const std::string& batch : split_list(argv[i])) {
+                params.batch_sizes.push_back(std::max(1, std::stoi(batch)));
+            }
+        } else if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.thread_counts.clear();
+            for (const std::string& n_threads : split_list(argv[i])) {
+                params.thread_counts.push_back(std::stoi(n_threads));
+            }
+        } else if (arg == "--type") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.wtypes.clear();
+            for (const std::string& type : split_list(argv[i])) {
+                sd_type_t wtype;
+                if (!parse_wtype(type, wtype)) {
+                    fprintf(stderr, "error: invalid weight format %s, must be one of [f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0]\n",
+                            type.c_str());
+                    exit(1);
+                }
+                params.wtypes.push_back(wtype);
+            }
+        } else if (arg == "--steps") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.steps = std::stoi(argv[i]);
+        } else if (arg == "--cfg-scale") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_scale = std::stof(argv[i]);
+        } else if (arg == "--repeat") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.repeat = std::stoi(argv[i]);
+        } else if (arg == "-s" || arg == "--seed") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.seed = std::stoll(argv[i]);
+        } else if (arg == "-o" || arg == "--output") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.output_path = argv[i];
+        } else if (arg == "-v" || arg == "--verbose") {
+            params.verbose = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argc, argv);
+            exit(0);
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            print_usage(argc, argv);
+            exit(1);
+        }
+    }
+    if (invalid_arg) {
+        fprintf(stderr, "error: invalid parameter for argument: %s\n", arg.c_str());
+        print_usage(argc, argv);
+        exit(1);
+    }
+    if (params.random == (params.model_path.size() > 0)) {
+        fprintf(stderr, "error: exactly one of --model and --random-weights is required\n");
+        print_usage(argc, argv);
+        exit(1);
+    }
+    if (params.steps <= 0 || params.repeat < 0) {
+        fprintf(stderr, "error: --steps must be positive and --repeat not negative\n");
+        exit(1);
+    }
+
+    if (params.thread_counts.size() == 0) {
+        params.thread_counts.push_back(get_num_physical_cores());
+    }
+    if (params.wtypes.size() == 0) {
+        params.wtypes.push_back(params.random ? SD_TYPE_F16 : SD_TYPE_COUNT);
+    }
+
+    if (benches.size() == 0) {
+        // everything that can run with the given files
+        for (int i = 0; i < BENCH_COUNT; i++) {
+            params.enabled[i] = true;
+        }
+        params.enabled[BENCH_LOAD]         = !params.random;
+        params.enabled[BENCH_TAESD_DECODE] = params.random || params.taesd_path.size() > 0;
+        params.enabled[BENCH_ESRGAN_TILE]  = params.random || params.esrgan_path.size() > 0;
+        params.enabled[BENCH_LORA_APPLY]   = !params.random && params.lora.size() > 0;
+    } else {
+        for (const std::string& name : split_list(benches)) {
+            int found = -1;
+            for (int i = 0; i < BENCH_COUNT; i++) {
+                if (name == bench_names[i]) {
+                    found = i;
+                }
+            }
+            if (found == -1) {
+                fprintf(stderr, "error: unknown benchmark %s\n", name.c_str());
+                exit(1);
+            }
+            params.enabled[found] = true;
+        }
+    }
+    if (params.random && (params.enabled[BENCH_LOAD] || params.enabled[BENCH_LORA_APPLY])) {
+        fprintf(stderr, "error: load and lora_apply need a model file (-m)\n");
+        exit(1);
+    }
+    if (!params.random && params.enabled[BENCH_TAESD_DECODE] && params.taesd_path.size() == 0) {
+        fprintf(stderr, "error: taesd_decode needs --taesd with -m\n");
+        exit(1);
+    }
+    if (!params.random && params.enabled[BENCH_ESRGAN_TILE] && params.esrgan_path.size() == 0) {
+        fprintf(stderr, "error: esrgan_tile needs --upscale-model with -m\n");
+        exit(1);
+    }
+    if (!params.random && params.enabled[BENCH_LORA_APPLY] && params.lora.size() == 0) {
+        fprintf(stderr, "error: lora_apply needs --lora with -m\n");
+        exit(1);
+    }
+}
+
+void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
+    BenchParams* params = (BenchParams*)data;
+    if (!log || (!params->verbose && level <= SD_LOG_INFO)) {
+        return;
+    }
+    // stdout may carry the results
+    fputs(log, stderr);
+    fflush(stderr);
+}
+
+/*================================================ Random weights ================================================*/
+
+// Random params scaled by 1/sqrt(fan_in), so the activations stay in range (no nan/denormal slow paths)
+// through the layers. 1d params (norm weights, biases) are around 1.
+void set_random_params(std::map<std::string, struct ggml_tensor*>& tensors, std::mt19937& gen) {
+    // drawing every value would take longer than the benchmark for the big models
+    static std::vector<float> pool;
+    if (pool.size() == 0) {
+        std::normal_distribution<float> distribution(0.0f, 1.0f);
+        pool.resize(1 << 20);
+        for (float& value : pool) {
+            value = distribution(gen);
+        }
+    }
+    std::uniform_int_distribution<size_t> offset_distribution(0, pool.size() - 1);
+
+    std::vector<float> src;
+    std::vector<uint8_t> dst;
+    for (auto& kv : tensors) {
+        struct ggml_tensor* tensor = kv.second;
+        int64_t n                  = ggml_nelements(tensor);
+        int n_dims                 = ggml_n_dims(tensor);
+        float scale                = n_dims > 1 ? 1.0f / sqrtf((float)(n / tensor->ne[n_dims - 1])) : 0.1f;
+        float bias                 = n_dims > 1 ? 0.0f : 1.0f;
+        size_t offset              = offset_distribution(gen);
+        src.resize(n);
+        for (int64_t i = 0; i < n; i++) {
+            src[i] = bias + scale * pool[(offset + i) % pool.size()];
+        }
+
+        if (tensor->type == GGML_TYPE_F32) {
+            ggml_backend_tensor_set(tensor, src.data(), 0, ggml_nbytes(tensor));
+            continue;
+        }
+        dst.resize(ggml_nbytes(tensor));
+        if (tensor->type == GGML_TYPE_F16) {
+            ggml_fp32_to_fp16_row(src.data(), (ggml_fp16_t*)dst.data(), n);
+        } else {
+            int64_t hist[16];
+            std::vector<float> imatrix(tensor->ne[0], 1.0f);  // dummy importance matrix
+            ggml_quantize_chunk(tensor->type, src.data(), dst.data(), 0, n / tensor->ne[0], tensor->ne[0], hist, imatrix.data());
+        }
+        ggml_backend_tensor_set(tensor, dst.data(), 0, ggml_nbytes(tensor));
+    }
+}
+
+template <typename Module>
+std::shared_ptr<Module> init_random_module(std::shared_ptr<Module> module, std::mt19937& gen) {
+    if (!module->alloc_params_buffer()) {
+        return NULL;
+    }
+    std::map<std::string, struct ggml_tensor*> tensors;
+    module->get_param_tensors(tensors, "");
+    set_random_params(tensors, gen);
+    return module;
+}
+
+// the params of some modules are only reachable through their blocks
+struct RandomTAESD : public TinyAutoEncoder {
+    RandomTAESD(ggml_backend_t backend, ggml_type wtype)
+        : TinyAutoEncoder(backend, wtype, true) {}
+
+    void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors, const std::string prefix) {
+        taesd.get_param_tensors(tensors, prefix);
+    }
+};
+
+struct RandomESRGAN : public ESRGAN {
+    RandomESRGAN(ggml_backend_t backend, ggml_type wtype)
+        : ESRGAN(backend, wtype) {}
+
+    void get_param_tensors(std::map<std::string, struct ggml_tensor*>& tensors, const std::string prefix) {
+        rrdb_net.get_param_tensors(tensors, prefix);
+    }
+};
+
+void fill_random(struct ggml_tensor* tensor, std::mt19937& gen) {
+    std::normal_distribution<float> distribution(0.0f, 1.0f);
+    float* data = (float*)tensor->data;
+    for (int64_t i = 0; i < ggml_nelements(tensor); i++) {
+        data[i] = distribution(gen);
+    }
+}
+
+struct ggml_context* new_work_ctx(size_t mem_size) {
+    struct ggml_init_params params;
+    params.mem_size   = mem_size;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+    return ggml_init(params);
+}
+
+// runs fn 1 + repeat times, in ms
+std::vector<float> time_runs(int repeat, std::function<void()> fn) {
+    std::vector<float> runs_ms;
+    for (int i = 0; i <= repeat; i++) {
+        int64_t t0 = ggml_time_us();
+        fn();
+        int64_t t1 = ggml_time_us();
+        runs_ms.push_back((t1 - t0) / 1000.f);
+    }
+    return runs_ms;
+}
+
+void run_random_benchmarks(const BenchParams& params,
+                           ggml_backend_t backend,
+                           sd_type_t wtype,
+                           int n_threads,
+                           std::vector<BenchResult>& results) {
+    const SDVersion version = params.version;
+    const ggml_type type    = (ggml_type)wtype;
+    const int context_dim   = version == VERSION_XL ? 2048 : (version == VERSION_2_x ? 1024 : 768);
+    const int adm_dim       = 2816;  // xl only
+    const bool has_uncond   = params.cfg_scale != 1.0f;
+    std::mt19937 gen((unsigned int)params.seed);
+
+    std::shared_ptr<FrozenCLIPEmbedderWithCustomWords> clip;
+    std::shared_ptr<UNetModel> unet;
+    std::shared_ptr<AutoEncoderKL> vae;
+    std::shared_ptr<RandomTAESD> taesd;
+    std::shared_ptr<RandomESRGAN> esrgan;
+
+    if (params.enabled[BENCH_CLIP]) {
+        clip = init_random_module(std::make_shared<FrozenCLIPEmbedderWithCustomWords>(backend, type, version), gen);
+    }
+    if (params.enabled[BENCH_UNET_STEP] || params.enabled[BENCH_SAMPLE]) {
+        unet = init_random_module(std::make_shared<UNetModel>(backend, type, version), gen);
+    }
+    if (params.enabled[BENCH_VAE_DECODE] || params.enabled[BENCH_VAE_DECODE_TILED]) {
+        // like the library, sdxl vae in f32
+        ggml_type vae_type = version == VERSION_XL ? GGML_TYPE_F32 : type;
+        vae                = init_random_module(std::make_shared<AutoEncoderKL>(backend, vae_type, true), gen);
+    }
+    if (params.enabled[BENCH_TAESD_DECODE]) {
+        taesd = init_random_module(std::make_shared<RandomTAESD>(backend, type), gen);
+    }
+    if (params.enabled[BENCH_ESRGAN_TILE]) {
+        esrgan = init_random_module(std::make_shared<RandomESRGAN>(backend, type), gen);
+    }
+
+    auto add_result = [&](BenchType bench, int width, int height, int batch, std::vector<float> runs_ms) {
+        results.push_back({bench, wtype, width, height, batch, n_threads, runs_ms});
+        fprintf(stderr, "%-18s %-5s %4dx%-4d batch %d, %d threads: cold %.1f ms\n",
+                bench_names[bench], sd_type_name(wtype), width, height, batch, n_threads, runs_ms[0]);
+    };
+
+    for (int batch : params.batch_sizes) {
+        if (clip != NULL) {
+            struct ggml_context* work_ctx = new_work_ctx(16 * 1024 * 1024);
+            int n_token                   = clip->text_model.n_token;
+            struct ggml_tensor* ids       = ggml_new_tensor_2d(work_ctx, GGML_TYPE_I32, n_token, batch);
+            std::uniform_int_distribution<int32_t> token_distribution(0, 49407);
+            for (int64_t i = 0; i < ggml_nelements(ids); i++) {
+                ((int32_t*)ids->data)[i] = token_distribution(gen);
+            }
+            struct ggml_tensor* ids2 = version == VERSION_XL ? ids : NULL;
+            int64_t hidden_size      = clip->text_model.hidden_size;
+            if (version == VERSION_XL) {
+                hidden_size += clip->text_model2.hidden_size;
+            }
+            // allocated once, every run copies its result into it
+            struct ggml_tensor* out = ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, hidden_size, n_token, batch);
+            auto runs_ms            = time_runs(params.repeat, [&]() {
+                clip->compute(n_threads, ids, ids2, 0, false, &out);
+                clip->free_compute_buffer();
+            });
+            add_result(BENCH_CLIP, 0, 0, batch, runs_ms);
+            ggml_free(work_ctx);
+        }
+
+        for (auto& res : params.resolutions) {
+            int width  = res.first;
+            int height = res.second;
+            int W      = width / 8;
+            int H      = height / 8;
+
+            size_t mem_size               = 64 * 1024 * 1024;
+            mem_size += (size_t)width * height * 3 * sizeof(float) * batch * 2;
+            struct ggml_context* work_ctx = new_work_ctx(mem_size);
+            if (work_ctx == NULL) {
+                fprintf(stderr, "error: failed to allocate the work memory\n");
+                return;
+            }
+            struct ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, 4, batch);
+            fill_random(latent, gen);
+
+            if (unet != NULL) {
+                struct ggml_tensor* x         = ggml_dup_tensor(work_ctx, latent);
+                struct ggml_tensor* out       = ggml_dup_tensor(work_ctx, latent);
+                struct ggml_tensor* context   = ggml_new_tensor_3d(work_ctx, GGML_TYPE_F32, context_dim, 77, batch);
+                struct ggml_tensor* y         = NULL;
+                struct ggml_tensor* timesteps = ggml_new_tensor_1d(work_ctx, GGML_TYPE_F32, batch);
+                fill_random(context, gen);
+                if (version == VERSION_XL) {
+                    y = ggml_new_tensor_2d(work_ctx, GGML_TYPE_F32, adm_dim, batch);
+                    fill_random(y, gen);
+                }
+
+                if (params.enabled[BENCH_UNET_STEP]) {
+                    copy_ggml_tensor(x, latent);
+                    ggml_set_f32(timesteps, 999.f);
+                    auto runs_ms = time_runs(params.repeat, [&]() {
+                        unet->compute(n_threads, x, timesteps, context, NULL, y, -1, {}, 0.f, &out);
+                    });
+                    unet->free_compute_buffer();
+                    add_result(BENCH_UNET_STEP, width, height, batch, runs_ms);
+                }
+                if (params.enabled[BENCH_SAMPLE]) {
+                    // euler with the cond and uncond passes of the library
+                    auto runs_ms = time_runs(params.repeat, [&]() {
+                        copy_ggml_tensor(x, latent);
+                        for (int step = 0; step < params.steps; step++) {
+                            ggml_set_f32(timesteps, 999.f * (params.steps - step) / params.steps);
+                            unet->compute(n_threads, x, timesteps, context, NULL, y, -1, {}, 0.f, &out);
+                            if (has_uncond) {
+                                unet->compute(n_threads, x, timesteps, context, NULL, y, -1, {}, 0.f, &out);
+                            }
+                            float* vec_x   = (float*)x->data;
+                            float* vec_out = (float*)out->data;
+                            for (int64_t i = 0; i < ggml_nelements(x); i++) {
+                                vec_x[i] -= vec_out[i] / params.steps;
+                            }
+                        }
+                        unet->free_compute_buffer();
+                    });
+                    add_result(BENCH_SAMPLE, width, height, batch, runs_ms);
+                }
+            }
+
+            struct ggml_tensor* img = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, batch);
+            if (vae != NULL && params.enabled[BENCH_VAE_DECODE]) {
+                auto runs_ms = time_runs(params.repeat, [&]() {
+                    vae->compute(n_threads, latent, true, &img);
+                    vae->free_compute_buffer();
+                });
+                add_result(BENCH_VAE_DECODE, width, height, batch, runs_ms);
+            }
+            if (vae != NULL && params.enabled[BENCH_VAE_DECODE_TILED]) {
+                // the tiles of the library, one latent at a time
+                struct ggml_tensor* latent_b = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, 4, 1);
+                struct ggml_tensor* img_b    = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, width, height, 3, 1);
+                auto on_tiling               = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
+                    vae->compute(n_threads, in, true, &out);
+                };
+                auto runs_ms = time_runs(params.repeat, [&]() {
+                    for (int b = 0; b < batch; b++) {
+                        memcpy(latent_b->data, (char*)latent->data + b * latent->nb[3], ggml_nbytes(latent_b));
+                        sd_tiling(latent_b, img_b, 8, 32, 0.5f, on_tiling);
+                    }
+                    vae->free_compute_buffer();
+                });
+                add_result(BENCH_VAE_DECODE_TILED, width, height, batch, runs_ms);
+            }
+            if (taesd != NULL) {
+                auto runs_ms = time_runs(params.repeat, [&]() {
+                    taesd->compute(n_threads, latent, true, &img);
+                    taesd->free_compute_buffer();
+                });
+                add_result(BENCH_TAESD_DECODE, width, height, batch, runs_ms);
+            }
+            ggml_free(work_ctx);
+        }
+
+        if (esrgan != NULL) {
+            // one tile of the upscaler
+            int tile_size                 = esrgan->tile_size;
+            size_t mem_size               = 16 * 1024 * 1024;
+            mem_size += (size_t)tile_size * tile_size * 3 * sizeof(float) * batch * (1 + esrgan->scale * esrgan->scale);
+            struct ggml_context* work_ctx = new_work_ctx(mem_size);
+            struct ggml_tensor* tile      = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, tile_size, tile_size, 3, batch);
+            ggml_tensor_set_f32_randn(tile, std::make_shared<STDDefaultRNG>());
+            int out_size            = tile_size * esrgan->scale;
+            struct ggml_tensor* out = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, out_size, out_size, 3, batch);
+            auto runs_ms            = time_runs(params.repeat, [&]() {
+                esrgan->compute(n_threads, tile, &out);
+                esrgan->free_compute_buffer();
+            });
+            add_result(BENCH_ESRGAN_TILE, tile_size, tile_size, batch, runs_ms);
+            ggml_free(work_ctx);
+        }
+    }
+}
+
+/*================================================ Model file ================================================*/
+
+sd_ctx_t* new_bench_ctx(const BenchParams& params, sd_type_t wtype, int n_threads, bool vae_tiling, bool taesd) {
+    return new_sd_ctx(params.model_path.c_str(),
+                      params.vae_path.c_str(),
+                      taesd ? params.taesd_path.c_str() : "",
+                      "",
+                      params.lora_model_dir.c_str(),
+                      "",
+                      "",
+                      true,
+                      vae_tiling,
+                      false,
+                      n_threads,
+                      wtype,
+                      CUDA_RNG,
+                      DEFAULT,
+                      false,
+                      false,
+                      false,
+                      false,
+                      0,
+                      false,
+                      true);
+}
+
+// txt2img with the whole batch in one pass, false on failure
+bool run_txt2img(const BenchParams& params,
+                 sd_ctx_t* sd_ctx,
+                 const std::string& prompt,
+                 int width,
+                 int height,
+                 int batch,
+                 int steps,
+                 sd_metrics_t* metrics) {
+    sd_image_t* images = txt2img(sd_ctx, prompt.c_str(), "", -1, params.cfg_scale, width, height, EULER,
+                                 steps, params.seed, batch, NULL, 0.f, 0.f, false, "");
+    if (images == NULL) {
+        return false;
+    }
+    for (int b = 0; b < batch; b++) {
+        free(images[b].data);
+    }
+    free(images);
+    return sd_get_metrics(sd_ctx, metrics);
+}
+
+bool run_model_benchmarks(const BenchParams& params,
+                          sd_type_t wtype,
+                          int n_threads,
+                          std::vector<BenchResult>& results) {
+    const std::string prompt = "a lovely cat";
+
+    auto add_result = [&](BenchType bench, int width, int height, int batch, std::vector<float> runs_ms) {
+        results.push_back({bench, wtype, width, height, batch, n_threads, runs_ms});
+        fprintf(stderr, "%-18s %-5s %4dx%-4d batch %d, %d threads: cold %.1f ms\n",
+                bench_names[bench], wtype < SD_TYPE_COUNT ? sd_type_name(wtype) : "file", width, height, batch,
+                n_threads, runs_ms[0]);
+    };
+
+    bool txt2img_benches = params.enabled[BENCH_CLIP] || params.enabled[BENCH_UNET_STEP] ||
+                           params.enabled[BENCH_SAMPLE] || params.enabled[BENCH_VAE_DECODE] ||
+                           params.enabled[BENCH_LORA_APPLY];
+    if (params.enabled[BENCH_LOAD] || txt2img_benches) {
+        int64_t t0       = ggml_time_us();
+        sd_ctx_t* sd_ctx = new_bench_ctx(params, wtype, n_threads, false, false);
+        int64_t t1       = ggml_time_us();
+        if (sd_ctx == NULL) {
+            fprintf(stderr, "error: new_sd_ctx failed\n");
+            return false;
+        }
+        if (params.enabled[BENCH_LOAD]) {
+            add_result(BENCH_LOAD, 0, 0, 1, {(t1 - t0) / 1000.f});
+        }
+
+        for (int batch : params.batch_sizes) {
+            for (auto& res : params.resolutions) {
+                if (!txt2img_benches) {
+                    break;
+                }
+                std::vector<float> clip_ms, unet_ms, sample_ms, vae_ms;
+                for (int i = 0; i <= params.repeat; i++) {
+                    sd_metrics_t metrics;
+                    if (!run_txt2img(params, sd_ctx, prompt, res.first, res.second, batch, params.steps, &metrics)) {
+                        fprintf(stderr, "error: txt2img failed\n");
+                        free_sd_ctx(sd_ctx);
+                        return false;
+                    }
+                    clip_ms.push_back(metrics.get_learned_condition_ms);
+                    for (int e = 0; e < std::min(metrics.n_unet_evals, SD_METRICS_MAX_UNET_EVALS); e++) {
+                        unet_ms.push_back(metrics.unet_eval_ms[e]);
+                    }
+                    sample_ms.push_back(metrics.sampling_ms);
+                    vae_ms.push_back(metrics.decode_first_stage_ms);
+                }
+                if (params.enabled[BENCH_CLIP]) {
+                    add_result(BENCH_CLIP, 0, 0, batch, clip_ms);
+                }
+                if (params.enabled[BENCH_UNET_STEP]) {
+                    // every step of every run, the cold one is the first step
+                    add_result(BENCH_UNET_STEP, res.first, res.second, batch, unet_ms);
+                }
+                if (params.enabled[BENCH_SAMPLE]) {
+                    add_result(BENCH_SAMPLE, res.first, res.second, batch, sample_ms);
+                }
+                if (params.enabled[BENCH_VAE_DECODE]) {
+                    add_result(BENCH_VAE_DECODE, res.first, res.second, batch, vae_ms);
+                }
+            }
+        }
+
+        if (params.enabled[BENCH_LORA_APPLY]) {
+            // the runs alternate with and without the lora, so every run applies it or removes it
+            auto& res = params.resolutions[0];
+            std::vector<float> lora_ms;
+            for (int i = 0; i <= params.repeat; i++) {
+                sd_metrics_t metrics;
+                std::string lora_prompt = prompt + "<lora:" + params.lora + ":1>";
+                if (!run_txt2img(params, sd_ctx, lora_prompt, res.first, res.second, 1, 1, &metrics)) {
+                    fprintf(stderr, "error: txt2img failed\n");
+                    free_sd_ctx(sd_ctx);
+                    return false;
+                }
+                lora_ms.push_back(metrics.apply_loras_ms);
+                run_txt2img(params, sd_ctx, prompt, res.first, res.second, 1, 1, &metrics);
+            }
+            add_result(BENCH_LORA_APPLY, 0, 0, 1, lora_ms);
+        }
+        free_sd_ctx(sd_ctx);
+    }
+
+    // the decoders are timed in contexts of their own, with one sampling step per run
+    for (int d = 0; d < 2; d++) {
+        BenchType bench = d == 0 ? BENCH_VAE_DECODE_TILED : BENCH_TAESD_DECODE;
+        if (!params.enabled[bench]) {
+            continue;
+        }
+        sd_ctx_t* sd_ctx = new_bench_ctx(params, wtype, n_threads, bench == BENCH_VAE_DECODE_TILED, bench == BENCH_TAESD_DECODE);
+        if (sd_ctx == NULL) {
+            fprintf(stderr, "error: new_sd_ctx failed\n");
+            return false;
+        }
+        for (int batch : params.batch_sizes) {
+            for (auto& res : params.resolutions) {
+                std::vector<float> decode_ms;
+                for (int i = 0; i <= params.repeat; i++) {
+                    sd_metrics_t metrics;
+                    if (!run_txt2img(params, sd_ctx, prompt, res.first, res.second, batch, 1, &metrics)) {
+                        fprintf(stderr, "error: txt2img failed\n");
+                        free_sd_ctx(sd_ctx);
+                        return false;
+                    }
+                    decode_ms.push_back(metrics.decode_first_stage_ms);
+                }
+                add_result(bench, res.first, res.second, batch, decode_ms);
+            }
+        }
+        free_sd_ctx(sd_ctx);
+    }
+
+    if (params.enabled[BENCH_ESRGAN_TILE]) {
+        upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx(params.esrgan_path.c_str(), n_threads, wtype);
+        if (upscaler_ctx == NULL) {
+            fprintf(stderr, "error: new_upscaler_ctx failed\n");
+            return false;
+        }
+        // one tile of the upscaler (tile_size 128)
+        const int tile_size = 128;
+        std::vector<uint8_t> pixels(tile_size * tile_size * 3);
+        std::mt19937 gen((unsigned int)params.seed);
+        for (uint8_t& pixel : pixels) {
+            pixel = (uint8_t)(gen() & 0xFF);
+        }
+        sd_image_t tile = {(uint32_t)tile_size, (uint32_t)tile_size, 3, pixels.data()};
+        auto runs_ms    = time_runs(params.repeat, [&]() {
+            sd_image_t upscaled = upscale(upscaler_ctx, tile, 4);
+            free(upscaled.data);
+        });
+        add_result(BENCH_ESRGAN_TILE, tile_size, tile_size, 1, runs_ms);
+        free_upscaler_ctx(upscaler_ctx);
+    }
+    return true;
+}
+
+/*================================================ Results ================================================*/
+
+// nearest rank
+float percentile(const std::vector<float>& sorted, float p) {
+    if (sorted.size() == 0) {
+        return 0.f;
+    }
+    size_t rank = (size_t)ceilf(p / 100.f * sorted.size());
+    return sorted[std::min(sorted.size(), std::max((size_t)1, rank)) - 1];
+}
+
+nlohmann::json result_to_json(const BenchParams& params, const BenchResult& result) {
+    nlohmann::json json;
+    json["bench"]   = bench_names[result.bench];
+    json["weights"] = params.random ? std::string("random-") + random_versions_str[params.version] : params.model_path;
+    json["type"]    = result.wtype < SD_TYPE_COUNT ? sd_type_name(result.wtype) : "file";
+    json["width"]   = result.width;
+    json["height"]  = result.height;
+    json["batch"]   = result.batch;
+    json["threads"] = result.n_threads;
+    json["cold_ms"] = result.runs_ms[0];
+
+    std::vector<float> warm(result.runs_ms.begin() + 1, result.runs_ms.end());
+    std::sort(warm.begin(), warm.end());
+    float sum = 0.f;
+    for (float ms : warm) {
+        sum += ms;
+    }
+    nlohmann::json warm_json;
+    warm_json["runs"] = warm.size();
+    if (warm.size() > 0) {
+        warm_json["mean_ms"] = sum / warm.size();
+        warm_json["min_ms"]  = warm.front();
+        warm_json["p50_ms"]  = percentile(warm, 50.f);
+        warm_json["p90_ms"]  = percentile(warm, 90.f);
+        warm_json["p99_ms"]  = percentile(warm, 99.f);
+        warm_json["max_ms"]  = warm.back();
+    }
+    json["warm"] = warm_json;
+    return json;
+}
+
+int main(int argc, const char* argv[]) {
+    BenchParams params;
+    parse_args(argc, argv, params);
+
+    sd_set_log_callback(sd_log_cb, (void*)&params);
+
+    ggml_backend_t backend = NULL;
+    if (params.random) {
+#ifdef SD_USE_CUBLAS
+        backend = ggml_backend_cuda_init(0);
+#endif
+#ifdef SD_USE_METAL
+        ggml_backend_metal_log_set_callback(ggml_log_callback_default, nullptr);
+        backend = ggml_backend_metal_init();
+#endif
+        if (!backend) {
+            backend = ggml_backend_cpu_init();
+        }
+    }
+
+    std::vector<BenchResult> results;
+    bool success = true;
+    for (sd_type_t wtype : params.wtypes) {
+        for (int n_threads : params.thread_counts) {
+            if (params.random) {
+                run_random_benchmarks(params, backend, wtype, n_threads, results);
+            } else if (!run_model_benchmarks(params, wtype, n_threads, results)) {
+                success = false;
+                break;
+            }
+        }
+    }
+    if (backend != NULL) {
+        ggml_backend_free(backend);
+    }
+
+    nlohmann::json output;
+    output["system_info"] = sd_get_system_info();
+    output["repeat"]      = params.repeat;
+    output["steps"]       = params.steps;
+    output["cfg_scale"]   = params.cfg_scale;
+    output["results"]     = nlohmann::json::array();
+    for (const BenchResult& result : results) {
+        output["results"].push_back(result_to_json(params, result));
+    }
+
+    std::string dump = output.dump(2);
+    if (params.output_path.size() > 0) {
+        std::ofstream file(params.output_path);
+        if (!file.is_open()) {
+            fprintf(stderr, "error: failed to open '%s'\n", params.output_path.c_str());
+            return 1;
+        }
+        file << dump << std::endl;
+    } else {
+        printf("%s\n", dump.c_str());
+    }
+    return success ? 0 : 1;
+}
@@ -36,6 +36,11 @@ const char* sample_method_str[] = {
     "dpm++2m",
     "dpm++2mv2",
     "lcm",
+    "unipc",
+    "dpm++3m_sde",
+    "deis",
+    "ipndm",
+    "dpm_adaptive",
 };
 
 // Names of the sigma schedule overrides, same order as sample_schedule in stable-diffusion.h
@@ -73,19 +78,27 @@ struct SDParams {
     std::string stacked_id_embeddings_path;
     std::string input_id_images_path;
     sd_type_t wtype = SD_TYPE_COUNT;
+    std::string tensor_type_rules;
+    std::string tensor_prefixes;
     std::string lora_model_dir;
     std::string output_path = "output.png";
     std::string input_path;
     std::string control_image_path;
+    std::string profile_path;
+    std::string profile_trace_path;
 
     std::string prompt;
     std::string negative_prompt;
-    float min_cfg     = 1.0f;
-    float cfg_scale   = 7.0f;
-    float style_ratio = 20.f;
-    int clip_skip     = -1;  // <= 0 represents unspecified
-    int width         = 512;
-    int height        = 512;
+    float min_cfg       = 1.0f;
+    float cfg_scale     = 7.0f;
+    float cfg_sigma_min = 0.f;
+    float cfg_sigma_max = 0.f;
+    float cfg_end       = 1.f;
+    int uncond_interval = 1;
+    float style_ratio   = 20.f;
+    int clip_skip       = -1;  // <= 0 represents unspecified
+    int width           = 512;
+    int height          = 512;
     int batch_count   = 1;
 
     int video_frames         = 6;
@@ -96,6 +109,8 @@ struct SDParams {
     sample_method_t sample_method = EULER_A;
     schedule_t schedule           = DEFAULT;
     int sample_steps              = 20;
+    float tolerance               = 0.05f;
+    int max_nfe                   = 0;
     float strength                = 0.75f;
     float control_strength        = 0.9f;
     rng_type_t rng_type           = CUDA_RNG;
@@ -106,6 +121,13 @@ struct SDParams {
     bool normalize_input          = false;
     bool clip_on_cpu              = false;
     bool vae_on_cpu               = false;
+    bool use_mmap                 = false;
+    int params_mem_budget_mb      = 0;
+    bool index_cache              = false;
+    bool batch_cfg                = false;
+    bool batch_generation         = false;
+    int deep_cache_interval       = 0;
+    int deep_cache_branch         = 0;
     bool canny_preprocess         = false;
     bool color                    = false;
     int upscale_repeats           = 1;
@@ -117,6 +139,8 @@ void print_params(SDParams params) {
     printf("    mode:              %s\n", modes_str[params.mode]);
     printf("    model_path:        %s\n", params.model_path.c_str());
     printf("    wtype:             %s\n", params.wtype < SD_TYPE_COUNT ? sd_type_name(params.wtype) : "unspecified");
+    printf("    tensor_type_rules: %s\n", params.tensor_type_rules.c_str());
+    printf("    tensor_prefixes:   %s\n", params.tensor_prefixes.c_str());
     printf("    vae_path:          %s\n", params.vae_path.c_str());
     printf("    taesd_path:        %s\n", params.taesd_path.c_str());
     printf("    esrgan_path:       %s\n", params.esrgan_path.c_str());
@@ -132,17 +156,30 @@ void print_params(SDParams params) {
     printf("    clip on cpu:       %s\n", params.clip_on_cpu ? "true" : "false");
     printf("    controlnet cpu:    %s\n", params.control_net_cpu ? "true" : "false");
     printf("    vae decoder on cpu:%s\n", params.vae_on_cpu ? "true" : "false");
+    printf("    use mmap:          %s\n", params.use_mmap ? "true" : "false");
+    printf("    params mem budget: %d MB\n", params.params_mem_budget_mb);
+    printf("    model index cache: %s\n", params.index_cache ? "true" : "false");
+    printf("    batch cfg:         %s\n", params.batch_cfg ? "true" : "false");
+    printf("    batch generation:  %s\n", params.batch_generation ? "true" : "false");
+    printf("    deep cache:        every %d steps, branch %d\n", params.deep_cache_interval, params.deep_cache_branch);
+    printf("    profile:           %s\n", params.profile_path.c_str());
+    printf("    profile trace:     %s\n", params.profile_trace_path.c_str());
     printf("    strength(control): %.2f\n", params.control_strength);
     printf("    prompt:            %s\n", params.prompt.c_str());
     printf("    negative_prompt:   %s\n", params.negative_prompt.c_str());
     printf("    min_cfg:           %.2f\n", params.min_cfg);
     printf("    cfg_scale:         %.2f\n", params.cfg_scale);
+    printf("    cfg_interval:      [%.2f, %.2f]\n", params.cfg_sigma_min, params.cfg_sigma_max);
+    printf("    cfg_end:           %.2f\n", params.cfg_end);
+    printf("    uncond_interval:   %d\n", params.uncond_interval);
     printf("    clip_skip:         %d\n", params.clip_skip);
     printf("    width:             %d\n", params.width);
     printf("    height:            %d\n", params.height);
     printf("    sample_method:     %s\n", sample_method_str[params.sample_method]);
     printf("    schedule:          %s\n", schedule_str[params.schedule]);
     printf("    sample_steps:      %d\n", params.sample_steps);
+    printf("    tolerance:         %.3f\n", params.tolerance);
+    printf("    max_nfe:           %d\n", params.max_nfe);
     printf("    strength(img2img): %.2f\n", params.strength);
     printf("    rng:               %s\n", rng_type_to_str[params.rng_type]);
     printf("    seed:              %ld\n", params.seed);
@@ -171,6 +208,10 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --upscale-repeats                  Run the ESRGAN upscaler this many times (default 1)\n");
     printf("  --type [TYPE]                      weight type (f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0)\n");
     printf("                                     If not specified, the default is the type of the weight file.\n");
+    printf("  --tensor-type-rules [RULES]        per tensor weight type for convert mode, comma separated pattern=type\n");
+    printf("                                     (regex searched in the tensor name, first match wins), e.g. \"first_stage_model=f16,attn=q4_K\"\n");
+    printf("  --tensor-prefixes [PREFIXES]       tensors to convert in convert mode, comma separated name prefixes\n");
+    printf("                                     ('-' leaves them out), e.g. \"first_stage_model.\" for the VAE only\n");
     printf("  --lora-model-dir [DIR]             lora model directory\n");
     printf("  -i, --init-img [IMAGE]             path to the input image, required by img2img\n");
     printf("  --control-image [IMAGE]            path to image condition, control net\n");
@@ -178,15 +219,22 @@ void print_usage(int argc, const char* argv[]) {
     printf("  -p, --prompt [PROMPT]              the prompt to render\n");
     printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
     printf("  --cfg-scale SCALE                  unconditional guidance scale: (default: 7.0)\n");
+    printf("  --cfg-sigma-min SIGMA              guidance only for sigmas >= SIGMA (with --cfg-sigma-max)\n");
+    printf("  --cfg-sigma-max SIGMA              guidance only for sigmas <= SIGMA (default: 0, all sigmas)\n");
+    printf("  --cfg-end FRACTION                 guidance only for the first FRACTION of the steps (default: 1.0)\n");
+    printf("  --uncond-interval N                compute the unconditional pass every N steps, reuse it in between (default: 1)\n");
     printf("  --strength STRENGTH                strength for noising/unnoising (default: 0.75)\n");
     printf("  --style-ratio STYLE-RATIO          strength for keeping input identity (default: 20%%)\n");
     printf("  --control-strength STRENGTH        strength to apply Control Net (default: 0.9)\n");
     printf("                                     1.0 corresponds to full destruction of information in init image\n");
     printf("  -H, --height H                     image height, in pixel space (default: 512)\n");
     printf("  -W, --width W                      image width, in pixel space (default: 512)\n");
-    printf("  --sampling-method {euler, euler_a, heun, dpm2, dpm++2s_a, dpm++2m, dpm++2mv2, lcm}\n");
+    printf("  --sampling-method {euler, euler_a, heun, dpm2, dpm++2s_a, dpm++2m, dpm++2mv2, lcm,\n");
+    printf("                                     unipc, dpm++3m_sde, deis, ipndm, dpm_adaptive}\n");
     printf("                                     sampling method (default: \"euler_a\")\n");
     printf("  --steps  STEPS                     number of sample steps (default: 20)\n");
+    printf("  --tolerance TOL                    dpm_adaptive: relative local error tolerance of a step (default: 0.05)\n");
+    printf("  --max-nfe N                        dpm_adaptive: max denoiser evaluations per image (default: 0, no limit)\n");
     printf("  --rng {std_default, cuda}          RNG (default: cuda)\n");
     printf("  -s SEED, --seed SEED               RNG seed (default: 42, use random seed for < 0)\n");
     printf("  -b, --batch-count COUNT            number of images to generate.\n");
@@ -196,6 +244,18 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --vae-tiling                       process vae in tiles to reduce memory usage\n");
     printf("  --control-net-cpu                  keep controlnet in cpu (for low vram)\n");
     printf("  --canny                            apply canny preprocessor (edge detection)\n");
+    printf("  --mmap                             memory-map the model file, CPU backend uses weights in place (no copy)\n");
+    printf("  --params-mem-budget MB             load clip/unet/vae weights on demand and evict the least recently used\n");
+    printf("                                     ones to stay within MB (default: 0, keep everything loaded)\n");
+    printf("  --index-cache                      cache the parsed tensor list of each model file in a <model>.sdindex file\n");
+    printf("  --batch-cfg                        run the conditional and unconditional passes of each step as one batch\n");
+    printf("  --batch-generation                 sample and decode the --batch-count images together (image i matches seed + i)\n");
+    printf("  --deep-cache N                     compute the full UNet every N steps, only its outer blocks in between\n");
+    printf("                                     on cached deep features (default: 0, full UNet on every step)\n");
+    printf("  --deep-cache-branch B              skip connection below which the UNet features are cached,\n");
+    printf("                                     0 is the outermost one and the fastest (default: 0)\n");
+    printf("  --profile FILE                     time every graph node, write a summary per step, module and op to FILE (JSON)\n");
+    printf("  --profile-trace FILE               time every graph node, write them to FILE in Chrome trace format\n");
     printf("  -v, --verbose                      print extra info\n");
 }
 
@@ -278,6 +338,30 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.input_id_images_path = argv[i];
+        } else if (arg == "--tensor-type-rules") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tensor_type_rules = argv[i];
+        } else if (arg == "--tensor-prefixes") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tensor_prefixes = argv[i];
+        } else if (arg == "--profile") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.profile_path = argv[i];
+        } else if (arg == "--profile-trace") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.profile_trace_path = argv[i];
         } else if (arg == "--type") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -355,6 +439,30 @@ void parse_args(int argc, const char** argv, SDParams& params) {
                 break;
             }
             params.cfg_scale = std::stof(argv[i]);
+        } else if (arg == "--cfg-sigma-min") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_sigma_min = std::stof(argv[i]);
+        } else if (arg == "--cfg-sigma-max") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_sigma_max = std::stof(argv[i]);
+        } else if (arg == "--cfg-end") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.cfg_end = std::stof(argv[i]);
+        } else if (arg == "--uncond-interval") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.uncond_interval = std::stoi(argv[i]);
         } else if (arg == "--strength") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -409,6 +517,44 @@ void parse_args(int argc, const char** argv, SDParams& params) {
             params.vae_on_cpu = true;  // will slow down latent decoding but necessary for low MEM GPUs
         } else if (arg == "--canny") {
             params.canny_preprocess = true;
+        } else if (arg == "--mmap") {
+            params.use_mmap = true;
+        } else if (arg == "--index-cache") {
+            params.index_cache = true;
+        } else if (arg == "--batch-cfg") {
+            params.batch_cfg = true;
+        } else if (arg == "--batch-generation") {
+            params.batch_generation = true;
+        } else if (arg == "--tolerance") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.tolerance = std::stof(argv[i]);
+        } else if (arg == "--max-nfe") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.max_nfe = std::stoi(argv[i]);
+        } else if (arg == "--deep-cache") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.deep_cache_interval = std::stoi(argv[i]);
+        } else if (arg == "--deep-cache-branch") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.deep_cache_branch = std::stoi(argv[i]);
+        } else if (arg == "--params-mem-budget") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.params_mem_budget_mb = std::stoi(argv[i]);
         } else if (arg == "-b" || arg == "--batch-count") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -627,6 +773,8 @@ int main(int argc, const char* argv[]) {
     parse_args(argc, argv, params);
 
     sd_set_log_callback(sd_log_cb, (void*)&params);
+    sd_set_model_index_cache(params.index_cache);
+    sd_set_profiling(params.profile_path.size() > 0 || params.profile_trace_path.size() > 0);
 
     if (params.verbose) {
         print_params(params);
@@ -634,7 +782,12 @@ int main(int argc, const char* argv[]) {
     }
 
     if (params.mode == CONVERT) {
-        bool success = convert(params.model_path.c_str(), params.vae_path.c_str(), params.output_path.c_str(), params.wtype);
+        bool success = convert(params.model_path.c_str(),
+                               params.vae_path.c_str(),
+                               params.output_path.c_str(),
+                               params.wtype,
+                               params.tensor_type_rules.c_str(),
+                               params.tensor_prefixes.empty() ? NULL : params.tensor_prefixes.c_str());
         if (!success) {
             fprintf(stderr,
                     "convert '%s'/'%s' to '%s' failed\n",
@@ -727,12 +880,19 @@ int main(int argc, const char* argv[]) {
                                   params.schedule,
                                   params.clip_on_cpu,
                                   params.control_net_cpu,
-                                  params.vae_on_cpu);
+                                  params.vae_on_cpu,
+                                  params.use_mmap,
+                                  (size_t)params.params_mem_budget_mb * 1024 * 1024,
+                                  params.batch_cfg,
+                                  params.batch_generation);
 
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
         return 1;
     }
+    sd_set_adaptive_sampling(sd_ctx, params.tolerance, params.max_nfe);
+    sd_set_cfg_schedule(sd_ctx, params.cfg_sigma_min, params.cfg_sigma_max, params.cfg_end, params.uncond_interval);
+    sd_set_deep_cache(sd_ctx, params.deep_cache_interval, params.deep_cache_branch);
 
     sd_image_t* control_image = NULL;
     if (params.controlnet_path.size() > 0 && params.control_image_path.size() > 0) {
@@ -887,6 +1047,12 @@ int main(int argc, const char* argv[]) {
         free(results[i].data);
         results[i].data = NULL;
     }
+    if (params.profile_path.size() > 0) {
+        sd_export_profile(params.profile_path.c_str(), false);
+    }
+    if (params.profile_trace_path.size() > 0) {
+        sd_export_profile(params.profile_trace_path.c_str(), true);
+    }
     free(results);
     free_sd_ctx(sd_ctx);
     free(control_image_buffer);
@@ -12,6 +12,7 @@
 #include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <set>
@@ -32,6 +33,7 @@
 #include "ggml-metal.h"
 #endif
 
+#include "profiler.h"
 #include "rng.hpp"
 #include "util.h"
 
@@ -56,6 +58,18 @@ __STATIC_INLINE__ void ggml_tensor_set_f32_randn(struct ggml_tensor* tensor, std
     }
 }
 
+// batch i (ne[3]) is drawn from rngs[i], so it gets the same numbers as a batch 1 tensor filled from rngs[i]
+__STATIC_INLINE__ void ggml_tensor_set_f32_randn(struct ggml_tensor* tensor, const std::vector<std::shared_ptr<RNG>>& rngs) {
+    GGML_ASSERT((int64_t)rngs.size() == tensor->ne[3]);
+    uint32_t n = (uint32_t)(ggml_nelements(tensor) / tensor->ne[3]);
+    for (size_t b = 0; b < rngs.size(); b++) {
+        std::vector<float> random_numbers = rngs[b]->randn(n);
+        for (uint32_t i = 0; i < n; i++) {
+            ggml_set_f32_1d(tensor, (int)(b * n + i), random_numbers[i]);
+        }
+    }
+}
+
 // set tensor[i, j, k, l]
 // set tensor[l]
 // set tensor[k, l]
@@ -219,7 +233,7 @@ __STATIC_INLINE__ float sigmoid(float x) {
 
 // SPECIAL OPERATIONS WITH TENSORS
 
-__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input) {
+__STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input, int idx = 0) {
     int64_t width    = input->ne[0];
     int64_t height   = input->ne[1];
     int64_t channels = input->ne[2];
@@ -228,7 +242,7 @@ __STATIC_INLINE__ uint8_t* sd_tensor_to_image(struct ggml_tensor* input) {
     for (int iy = 0; iy < height; iy++) {
         for (int ix = 0; ix < width; ix++) {
             for (int k = 0; k < channels; k++) {
-                float value                                               = ggml_tensor_get_f32(input, ix, iy, k);
+                float value                                               = ggml_tensor_get_f32(input, ix, iy, k, idx);
                 *(image_data + iy * width * channels + ix * channels + k) = (uint8_t)(value * 255.0f);
             }
         }
@@ -679,6 +693,38 @@ __STATIC_INLINE__ struct ggml_tensor* vector_to_ggml_tensor_i32(struct ggml_cont
     return t;
 }
 
+// Stacks tensors along their batch dim (ne[dim] and the dims above it must be 1), e.g. to
+// compute the cond and uncond inputs in one pass. Returns NULL if they can't be stacked.
+__STATIC_INLINE__ struct ggml_tensor* ggml_stack_batch(struct ggml_context* ctx,
+                                                       const std::vector<struct ggml_tensor*>& tensors,
+                                                       int dim) {
+    if (tensors.empty()) {
+        return NULL;
+    }
+    struct ggml_tensor* a = tensors[0];
+    for (struct ggml_tensor* b : tensors) {
+        if (b == NULL || a->type != b->type || !ggml_are_same_shape(a, b) || !ggml_is_contiguous(b)) {
+            return NULL;
+        }
+    }
+    for (int i = dim; i < GGML_MAX_DIMS; i++) {
+        if (a->ne[i] != 1) {
+            return NULL;
+        }
+    }
+    int64_t ne[GGML_MAX_DIMS];
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        ne[i] = a->ne[i];
+    }
+    ne[dim]               = (int64_t)tensors.size();
+    struct ggml_tensor* t = ggml_new_tensor(ctx, a->type, GGML_MAX_DIMS, ne);
+    size_t nbytes         = ggml_nbytes(a);
+    for (size_t i = 0; i < tensors.size(); i++) {
+        memcpy((char*)t->data + i * nbytes, tensors[i]->data, nbytes);
+    }
+    return t;
+}
+
 __STATIC_INLINE__ std::vector<float> arange(float start, float end, float step = 1.f) {
     std::vector<float> result;
 
@@ -764,6 +810,169 @@ __STATIC_INLINE__ size_t ggml_tensor_num(ggml_context* ctx) {
 #define MAX_PARAMS_TENSOR_NUM 15360
 #define MAX_GRAPH_SIZE 15360
 
+/*
+    Compute buffer shared by the GGMLModules of one backend that never compute at the
+    same time (text encoding, sampling, decoding): a single graph allocator whose buffer
+    grows to the largest graph, instead of one peak sized buffer per module.
+    The allocator lives while at least one module holds a lease on it.
+*/
+struct ComputeBufferPool {
+    ggml_backend_t backend      = NULL;
+    struct ggml_gallocr* allocr = NULL;
+    const void* owner           = NULL;  // module whose graph was allocated last
+    int n_leases                = 0;
+    uint64_t generation         = 0;  // changes whenever the buffer is reallocated
+
+    ComputeBufferPool(ggml_backend_t backend)
+        : backend(backend) {}
+
+    ~ComputeBufferPool() {
+        if (allocr != NULL) {
+            ggml_gallocr_free(allocr);
+        }
+    }
+
+    struct ggml_gallocr* lease() {
+        if (allocr == NULL) {
+            allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+        }
+        n_leases++;
+        return allocr;
+    }
+
+    void release() {
+        GGML_ASSERT(n_leases > 0);
+        if (--n_leases == 0) {
+            ggml_gallocr_free(allocr);
+            allocr = NULL;
+            owner  = NULL;
+            generation++;
+        }
+    }
+
+    bool reserve(const void* module, struct ggml_cgraph* gf) {
+        size_t buffer_size = ggml_gallocr_get_buffer_size(allocr, 0);
+        bool success       = ggml_gallocr_reserve(allocr, gf);
+        owner              = module;
+        if (ggml_gallocr_get_buffer_size(allocr, 0) != buffer_size) {
+            generation++;
+        }
+        return success;
+    }
+
+    // the layout of the last graph allocated by another module doesn't fit, so reserve first
+    bool alloc_graph(const void* module, struct ggml_cgraph* gf) {
+        if (owner != module && !reserve(module, gf)) {
+            return false;
+        }
+        size_t buffer_size = ggml_gallocr_get_buffer_size(allocr, 0);
+        bool success       = ggml_gallocr_alloc_graph(allocr, gf);
+        if (ggml_gallocr_get_buffer_size(allocr, 0) != buffer_size) {
+            generation++;
+        }
+        return success;
+    }
+};
+
+/*
+    Work memory of the generation requests (their work_ctx). The buffers are kept between
+    requests instead of being allocated and faulted in for every ggml_init, and are sized for
+    the largest request so far, so any later request can reuse them. A ggml context can't
+    grow: the size a caller asks for must cover everything it allocates in it. The most
+    memory a request used (high-water mark) is only reported, to check these estimates.
+    Several contexts can be out at once.
+*/
+class WorkArena {
+protected:
+    struct Block {
+        void* raw   = NULL;
+        void* data  = NULL;  // raw, aligned
+        size_t size = 0;
+        bool in_use = false;
+    };
+
+    std::mutex mutex;
+    std::vector<Block> blocks;
+    size_t max_request = 0;
+    size_t high_water  = 0;
+    int n_allocs       = 0;
+
+public:
+    ~WorkArena() {
+        for (Block& block : blocks) {
+            free(block.raw);
+        }
+    }
+
+    // a context of at least mem_size bytes, return it with release()
+    struct ggml_context* acquire(size_t mem_size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_request = std::max(max_request, mem_size);
+        mem_size    = max_request;
+
+        Block* block = NULL;
+        for (Block& b : blocks) {
+            if (!b.in_use && (block == NULL || b.size > block->size)) {
+                block = &b;
+            }
+        }
+        if (block == NULL) {
+            blocks.push_back(Block());
+            block = &blocks.back();
+        }
+        if (block->size < mem_size) {
+            const size_t alignment = 64;
+            free(block->raw);
+            block->raw  = malloc(mem_size + alignment);
+            block->data = NULL;
+            block->size = 0;
+            n_allocs++;
+            if (block->raw == NULL) {
+                LOG_ERROR("failed to allocate %.2fMB of work memory", mem_size / 1024.0 / 1024.0);
+                return NULL;
+            }
+            block->data = (void*)(((uintptr_t)block->raw + alignment - 1) & ~(uintptr_t)(alignment - 1));
+            block->size = mem_size;
+        }
+
+        struct ggml_init_params params;
+        params.mem_size   = block->size;
+        params.mem_buffer = block->data;
+        params.no_alloc   = false;
+
+        struct ggml_context* ctx = ggml_init(params);
+        if (ctx != NULL) {
+            block->in_use = true;
+        }
+        return ctx;
+    }
+
+    void release(struct ggml_context* ctx) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t used = ggml_used_mem(ctx);
+        void* data  = ggml_get_mem_buffer(ctx);
+        ggml_free(ctx);
+        high_water = std::max(high_water, used);
+        for (Block& block : blocks) {
+            if (block.data == data) {
+                block.in_use = false;
+            }
+        }
+        LOG_DEBUG("work memory: used %.2fMB, high-water mark %.2fMB", used / 1024.0 / 1024.0, high_water / 1024.0 / 1024.0);
+    }
+
+    size_t get_high_water() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return high_water;
+    }
+
+    // buffers allocated so far
+    int get_n_allocs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return n_allocs;
+    }
+};
+
 struct GGMLModule {
 protected:
     typedef std::function<struct ggml_cgraph*()> get_graph_cb_t;
@@ -773,8 +982,21 @@ protected:
 
     struct ggml_context* compute_ctx    = NULL;
     struct ggml_gallocr* compute_allocr = NULL;
+    std::shared_ptr<ComputeBufferPool> compute_buffer_pool;
 
     std::map<struct ggml_tensor*, const void*> backend_tensor_data_map;
+    std::map<struct ggml_tensor*, struct ggml_tensor*> backend_tensor_src_map;  // dst -> src in a device buffer
+
+    // graph kept by compute_cached() while its signature doesn't change
+    struct ggml_cgraph* cached_graph = NULL;
+    std::string cached_graph_signature;
+    uint64_t cached_graph_generation = 0;
+    std::vector<struct ggml_tensor*> graph_inputs;  // copies made by to_backend(), in call order
+    bool record_graph_inputs = false;
+
+    // for sd_metrics_t
+    size_t compute_buffer_peak  = 0;
+    int n_compute_buffer_allocs = 0;
 
     ggml_type wtype        = GGML_TYPE_F32;
     ggml_backend_t backend = NULL;
@@ -820,9 +1042,17 @@ protected:
         reset_compute_ctx();
         struct ggml_cgraph* gf = get_graph();
         backend_tensor_data_map.clear();
-        compute_allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+        backend_tensor_src_map.clear();
+        bool reserved = false;
+        if (compute_buffer_pool != NULL) {
+            compute_allocr = compute_buffer_pool->lease();
+            reserved       = compute_buffer_pool->reserve(this, gf);
+        } else {
+            compute_allocr = ggml_gallocr_new(ggml_backend_get_default_buffer_type(backend));
+            reserved       = ggml_gallocr_reserve(compute_allocr, gf);
+        }
 
-        if (!ggml_gallocr_reserve(compute_allocr, gf)) {
+        if (!reserved) {
             // failed to allocate the compute buffer
             LOG_ERROR("%s: failed to allocate the compute buffer\n", get_desc().c_str());
             free_compute_buffer();
@@ -831,6 +1061,8 @@ protected:
 
         // compute the required memory
         size_t compute_buffer_size = ggml_gallocr_get_buffer_size(compute_allocr, 0);
+        compute_buffer_peak        = std::max(compute_buffer_peak, compute_buffer_size);
+        n_compute_buffer_allocs++;
         LOG_DEBUG("%s compute buffer size: %.2f MB(%s)",
                   get_desc().c_str(),
                   compute_buffer_size / 1024.0 / 1024.0,
@@ -845,11 +1077,18 @@ protected:
 
             ggml_backend_tensor_set(tensor, data, 0, ggml_nbytes(tensor));
         }
+        for (auto& kv : backend_tensor_src_map) {
+            ggml_backend_tensor_copy(kv.second, kv.first);
+        }
 
         backend_tensor_data_map.clear();
+        backend_tensor_src_map.clear();
     }
 
 public:
+    // called at the start of compute(), lets the owner (re)load evicted params on demand
+    std::function<bool()> on_compute_begin;
+
     virtual std::string get_desc() = 0;
 
     GGMLModule(ggml_backend_t backend, ggml_type wtype = GGML_TYPE_F32)
@@ -865,13 +1104,23 @@ public:
     }
 
     void reset_compute_ctx() {
+        cached_graph = NULL;
         free_compute_ctx();
         alloc_compute_ctx();
     }
 
     bool alloc_params_buffer() {
-        size_t num_tensors = ggml_tensor_num(params_ctx);
-        params_buffer      = ggml_backend_alloc_ctx_tensors(params_ctx, backend);
+        size_t num_tensors = 0;
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+            if (t->data == NULL) {
+                num_tensors++;
+            }
+        }
+        if (num_tensors == 0) {
+            // every tensor is already backed by memory (e.g. mapped from the model file)
+            return true;
+        }
+        params_buffer = ggml_backend_alloc_ctx_tensors(params_ctx, backend);
         if (params_buffer == NULL) {
             LOG_ERROR("%s alloc params backend buffer failed", get_desc().c_str());
             return false;
@@ -887,11 +1136,31 @@ public:
 
     void free_params_buffer() {
         if (params_buffer != NULL) {
+            // detach the tensors, so the buffer can be allocated again later
+            for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+                if (t->buffer == params_buffer) {
+                    t->buffer = NULL;
+                    t->data   = NULL;
+                }
+            }
             ggml_backend_buffer_free(params_buffer);
             params_buffer = NULL;
         }
     }
 
+    struct ggml_context* get_params_ctx() {
+        return params_ctx;
+    }
+
+    bool params_allocated() {
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+            if (t->data == NULL) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     size_t get_params_buffer_size() {
         if (params_buffer != NULL) {
             return ggml_backend_buffer_get_size(params_buffer);
@@ -899,23 +1168,68 @@ public:
         return 0;
     }
 
+    // the largest compute buffer the module has used (shared with the other modules of a pool)
+    size_t get_compute_buffer_peak() { return compute_buffer_peak; }
+    int get_compute_buffer_allocs() { return n_compute_buffer_allocs; }
+
     void free_compute_buffer() {
+        cached_graph = NULL;
         if (compute_allocr != NULL) {
-            ggml_gallocr_free(compute_allocr);
+            if (compute_buffer_pool != NULL) {
+                compute_buffer_pool->release();
+            } else {
+                ggml_gallocr_free(compute_allocr);
+            }
             compute_allocr = NULL;
         }
     }
 
+    // modules sharing a pool must not compute at the same time
+    void set_compute_buffer_pool(std::shared_ptr<ComputeBufferPool> pool) {
+        free_compute_buffer();
+        compute_buffer_pool = pool;
+    }
+
+    ggml_backend_t get_backend() {
+        return backend;
+    }
+
     // do copy after alloc graph
     void set_backend_tensor_data(struct ggml_tensor* tensor, const void* data) {
         backend_tensor_data_map[tensor] = data;
     }
 
+    // tensor->data is a device pointer, e.g. the ControlNet controls
+    static bool is_device_tensor(struct ggml_tensor* tensor) {
+        return tensor->buffer != NULL && !ggml_backend_buffer_is_host(tensor->buffer);
+    }
+
+    // copy data from the host or from another backend tensor into a graph input
+    static void copy_input(struct ggml_tensor* dst, struct ggml_tensor* src) {
+        if (is_device_tensor(src)) {
+            ggml_backend_tensor_copy(src, dst);
+        } else {
+            ggml_backend_tensor_set(dst, src->data, 0, ggml_nbytes(src));
+        }
+    }
+
     struct ggml_tensor* to_backend(struct ggml_tensor* tensor) {
         GGML_ASSERT(compute_ctx != NULL);
         if (tensor == NULL) {
             return NULL;
         }
+        if (record_graph_inputs) {
+            // always copied into the compute buffer, so the graph can be reused with new input data
+            auto backend_tensor = ggml_dup_tensor(compute_ctx, tensor);
+
+            if (is_device_tensor(tensor)) {
+                backend_tensor_src_map[backend_tensor] = tensor;
+            } else {
+                set_backend_tensor_data(backend_tensor, tensor->data);
+            }
+            graph_inputs.push_back(backend_tensor);
+            return backend_tensor;
+        }
         // it's performing a compute, check if backend isn't cpu
         if (!ggml_backend_is_cpu(backend) && tensor->backend == GGML_BACKEND_TYPE_CPU) {
             // pass input tensors to gpu memory
@@ -928,16 +1242,115 @@ public:
         }
     }
 
-    void compute(get_graph_cb_t get_graph,
+    // shapes of the inputs, for compute_cached()
+    static std::string get_graph_signature(const std::vector<struct ggml_tensor*>& inputs) {
+        std::string signature;
+        for (auto input : inputs) {
+            if (input == NULL) {
+                signature += "-,";
+            } else {
+                signature += format("%s:%lldx%lldx%lldx%lld,", ggml_type_name(input->type),
+                                    (long long)input->ne[0], (long long)input->ne[1], (long long)input->ne[2], (long long)input->ne[3]);
+            }
+        }
+        return signature;
+    }
+
+    // returns false if the params are not available (see on_compute_begin)
+    bool compute(get_graph_cb_t get_graph,
                  int n_threads,
                  bool free_compute_buffer_immediately = true,
                  struct ggml_tensor** output          = NULL,
                  struct ggml_context* output_ctx      = NULL) {
+        if (!begin_compute()) {
+            return false;
+        }
+        struct ggml_cgraph* gf = build_compute_graph(get_graph);
+        run_compute_graph(gf, n_threads, output, output_ctx);
+
+        if (free_compute_buffer_immediately) {
+            free_compute_buffer();
+        }
+        return true;
+    }
+
+    // Like compute(), but the graph is only built and allocated again when the signature
+    // (the input shapes and anything else that changes the graph) differs from the last
+    // call. inputs are the tensors get_graph() passes to to_backend(), in the same order
+    // (NULL entries are skipped); a reused graph only gets their new data copied in.
+    // The compute buffer is kept, the graph is dropped with it.
+    bool compute_cached(const std::string& signature,
+                        const std::vector<struct ggml_tensor*>& inputs,
+                        get_graph_cb_t get_graph,
+                        int n_threads,
+                        struct ggml_tensor** output     = NULL,
+                        struct ggml_context* output_ctx = NULL) {
+        if (!begin_compute()) {
+            return false;
+        }
+        struct ggml_cgraph* gf = cached_graph;
+        if (compute_buffer_pool != NULL && compute_buffer_pool->generation != cached_graph_generation) {
+            // the shared buffer has been reallocated, the graph points to the old one
+            gf = NULL;
+        }
+        if (gf == NULL || signature != cached_graph_signature) {
+            auto get_recorded_graph = [&]() -> struct ggml_cgraph* {
+                graph_inputs.clear();
+                return get_graph();
+            };
+            record_graph_inputs = true;
+            gf                  = build_compute_graph(get_recorded_graph);
+            record_graph_inputs = false;
+
+            cached_graph           = gf;
+            cached_graph_signature = signature;
+            if (compute_buffer_pool != NULL) {
+                cached_graph_generation = compute_buffer_pool->generation;
+            }
+        } else {
+            size_t input_index = 0;
+            for (auto input : inputs) {
+                if (input == NULL) {
+                    continue;
+                }
+                GGML_ASSERT(input_index < graph_inputs.size());
+                copy_input(graph_inputs[input_index++], input);
+            }
+            GGML_ASSERT(input_index == graph_inputs.size());
+        }
+        run_compute_graph(gf, n_threads, output, output_ctx);
+        return true;
+    }
+
+protected:
+    bool begin_compute() {
+        if (on_compute_begin) {
+            if (!on_compute_begin()) {
+                LOG_ERROR("%s: params are not available", get_desc().c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    struct ggml_cgraph* build_compute_graph(get_graph_cb_t get_graph) {
         alloc_compute_buffer(get_graph);
         reset_compute_ctx();
         struct ggml_cgraph* gf = get_graph();
-        GGML_ASSERT(ggml_gallocr_alloc_graph(compute_allocr, gf));
+        if (compute_buffer_pool != NULL) {
+            GGML_ASSERT(compute_buffer_pool->alloc_graph(this, gf));
+        } else {
+            GGML_ASSERT(ggml_gallocr_alloc_graph(compute_allocr, gf));
+        }
+        compute_buffer_peak = std::max(compute_buffer_peak, ggml_gallocr_get_buffer_size(compute_allocr, 0));
         cpy_data_to_backend_tensor();
+        return gf;
+    }
+
+    void run_compute_graph(struct ggml_cgraph* gf,
+                           int n_threads,
+                           struct ggml_tensor** output,
+                           struct ggml_context* output_ctx) {
         if (ggml_backend_is_cpu(backend)) {
             ggml_backend_cpu_set_n_threads(backend, n_threads);
         }
@@ -947,11 +1360,19 @@ public:
             ggml_backend_metal_set_n_cb(backend, n_threads);
         }
 #endif
-        ggml_backend_graph_compute(backend, gf);
+        if (profiler_enabled()) {
+            // node by node, to time each of them
+            for (int i = 0; i < gf->n_nodes; i++) {
+                struct ggml_cgraph node_graph = ggml_graph_view(gf, i, i + 1);
+                int64_t t0                    = ggml_time_us();
+                ggml_backend_graph_compute(backend, &node_graph);
+                ggml_backend_synchronize(backend);
+                profiler_record(get_desc(), gf->nodes[i], t0, ggml_time_us() - t0);
+            }
+        } else {
+            ggml_backend_graph_compute(backend, gf);
+        }
 
-#ifdef GGML_PERF
-        ggml_graph_print(gf);
-#endif
         if (output != NULL) {
             auto result = gf->nodes[gf->n_nodes - 1];
             if (*output == NULL && output_ctx != NULL) {
@@ -961,10 +1382,6 @@ public:
                 ggml_backend_tensor_get_and_sync(backend, result, (*output)->data, 0, ggml_nbytes(*output));
             }
         }
-
-        if (free_compute_buffer_immediately) {
-            free_compute_buffer();
-        }
     }
 };
 
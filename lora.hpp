@@ -12,6 +12,8 @@ struct LoraModel : public GGMLModule {
     ModelLoader model_loader;
     bool load_failed = false;
     bool applied     = false;
+    // false when applying to a subset of the model tensors (e.g. a single lazily loaded module)
+    bool warn_unused_tensors = true;
 
     LoraModel(ggml_backend_t backend,
               ggml_type wtype,
@@ -68,48 +70,57 @@ struct LoraModel : public GGMLModule {
         return true;
     }
 
+    // the lora key of a model tensor name, or "" if the tensor has no lora_up/lora_down pair
+    std::string get_lora_key(const std::string& name) {
+        size_t k_pos = name.find(".weight");
+        if (k_pos == std::string::npos) {
+            return "";
+        }
+        std::string k_tensor = name.substr(0, k_pos);
+        replace_all_chars(k_tensor, '.', '_');
+        // LOG_DEBUG("k_tensor %s", k_tensor.c_str());
+        if (lora_tensors.find("lora." + k_tensor + ".lora_up.weight") == lora_tensors.end()) {
+            if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
+                // fix for some sdxl lora, like lcm-lora-xl
+                k_tensor = "model_diffusion_model_output_blocks_2_1_conv";
+            }
+        }
+        if (lora_tensors.find("lora." + k_tensor + ".lora_up.weight") == lora_tensors.end() ||
+            lora_tensors.find("lora." + k_tensor + ".lora_down.weight") == lora_tensors.end()) {
+            return "";
+        }
+        return k_tensor;
+    }
+
+    // names of the model tensors apply() modifies
+    std::set<std::string> get_target_tensors(const std::map<std::string, struct ggml_tensor*>& model_tensors) {
+        std::set<std::string> names;
+        for (auto& kv : model_tensors) {
+            if (get_lora_key(kv.first).size() > 0) {
+                names.insert(kv.first);
+            }
+        }
+        return names;
+    }
+
     struct ggml_cgraph* build_lora_graph(std::map<std::string, struct ggml_tensor*> model_tensors) {
         struct ggml_cgraph* gf = ggml_new_graph_custom(compute_ctx, LORA_GRAPH_SIZE, false);
 
         std::set<std::string> applied_lora_tensors;
         for (auto it : model_tensors) {
-            std::string k_tensor       = it.first;
+            std::string k_tensor       = get_lora_key(it.first);
             struct ggml_tensor* weight = model_tensors[it.first];
-
-            size_t k_pos = k_tensor.find(".weight");
-            if (k_pos == std::string::npos) {
+            if (k_tensor.size() == 0) {
                 continue;
             }
-            k_tensor = k_tensor.substr(0, k_pos);
-            replace_all_chars(k_tensor, '.', '_');
-            // LOG_DEBUG("k_tensor %s", k_tensor.c_str());
-            std::string lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-            if (lora_tensors.find(lora_up_name) == lora_tensors.end()) {
-                if (k_tensor == "model_diffusion_model_output_blocks_2_2_conv") {
-                    // fix for some sdxl lora, like lcm-lora-xl
-                    k_tensor     = "model_diffusion_model_output_blocks_2_1_conv";
-                    lora_up_name = "lora." + k_tensor + ".lora_up.weight";
-                }
-            }
 
+            std::string lora_up_name   = "lora." + k_tensor + ".lora_up.weight";
             std::string lora_down_name = "lora." + k_tensor + ".lora_down.weight";
             std::string alpha_name     = "lora." + k_tensor + ".alpha";
             std::string scale_name     = "lora." + k_tensor + ".scale";
 
-            ggml_tensor* lora_up   = NULL;
-            ggml_tensor* lora_down = NULL;
-
-            if (lora_tensors.find(lora_up_name) != lora_tensors.end()) {
-                lora_up = lora_tensors[lora_up_name];
-            }
-
-            if (lora_tensors.find(lora_down_name) != lora_tensors.end()) {
-                lora_down = lora_tensors[lora_down_name];
-            }
-
-            if (lora_up == NULL || lora_down == NULL) {
-                continue;
-            }
+            ggml_tensor* lora_up   = lora_tensors[lora_up_name];
+            ggml_tensor* lora_down = lora_tensors[lora_down_name];
 
             applied_lora_tensors.insert(lora_up_name);
             applied_lora_tensors.insert(lora_down_name);
@@ -159,7 +170,9 @@ struct LoraModel : public GGMLModule {
         for (auto& kv : lora_tensors) {
             total_lora_tensors_count++;
             if (applied_lora_tensors.find(kv.first) == applied_lora_tensors.end()) {
-                LOG_WARN("unused lora tensor %s", kv.first.c_str());
+                if (warn_unused_tensors) {
+                    LOG_WARN("unused lora tensor %s", kv.first.c_str());
+                }
             } else {
                 applied_lora_tensors_count++;
             }
@@ -167,7 +180,7 @@ struct LoraModel : public GGMLModule {
         /* Don't worry if this message shows up twice in the logs per LoRA,
          * this function is called once to calculate the required buffer size
          * and then again to actually generate a graph to be used */
-        if (applied_lora_tensors_count != total_lora_tensors_count) {
+        if (applied_lora_tensors_count != total_lora_tensors_count && warn_unused_tensors) {
             LOG_WARN("Only (%lu / %lu) LoRA tensors have been applied",
                      applied_lora_tensors_count, total_lora_tensors_count);
         } else {
@@ -178,11 +191,11 @@ struct LoraModel : public GGMLModule {
         return gf;
     }
 
-    void apply(std::map<std::string, struct ggml_tensor*> model_tensors, int n_threads) {
+    bool apply(std::map<std::string, struct ggml_tensor*> model_tensors, int n_threads) {
         auto get_graph = [&]() -> struct ggml_cgraph* {
             return build_lora_graph(model_tensors);
         };
-        GGMLModule::compute(get_graph, n_threads, true);
+        return GGMLModule::compute(get_graph, n_threads, true);
     }
 };
 
@@ -1,8 +1,13 @@
 #include <stdarg.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <fstream>
+#include <mutex>
 #include <regex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
@@ -207,7 +212,7 @@ std::string convert_vae_decoder_name(const std::string& name) {
 /* If not a SDXL LoRA the unet" prefix will have already been replaced by this
  * point and "te2" and "te1" don't seem to appear in non-SDXL only "te_" */
 std::string convert_sdxl_lora_name(std::string tensor_name) {
-    const std::pair<std::string, std::string> sdxl_lora_name_lookup[] = {
+    static const std::pair<std::string, std::string> sdxl_lora_name_lookup[] = {
         {"unet", "model_diffusion_model"},
         {"te2", "cond_stage_model_1_transformer"},
         {"te1", "cond_stage_model_transformer"},
@@ -216,7 +221,12 @@ std::string convert_sdxl_lora_name(std::string tensor_name) {
     };
     for (auto& pair_i : sdxl_lora_name_lookup) {
         if (tensor_name.compare(0, pair_i.first.length(), pair_i.first) == 0) {
-            tensor_name = std::regex_replace(tensor_name, std::regex(pair_i.first), pair_i.second);
+            // every occurrence is replaced, not only the prefix
+            size_t pos = 0;
+            while ((pos = tensor_name.find(pair_i.first, pos)) != std::string::npos) {
+                tensor_name.replace(pos, pair_i.first.length(), pair_i.second);
+                pos += pair_i.second.length();
+            }
             break;
         }
     }
@@ -271,28 +281,204 @@ std::unordered_map<std::string, std::unordered_map<std::string, std::string>> su
     },
 };
 
-std::string convert_diffusers_name_to_compvis(std::string key, char seq) {
-    std::vector<std::string> m;
+/* A diffusers name pattern, compiled once instead of building a std::regex for every
+ * tensor name. Syntax: '.' is the separator (like the former regex, it matches any
+ * character when the separator is '.'), "{n}" captures a number (\d+), "{*}" and "{+}"
+ * capture (.*) and (.+), "{a|b}" captures one of the alternatives. Matching backtracks
+ * greedily from left to right, so captures are the same as with std::regex_match. */
+class DiffusersNamePattern {
+    enum PartType {
+        LITERAL,
+        SEPARATOR,
+        NUMBER,
+        ANY,
+        NON_EMPTY,
+        ALTERNATIVES,
+    };
 
-    auto match = [](std::vector<std::string>& match_list, const std::regex& regex, const std::string& key) {
-        auto r = std::smatch{};
-        if (!std::regex_match(key, r, regex)) {
-            return false;
+    struct Part {
+        PartType type;
+        std::vector<std::string> texts;  // literal or alternatives
+    };
+
+    char seq;
+    std::string literal_prefix;
+    std::vector<Part> parts;
+
+    bool match_from(const std::string& key, size_t pos, size_t part_index, std::vector<std::string>& captures) const {
+        if (part_index == parts.size()) {
+            return pos == key.size();
         }
+        const Part& part = parts[part_index];
+        switch (part.type) {
+            case LITERAL: {
+                const std::string& text = part.texts[0];
+                if (key.compare(pos, text.size(), text) != 0) {
+                    return false;
+                }
+                return match_from(key, pos + text.size(), part_index + 1, captures);
+            }
+            case SEPARATOR: {
+                if (pos >= key.size() || (seq != '.' && key[pos] != seq)) {
+                    return false;
+                }
+                return match_from(key, pos + 1, part_index + 1, captures);
+            }
+            case NUMBER: {
+                size_t end = pos;
+                while (end < key.size() && key[end] >= '0' && key[end] <= '9') {
+                    end++;
+                }
+                for (; end > pos; end--) {
+                    captures.push_back(key.substr(pos, end - pos));
+                    if (match_from(key, end, part_index + 1, captures)) {
+                        return true;
+                    }
+                    captures.pop_back();
+                }
+                return false;
+            }
+            case ANY:
+            case NON_EMPTY: {
+                size_t min_end = pos + (part.type == NON_EMPTY ? 1 : 0);
+                for (size_t end = key.size(); end + 1 > min_end; end--) {
+                    captures.push_back(key.substr(pos, end - pos));
+                    if (match_from(key, end, part_index + 1, captures)) {
+                        return true;
+                    }
+                    captures.pop_back();
+                    if (end == 0) {
+                        break;
+                    }
+                }
+                return false;
+            }
+            case ALTERNATIVES: {
+                for (const std::string& text : part.texts) {
+                    if (key.compare(pos, text.size(), text) != 0) {
+                        continue;
+                    }
+                    captures.push_back(text);
+                    if (match_from(key, pos + text.size(), part_index + 1, captures)) {
+                        return true;
+                    }
+                    captures.pop_back();
+                }
+                return false;
+            }
+        }
+        return false;
+    }
 
-        match_list.clear();
-        for (size_t i = 1; i < r.size(); ++i) {
-            match_list.push_back(r.str(i));
+public:
+    DiffusersNamePattern(const std::string& pattern, char seq)
+        : seq(seq) {
+        size_t i = 0;
+        while (i < pattern.size()) {
+            char c = pattern[i];
+            if (c == '.') {
+                parts.push_back({SEPARATOR, {}});
+                i++;
+            } else if (c == '{') {
+                size_t end       = pattern.find('}', i);
+                std::string spec = pattern.substr(i + 1, end - i - 1);
+                if (spec == "n") {
+                    parts.push_back({NUMBER, {}});
+                } else if (spec == "*") {
+                    parts.push_back({ANY, {}});
+                } else if (spec == "+") {
+                    parts.push_back({NON_EMPTY, {}});
+                } else {
+                    Part part = {ALTERNATIVES, {}};
+                    std::stringstream ss(spec);
+                    std::string text;
+                    while (std::getline(ss, text, '|')) {
+                        part.texts.push_back(text);
+                    }
+                    parts.push_back(part);
+                }
+                i = end + 1;
+            } else {
+                if (parts.empty() || parts.back().type != LITERAL) {
+                    parts.push_back({LITERAL, {""}});
+                }
+                parts.back().texts[0] += c;
+                i++;
+            }
         }
-        return true;
-    };
+        if (!parts.empty() && parts[0].type == LITERAL) {
+            literal_prefix = parts[0].texts[0];
+        }
+    }
 
-    std::unordered_map<std::string, std::unordered_map<std::string, std::string>> suffix_conversion;
-    if (seq == '_') {
-        suffix_conversion = suffix_conversion_underline;
-    } else {
-        suffix_conversion = suffix_conversion_dot;
+    bool match(const std::string& key, std::vector<std::string>& captures) const {
+        if (!starts_with(key, literal_prefix)) {
+            return false;
+        }
+        captures.clear();
+        return match_from(key, 0, 0, captures);
+    }
+};
+
+enum DiffusersNameRule {
+    UNET_CONV_IN,
+    UNET_CONV_OUT,
+    UNET_CONV_NORM_OUT,
+    UNET_TIME_EMBEDDING,
+    UNET_DOWN_BLOCKS,
+    UNET_MID_BLOCK,
+    UNET_UP_BLOCKS,
+    UNET_DOWNSAMPLERS,
+    UNET_UPSAMPLERS,
+    TE_ENCODER_LAYERS,
+    TE_TEXT_MODEL,
+    VAE_CONV_NORM_OUT,
+    VAE_MID_BLOCK,
+    VAE_UP_BLOCKS_RESNETS,
+    VAE_DOWNSAMPLERS,
+    VAE_DOWN_BLOCKS_RESNETS,
+    VAE_UPSAMPLERS,
+    VAE_OTHERS,
+};
+
+// tried in order, the first match wins
+std::vector<std::pair<DiffusersNamePattern, DiffusersNameRule>> build_diffusers_name_patterns(char seq) {
+    const std::pair<const char*, DiffusersNameRule> patterns[] = {
+        // unet
+        {"unet.conv_in{*}", UNET_CONV_IN},
+        {"unet.conv.out{*}", UNET_CONV_OUT},
+        {"unet.conv_norm_out{*}", UNET_CONV_NORM_OUT},
+        {"unet.time_embedding.linear_{n}{*}", UNET_TIME_EMBEDDING},
+        {"unet.down_blocks.{n}.{attentions|resnets}.{n}.{+}", UNET_DOWN_BLOCKS},
+        {"unet.mid_block.{attentions|resnets}.{n}.{+}", UNET_MID_BLOCK},
+        {"unet.up_blocks.{n}.{attentions|resnets}.{n}.{+}", UNET_UP_BLOCKS},
+        {"unet.down_blocks.{n}.downsamplers.0.conv", UNET_DOWNSAMPLERS},
+        {"unet.up_blocks.{n}.upsamplers.0.conv", UNET_UPSAMPLERS},
+        // clip
+        {"te.text_model.encoder.layers.{n}.{+}", TE_ENCODER_LAYERS},
+        {"te.text_model{*}", TE_TEXT_MODEL},
+        // vae
+        {"vae.{*}.conv_norm_out{*}", VAE_CONV_NORM_OUT},
+        {"vae.{*}.mid_block.{attentions|resnets}.{n}.{+}", VAE_MID_BLOCK},
+        {"vae.{*}.up_blocks.{n}.resnets.{n}.{+}", VAE_UP_BLOCKS_RESNETS},
+        {"vae.{*}.down_blocks.{n}.downsamplers.0.conv", VAE_DOWNSAMPLERS},
+        {"vae.{*}.down_blocks.{n}.resnets.{n}.{+}", VAE_DOWN_BLOCKS_RESNETS},
+        {"vae.{*}.up_blocks.{n}.upsamplers.0.conv", VAE_UPSAMPLERS},
+        {"vae.{*}", VAE_OTHERS},
+    };
+    std::vector<std::pair<DiffusersNamePattern, DiffusersNameRule>> result;
+    for (auto& pattern : patterns) {
+        result.push_back({DiffusersNamePattern(pattern.first, seq), pattern.second});
     }
+    return result;
+}
+
+std::string convert_diffusers_name_to_compvis(std::string key, char seq) {
+    static const std::vector<std::pair<DiffusersNamePattern, DiffusersNameRule>> patterns_underline = build_diffusers_name_patterns('_');
+    static const std::vector<std::pair<DiffusersNamePattern, DiffusersNameRule>> patterns_dot       = build_diffusers_name_patterns('.');
+
+    const auto& patterns          = seq == '_' ? patterns_underline : patterns_dot;
+    const auto& suffix_conversion = seq == '_' ? suffix_conversion_underline : suffix_conversion_dot;
 
     auto get_converted_suffix = [&suffix_conversion](const std::string& outer_key, const std::string& inner_key) {
         auto outer_iter = suffix_conversion.find(outer_key);
@@ -310,109 +496,88 @@ std::string convert_diffusers_name_to_compvis(std::string key, char seq) {
         key += format("%c0", seq);
     }
 
-    // unet
-    if (match(m, std::regex(format("unet%cconv_in(.*)", seq)), key)) {
-        return format("model%cdiffusion_model%cinput_blocks%c0%c0", seq, seq, seq, seq) + m[0];
-    }
-
-    if (match(m, std::regex(format("unet%cconv%cout(.*)", seq, seq)), key)) {
-        return format("model%cdiffusion_model%cout%c2", seq, seq, seq) + m[0];
-    }
-
-    if (match(m, std::regex(format("unet%cconv_norm_out(.*)", seq)), key)) {
-        return format("model%cdiffusion_model%cout%c0", seq, seq, seq) + m[0];
-    }
-
-    if (match(m, std::regex(format("unet%ctime_embedding%clinear_(\\d+)(.*)", seq, seq)), key)) {
-        return format("model%cdiffusion_model%ctime_embed%c", seq, seq, seq) + std::to_string(std::stoi(m[0]) * 2 - 2) + m[1];
-    }
-
-    if (match(m, std::regex(format("unet%cdown_blocks%c(\\d+)%c(attentions|resnets)%c(\\d+)%c(.+)", seq, seq, seq, seq, seq)), key)) {
-        std::string suffix = get_converted_suffix(m[1], m[3]);
-        // LOG_DEBUG("%s %s %s %s", m[0].c_str(), m[1].c_str(), m[2].c_str(), m[3].c_str());
-        return format("model%cdiffusion_model%cinput_blocks%c", seq, seq, seq) + std::to_string(1 + std::stoi(m[0]) * 3 + std::stoi(m[2])) + seq +
-               (m[1] == "attentions" ? "1" : "0") + seq + suffix;
-    }
-
-    if (match(m, std::regex(format("unet%cmid_block%c(attentions|resnets)%c(\\d+)%c(.+)", seq, seq, seq, seq)), key)) {
-        std::string suffix = get_converted_suffix(m[0], m[2]);
-        return format("model%cdiffusion_model%cmiddle_block%c", seq, seq, seq) + (m[0] == "attentions" ? "1" : std::to_string(std::stoi(m[1]) * 2)) +
-               seq + suffix;
-    }
-
-    if (match(m, std::regex(format("unet%cup_blocks%c(\\d+)%c(attentions|resnets)%c(\\d+)%c(.+)", seq, seq, seq, seq, seq)), key)) {
-        std::string suffix = get_converted_suffix(m[1], m[3]);
-        return format("model%cdiffusion_model%coutput_blocks%c", seq, seq, seq) + std::to_string(std::stoi(m[0]) * 3 + std::stoi(m[2])) + seq +
-               (m[1] == "attentions" ? "1" : "0") + seq + suffix;
-    }
-
-    if (match(m, std::regex(format("unet%cdown_blocks%c(\\d+)%cdownsamplers%c0%cconv", seq, seq, seq, seq, seq)), key)) {
-        return format("model%cdiffusion_model%cinput_blocks%c", seq, seq, seq) + std::to_string(3 + std::stoi(m[0]) * 3) + seq + "0" + seq + "op";
-    }
-
-    if (match(m, std::regex(format("unet%cup_blocks%c(\\d+)%cupsamplers%c0%cconv", seq, seq, seq, seq, seq)), key)) {
-        return format("model%cdiffusion_model%coutput_blocks%c", seq, seq, seq) + std::to_string(2 + std::stoi(m[0]) * 3) + seq +
-               (std::stoi(m[0]) > 0 ? "2" : "1") + seq + "conv";
-    }
-
-    // clip
-    if (match(m, std::regex(format("te%ctext_model%cencoder%clayers%c(\\d+)%c(.+)", seq, seq, seq, seq, seq)), key)) {
-        return format("cond_stage_model%ctransformer%ctext_model%cencoder%clayers%c", seq, seq, seq, seq, seq) + m[0] + seq + m[1];
-    }
-
-    if (match(m, std::regex(format("te%ctext_model(.*)", seq)), key)) {
-        return format("cond_stage_model%ctransformer%ctext_model", seq, seq) + m[0];
-    }
-
-    // vae
-    if (match(m, std::regex(format("vae%c(.*)%cconv_norm_out(.*)", seq, seq)), key)) {
-        return format("first_stage_model%c%s%cnorm_out%s", seq, m[0].c_str(), seq, m[1].c_str());
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)%cmid_block%c(attentions|resnets)%c(\\d+)%c(.+)", seq, seq, seq, seq, seq)), key)) {
-        std::string suffix;
-        std::string block_name;
-        if (m[1] == "attentions") {
-            block_name = "attn";
-            suffix     = get_converted_suffix(m[1], m[3]);
-        } else {
-            block_name = "block";
-            suffix     = m[3];
-        }
-        return format("first_stage_model%c%s%cmid%c%s_%d%c%s",
-                      seq, m[0].c_str(), seq, seq, block_name.c_str(), std::stoi(m[2]) + 1, seq, suffix.c_str());
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)%cup_blocks%c(\\d+)%cresnets%c(\\d+)%c(.+)", seq, seq, seq, seq, seq, seq)), key)) {
-        std::string suffix = m[3];
-        if (suffix == "conv_shortcut") {
-            suffix = "nin_shortcut";
+    std::vector<std::string> m;
+    for (auto& pattern : patterns) {
+        if (!pattern.first.match(key, m)) {
+            continue;
         }
-        return format("first_stage_model%c%s%cup%c%d%cblock%c%s%c%s",
-                      seq, m[0].c_str(), seq, seq, 3 - std::stoi(m[1]), seq, seq, m[2].c_str(), seq, suffix.c_str());
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)%cdown_blocks%c(\\d+)%cdownsamplers%c0%cconv", seq, seq, seq, seq, seq, seq)), key)) {
-        return format("first_stage_model%c%s%cdown%c%d%cdownsample%cconv",
-                      seq, m[0].c_str(), seq, seq, std::stoi(m[1]), seq, seq);
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)%cdown_blocks%c(\\d+)%cresnets%c(\\d+)%c(.+)", seq, seq, seq, seq, seq, seq)), key)) {
-        std::string suffix = m[3];
-        if (suffix == "conv_shortcut") {
-            suffix = "nin_shortcut";
+        switch (pattern.second) {
+            // unet
+            case UNET_CONV_IN:
+                return format("model%cdiffusion_model%cinput_blocks%c0%c0", seq, seq, seq, seq) + m[0];
+            case UNET_CONV_OUT:
+                return format("model%cdiffusion_model%cout%c2", seq, seq, seq) + m[0];
+            case UNET_CONV_NORM_OUT:
+                return format("model%cdiffusion_model%cout%c0", seq, seq, seq) + m[0];
+            case UNET_TIME_EMBEDDING:
+                return format("model%cdiffusion_model%ctime_embed%c", seq, seq, seq) + std::to_string(std::stoi(m[0]) * 2 - 2) + m[1];
+            case UNET_DOWN_BLOCKS: {
+                std::string suffix = get_converted_suffix(m[1], m[3]);
+                // LOG_DEBUG("%s %s %s %s", m[0].c_str(), m[1].c_str(), m[2].c_str(), m[3].c_str());
+                return format("model%cdiffusion_model%cinput_blocks%c", seq, seq, seq) + std::to_string(1 + std::stoi(m[0]) * 3 + std::stoi(m[2])) + seq +
+                       (m[1] == "attentions" ? "1" : "0") + seq + suffix;
+            }
+            case UNET_MID_BLOCK: {
+                std::string suffix = get_converted_suffix(m[0], m[2]);
+                return format("model%cdiffusion_model%cmiddle_block%c", seq, seq, seq) + (m[0] == "attentions" ? "1" : std::to_string(std::stoi(m[1]) * 2)) +
+                       seq + suffix;
+            }
+            case UNET_UP_BLOCKS: {
+                std::string suffix = get_converted_suffix(m[1], m[3]);
+                return format("model%cdiffusion_model%coutput_blocks%c", seq, seq, seq) + std::to_string(std::stoi(m[0]) * 3 + std::stoi(m[2])) + seq +
+                       (m[1] == "attentions" ? "1" : "0") + seq + suffix;
+            }
+            case UNET_DOWNSAMPLERS:
+                return format("model%cdiffusion_model%cinput_blocks%c", seq, seq, seq) + std::to_string(3 + std::stoi(m[0]) * 3) + seq + "0" + seq + "op";
+            case UNET_UPSAMPLERS:
+                return format("model%cdiffusion_model%coutput_blocks%c", seq, seq, seq) + std::to_string(2 + std::stoi(m[0]) * 3) + seq +
+                       (std::stoi(m[0]) > 0 ? "2" : "1") + seq + "conv";
+            // clip
+            case TE_ENCODER_LAYERS:
+                return format("cond_stage_model%ctransformer%ctext_model%cencoder%clayers%c", seq, seq, seq, seq, seq) + m[0] + seq + m[1];
+            case TE_TEXT_MODEL:
+                return format("cond_stage_model%ctransformer%ctext_model", seq, seq) + m[0];
+            // vae
+            case VAE_CONV_NORM_OUT:
+                return format("first_stage_model%c%s%cnorm_out%s", seq, m[0].c_str(), seq, m[1].c_str());
+            case VAE_MID_BLOCK: {
+                std::string suffix;
+                std::string block_name;
+                if (m[1] == "attentions") {
+                    block_name = "attn";
+                    suffix     = get_converted_suffix(m[1], m[3]);
+                } else {
+                    block_name = "block";
+                    suffix     = m[3];
+                }
+                return format("first_stage_model%c%s%cmid%c%s_%d%c%s",
+                              seq, m[0].c_str(), seq, seq, block_name.c_str(), std::stoi(m[2]) + 1, seq, suffix.c_str());
+            }
+            case VAE_UP_BLOCKS_RESNETS: {
+                std::string suffix = m[3];
+                if (suffix == "conv_shortcut") {
+                    suffix = "nin_shortcut";
+                }
+                return format("first_stage_model%c%s%cup%c%d%cblock%c%s%c%s",
+                              seq, m[0].c_str(), seq, seq, 3 - std::stoi(m[1]), seq, seq, m[2].c_str(), seq, suffix.c_str());
+            }
+            case VAE_DOWNSAMPLERS:
+                return format("first_stage_model%c%s%cdown%c%d%cdownsample%cconv",
+                              seq, m[0].c_str(), seq, seq, std::stoi(m[1]), seq, seq);
+            case VAE_DOWN_BLOCKS_RESNETS: {
+                std::string suffix = m[3];
+                if (suffix == "conv_shortcut") {
+                    suffix = "nin_shortcut";
+                }
+                return format("first_stage_model%c%s%cdown%c%d%cblock%c%s%c%s",
+                              seq, m[0].c_str(), seq, seq, std::stoi(m[1]), seq, seq, m[2].c_str(), seq, suffix.c_str());
+            }
+            case VAE_UPSAMPLERS:
+                return format("first_stage_model%c%s%cup%c%d%cupsample%cconv",
+                              seq, m[0].c_str(), seq, seq, 3 - std::stoi(m[1]), seq, seq);
+            case VAE_OTHERS:
+                return format("first_stage_model%c", seq) + m[0];
         }
-        return format("first_stage_model%c%s%cdown%c%d%cblock%c%s%c%s",
-                      seq, m[0].c_str(), seq, seq, std::stoi(m[1]), seq, seq, m[2].c_str(), seq, suffix.c_str());
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)%cup_blocks%c(\\d+)%cupsamplers%c0%cconv", seq, seq, seq, seq, seq, seq)), key)) {
-        return format("first_stage_model%c%s%cup%c%d%cupsample%cconv",
-                      seq, m[0].c_str(), seq, seq, 3 - std::stoi(m[1]), seq, seq);
-    }
-
-    if (match(m, std::regex(format("vae%c(.*)", seq)), key)) {
-        return format("first_stage_model%c", seq) + m[0];
     }
 
     return key;
@@ -557,12 +722,12 @@ void bf16_to_f32_vec(uint16_t* src, float* dst, int64_t n) {
     }
 }
 
-void convert_tensor(void* src,
-                    ggml_type src_type,
-                    void* dst,
-                    ggml_type dst_type,
-                    int nrows,
-                    int n_per_row) {
+void convert_tensor_rows(void* src,
+                         ggml_type src_type,
+                         void* dst,
+                         ggml_type dst_type,
+                         int nrows,
+                         int n_per_row) {
     int n = nrows * n_per_row;
     if (src_type == dst_type) {
         size_t nbytes = n * ggml_type_size(src_type) / ggml_blck_size(src_type);
@@ -610,6 +775,54 @@ void convert_tensor(void* src,
     }
 }
 
+// rows are independent, so big tensors are split into row ranges converted by n_threads threads
+void convert_tensor(void* src,
+                    ggml_type src_type,
+                    void* dst,
+                    ggml_type dst_type,
+                    int nrows,
+                    int n_per_row,
+                    int n_threads = 1) {
+    const int64_t min_elements_per_thread = 64 * 1024;
+    n_threads                             = std::min(n_threads, nrows);
+    n_threads                             = (int)std::min<int64_t>(n_threads, (int64_t)nrows * n_per_row / min_elements_per_thread);
+    if (n_threads <= 1 || src_type == dst_type) {
+        convert_tensor_rows(src, src_type, dst, dst_type, nrows, n_per_row);
+        return;
+    }
+
+    size_t src_row_size = n_per_row * ggml_type_size(src_type) / ggml_blck_size(src_type);
+    size_t dst_row_size = n_per_row * ggml_type_size(dst_type) / ggml_blck_size(dst_type);
+    int rows_per_thread = (nrows + n_threads - 1) / n_threads;
+
+    std::vector<std::thread> workers;
+    std::vector<std::string> errors(n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        int row_start = i * rows_per_thread;
+        int row_count = std::min(rows_per_thread, nrows - row_start);
+        if (row_count <= 0) {
+            break;
+        }
+        workers.emplace_back([=, &errors]() {
+            try {
+                convert_tensor_rows((char*)src + row_start * src_row_size, src_type,
+                                    (char*)dst + row_start * dst_row_size, dst_type,
+                                    row_count, n_per_row);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    for (auto& error : errors) {
+        if (error.size() > 0) {
+            throw std::runtime_error(error);
+        }
+    }
+}
+
 /*================================================= ModelLoader ==================================================*/
 
 // ported from https://github.com/openai/CLIP/blob/main/clip/simple_tokenizer.py#L16
@@ -724,23 +937,281 @@ bool is_safetensors_file(const std::string& file_path) {
     return true;
 }
 
+/*================================================= Model Index Cache ==================================================*/
+
+// Sidecar "<model path>.sdindex" with the processed tensor storages of a model file,
+// valid as long as path, size and mtime of every file it was built from are unchanged.
+
+#define SD_MODEL_INDEX_MAGIC "SDIX"
+#define SD_MODEL_INDEX_VERSION 1  // bump when tensor name conversion/preprocessing changes
+
+static bool model_index_cache_enabled = false;
+
+void sd_set_model_index_cache(bool enable) {
+    model_index_cache_enabled = enable;
+}
+
+std::string get_model_index_path(const std::string& file_path) {
+    std::string path = file_path;
+    while (path.size() > 1 && (path.back() == '/' || path.back() == '\\')) {
+        path.pop_back();
+    }
+    return path + ".sdindex";
+}
+
+static void write_index_u64(std::ofstream& file, uint64_t value) {
+    file.write((const char*)&value, sizeof(value));
+}
+
+static void write_index_str(std::ofstream& file, const std::string& value) {
+    write_index_u64(file, value.size());
+    file.write(value.data(), value.size());
+}
+
+static bool read_index_u64(std::ifstream& file, uint64_t& value) {
+    file.read((char*)&value, sizeof(value));
+    return (bool)file;
+}
+
+static bool read_index_str(std::ifstream& file, std::string& value) {
+    uint64_t size = 0;
+    if (!read_index_u64(file, size) || size > 64 * 1024) {
+        return false;
+    }
+    value.resize(size);
+    file.read(&value[0], size);
+    return (bool)file;
+}
+
+bool ModelLoader::load_model_index(const std::string& file_path, const std::string& prefix) {
+    std::string index_path = get_model_index_path(file_path);
+    std::ifstream file(index_path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    char magic[4];
+    file.read(magic, sizeof(magic));
+    uint64_t version = 0;
+    std::string index_prefix;
+    if (!file || memcmp(magic, SD_MODEL_INDEX_MAGIC, sizeof(magic)) != 0 ||
+        !read_index_u64(file, version) || version != SD_MODEL_INDEX_VERSION ||
+        !read_index_str(file, index_prefix) || index_prefix != prefix) {
+        return false;
+    }
+
+    uint64_t n_files = 0;
+    if (!read_index_u64(file, n_files)) {
+        return false;
+    }
+    std::vector<std::string> index_file_paths;
+    for (uint64_t i = 0; i < n_files; i++) {
+        std::string path;
+        uint64_t size  = 0;
+        uint64_t mtime = 0;
+        if (!read_index_str(file, path) || !read_index_u64(file, size) || !read_index_u64(file, mtime)) {
+            return false;
+        }
+        size_t curr_size  = 0;
+        int64_t curr_mtime = 0;
+        if (!get_file_stat(path, curr_size, curr_mtime) || curr_size != size || (uint64_t)curr_mtime != mtime) {
+            LOG_DEBUG("model index '%s' is stale", index_path.c_str());
+            return false;
+        }
+        index_file_paths.push_back(path);
+    }
+
+    uint64_t n_tensors = 0;
+    if (!read_index_u64(file, n_tensors)) {
+        return false;
+    }
+    size_t file_index_begin = file_paths_.size();
+    std::vector<TensorStorage> index_tensor_storages(n_tensors);
+    for (auto& tensor_storage : index_tensor_storages) {
+        uint64_t type, is_bf16, n_dims, file_index, index_in_zip, offset;
+        if (!read_index_str(file, tensor_storage.name) ||
+            !read_index_u64(file, type) ||
+            !read_index_u64(file, is_bf16) ||
+            !read_index_u64(file, n_dims) ||
+            !read_index_u64(file, file_index) ||
+            !read_index_u64(file, index_in_zip) ||
+            !read_index_u64(file, offset)) {
+            return false;
+        }
+        for (int i = 0; i < SD_MAX_DIMS; i++) {
+            uint64_t ne;
+            if (!read_index_u64(file, ne)) {
+                return false;
+            }
+            tensor_storage.ne[i] = (int64_t)ne;
+        }
+        if (type >= GGML_TYPE_COUNT || n_dims > SD_MAX_DIMS || file_index >= n_files) {
+            return false;
+        }
+        tensor_storage.type         = (ggml_type)type;
+        tensor_storage.is_bf16      = is_bf16 != 0;
+        tensor_storage.n_dims       = (int)n_dims;
+        tensor_storage.file_index   = file_index_begin + file_index;
+        tensor_storage.index_in_zip = (int)(int64_t)index_in_zip;
+        tensor_storage.offset       = offset;
+    }
+
+    file_paths_.insert(file_paths_.end(), index_file_paths.begin(), index_file_paths.end());
+    tensor_storages.insert(tensor_storages.end(), index_tensor_storages.begin(), index_tensor_storages.end());
+    LOG_INFO("load %s using model index '%s' (%d tensors)", file_path.c_str(), index_path.c_str(), (int)n_tensors);
+    return true;
+}
+
+bool ModelLoader::save_model_index(const std::string& file_path,
+                                   const std::string& prefix,
+                                   size_t file_index_begin,
+                                   size_t storage_index_begin) {
+    std::string index_path = get_model_index_path(file_path);
+    std::string tmp_path   = index_path + ".tmp";
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        LOG_DEBUG("can not write model index '%s'", index_path.c_str());
+        return false;
+    }
+
+    file.write(SD_MODEL_INDEX_MAGIC, 4);
+    write_index_u64(file, SD_MODEL_INDEX_VERSION);
+    write_index_str(file, prefix);
+
+    write_index_u64(file, file_paths_.size() - file_index_begin);
+    for (size_t i = file_index_begin; i < file_paths_.size(); i++) {
+        size_t size   = 0;
+        int64_t mtime = 0;
+        if (!get_file_stat(file_paths_[i], size, mtime)) {
+            file.close();
+            remove(tmp_path.c_str());
+            return false;
+        }
+        write_index_str(file, file_paths_[i]);
+        write_index_u64(file, size);
+        write_index_u64(file, (uint64_t)mtime);
+    }
+
+    write_index_u64(file, tensor_storages.size() - storage_index_begin);
+    for (size_t i = storage_index_begin; i < tensor_storages.size(); i++) {
+        const TensorStorage& tensor_storage = tensor_storages[i];
+        write_index_str(file, tensor_storage.name);
+        write_index_u64(file, (uint64_t)tensor_storage.type);
+        write_index_u64(file, tensor_storage.is_bf16 ? 1 : 0);
+        write_index_u64(file, (uint64_t)tensor_storage.n_dims);
+        write_index_u64(file, tensor_storage.file_index - file_index_begin);
+        write_index_u64(file, (uint64_t)(int64_t)tensor_storage.index_in_zip);
+        write_index_u64(file, tensor_storage.offset);
+        for (int j = 0; j < SD_MAX_DIMS; j++) {
+            write_index_u64(file, (uint64_t)tensor_storage.ne[j]);
+        }
+    }
+    file.close();
+    if (!file) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    // replace atomically, concurrent workers may read the index at the same time
+    remove(index_path.c_str());
+    if (rename(tmp_path.c_str(), index_path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    LOG_DEBUG("model index saved to '%s'", index_path.c_str());
+    return true;
+}
+
 bool ModelLoader::init_from_file(const std::string& file_path, const std::string& prefix) {
+    size_t file_index_begin    = file_paths_.size();
+    size_t storage_index_begin = tensor_storages.size();
+
+    if (model_index_cache_enabled && load_model_index(file_path, prefix)) {
+        apply_tensor_prefixes(file_path, storage_index_begin);
+        return true;
+    }
+
+    bool success = false;
     if (is_directory(file_path)) {
         LOG_INFO("load %s using diffusers format", file_path.c_str());
-        return init_from_diffusers_file(file_path, prefix);
+        success = init_from_diffusers_file(file_path, prefix);
     } else if (is_gguf_file(file_path)) {
         LOG_INFO("load %s using gguf format", file_path.c_str());
-        return init_from_gguf_file(file_path, prefix);
+        success = init_from_gguf_file(file_path, prefix);
     } else if (is_safetensors_file(file_path)) {
         LOG_INFO("load %s using safetensors format", file_path.c_str());
-        return init_from_safetensors_file(file_path, prefix);
+        success = init_from_safetensors_file(file_path, prefix);
     } else if (is_zip_file(file_path)) {
         LOG_INFO("load %s using checkpoint format", file_path.c_str());
-        return init_from_ckpt_file(file_path, prefix);
+        success = init_from_ckpt_file(file_path, prefix);
     } else {
         LOG_WARN("unknown format %s", file_path.c_str());
         return false;
     }
+    if (!success) {
+        return false;
+    }
+
+    // name conversion and splitting only depend on the tensor itself, do it once here
+    std::vector<TensorStorage> processed_tensor_storages;
+    for (size_t i = storage_index_begin; i < tensor_storages.size(); i++) {
+        if (is_unused_tensor(tensor_storages[i].name)) {
+            continue;
+        }
+        preprocess_tensor(tensor_storages[i], processed_tensor_storages);
+    }
+    tensor_storages.resize(storage_index_begin);
+    tensor_storages.insert(tensor_storages.end(), processed_tensor_storages.begin(), processed_tensor_storages.end());
+
+    if (model_index_cache_enabled) {
+        save_model_index(file_path, prefix, file_index_begin, storage_index_begin);
+    }
+    apply_tensor_prefixes(file_path, storage_index_begin);
+    return true;
+}
+
+void ModelLoader::set_tensor_prefixes_from_string(const std::string& prefixes) {
+    tensor_prefixes.clear();
+    excluded_tensor_prefixes.clear();
+    std::stringstream ss(prefixes);
+    std::string prefix;
+    while (std::getline(ss, prefix, ',')) {
+        prefix = trim(prefix);
+        if (prefix.size() == 0) {
+            continue;
+        }
+        if (prefix[0] == '-') {
+            excluded_tensor_prefixes.push_back(prefix.substr(1));
+        } else {
+            tensor_prefixes.push_back(prefix);
+        }
+    }
+}
+
+void ModelLoader::apply_tensor_prefixes(const std::string& file_path, size_t storage_index_begin) {
+    if (tensor_prefixes.empty() && excluded_tensor_prefixes.empty()) {
+        return;
+    }
+    size_t n_tensors = tensor_storages.size() - storage_index_begin;
+    auto is_excluded = [this](const TensorStorage& tensor_storage) {
+        for (auto& tensor_prefix : excluded_tensor_prefixes) {
+            if (starts_with(tensor_storage.name, tensor_prefix)) {
+                return true;
+            }
+        }
+        if (tensor_prefixes.empty()) {
+            return false;
+        }
+        for (auto& tensor_prefix : tensor_prefixes) {
+            if (starts_with(tensor_storage.name, tensor_prefix)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    tensor_storages.erase(std::remove_if(tensor_storages.begin() + storage_index_begin, tensor_storages.end(), is_excluded),
+                          tensor_storages.end());
+    LOG_DEBUG("using %d of %d tensors from '%s'",
+              (int)(tensor_storages.size() - storage_index_begin), (int)n_tensors, file_path.c_str());
 }
 
 /*================================================= GGUFModelLoader ==================================================*/
@@ -1353,31 +1824,72 @@ std::vector<TensorStorage> remove_duplicates(const std::vector<TensorStorage>& v
     return res;
 }
 
-bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend) {
-    std::vector<TensorStorage> processed_tensor_storages;
-    for (auto& tensor_storage : tensor_storages) {
-        // LOG_DEBUG("%s", name.c_str());
-
-        if (is_unused_tensor(tensor_storage.name)) {
-            continue;
+std::vector<std::string> get_tensor_prefixes(const std::map<std::string, struct ggml_tensor*>& tensors) {
+    std::vector<std::string> tensor_prefixes;
+    for (auto& pair : tensors) {
+        std::string tensor_prefix = pair.first.substr(0, pair.first.find('.') + 1);
+        if (std::find(tensor_prefixes.begin(), tensor_prefixes.end(), tensor_prefix) == tensor_prefixes.end()) {
+            tensor_prefixes.push_back(tensor_prefix);
         }
+    }
+    return tensor_prefixes;
+}
+
+std::shared_ptr<ModelFileMapping> ModelLoader::get_file_mapping(size_t file_index) {
+    if (file_mappings.size() < file_paths_.size()) {
+        file_mappings.resize(file_paths_.size());
+    }
+    if (file_mappings[file_index] != NULL) {
+        return file_mappings[file_index];
+    }
+    const std::string& file_path = file_paths_[file_index];
+    auto mapping                 = std::make_shared<ModelFileMapping>();
+    if (!mapping->file.open(file_path)) {
+        LOG_WARN("failed to mmap '%s', falling back to regular reads", file_path.c_str());
+        return NULL;
+    }
+    mapping->buffer = ggml_backend_cpu_buffer_from_ptr(mapping->file.data(), mapping->file.size());
+    if (mapping->buffer == NULL) {
+        LOG_WARN("failed to create backend buffer for '%s', falling back to regular reads", file_path.c_str());
+        return NULL;
+    }
+    file_mappings[file_index] = mapping;
+    return mapping;
+}
 
-        preprocess_tensor(tensor_storage, processed_tensor_storages);
+std::vector<std::shared_ptr<ModelFileMapping>> ModelLoader::get_file_mappings() {
+    std::vector<std::shared_ptr<ModelFileMapping>> mappings;
+    for (auto& mapping : file_mappings) {
+        if (mapping != NULL) {
+            mappings.push_back(mapping);
+        }
     }
-    std::vector<TensorStorage> dedup = remove_duplicates(processed_tensor_storages);
-    processed_tensor_storages        = dedup;
+    return mappings;
+}
+
+/* The alignment the CPU kernels need to use tensor data in place: the largest power of two
+ * dividing the element (or block) size. Every element of a contiguous array starting at such
+ * an address is then aligned for the fields of its type (e.g. the ggml_half scale of a
+ * quantized block only needs 2 bytes), unlike the backend buffer alignment. */
+static size_t get_type_alignment(ggml_type type) {
+    size_t type_size = ggml_type_size(type);
+    return type_size & (~type_size + 1);
+}
+
+bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend, on_tensor_loaded_cb_t on_tensor_loaded_cb) {
+    // tensor_storages are already preprocessed by init_from_file
+    std::vector<TensorStorage> processed_tensor_storages = remove_duplicates(tensor_storages);
+
+    bool can_bind_to_mmap = backend == NULL || ggml_backend_is_cpu(backend);
+    size_t mapped_size    = 0;
+    int mapped_count      = 0;
+    int copied_count      = 0;
 
     bool success = true;
     for (size_t file_index = 0; file_index < file_paths_.size(); file_index++) {
         std::string file_path = file_paths_[file_index];
         LOG_DEBUG("loading tensors from %s", file_path.c_str());
 
-        std::ifstream file(file_path, std::ios::binary);
-        if (!file.is_open()) {
-            LOG_ERROR("failed to open '%s'", file_path.c_str());
-            return false;
-        }
-
         bool is_zip = false;
         for (auto& tensor_storage : tensor_storages) {
             if (tensor_storage.file_index != file_index) {
@@ -1398,32 +1910,21 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
             }
         }
 
-        std::vector<uint8_t> read_buffer;
-        std::vector<uint8_t> convert_buffer;
+        std::shared_ptr<ModelFileMapping> mapping = NULL;
+        if (use_mmap && zip == NULL) {
+            mapping = get_file_mapping(file_index);
+        }
 
-        auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
-            if (zip != NULL) {
-                zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
-                size_t entry_size = zip_entry_size(zip);
-                if (entry_size != n) {
-                    read_buffer.resize(entry_size);
-                    zip_entry_noallocread(zip, (void*)read_buffer.data(), entry_size);
-                    memcpy((void*)buf, (void*)(read_buffer.data() + tensor_storage.offset), n);
-                } else {
-                    zip_entry_noallocread(zip, (void*)buf, n);
-                }
-                zip_entry_close(zip);
-            } else {
-                file.seekg(tensor_storage.offset);
-                file.read(buf, n);
-                if (!file) {
-                    LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
-                    return false;
-                }
+        // returns the tensor data inside the mapping, or NULL if it has to be read
+        auto mapped_data = [&](const TensorStorage& tensor_storage, size_t n) -> uint8_t* {
+            if (mapping == NULL || tensor_storage.offset + n > mapping->file.size()) {
+                return NULL;
             }
-            return true;
+            return mapping->file.data() + tensor_storage.offset;
         };
 
+        // the callback is not required to be thread safe, so resolve all destination tensors first
+        std::vector<std::pair<const TensorStorage*, ggml_tensor*>> load_jobs;
         for (auto& tensor_storage : processed_tensor_storages) {
             if (tensor_storage.file_index != file_index) {
                 continue;
@@ -1440,61 +1941,254 @@ bool ModelLoader::load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend
                 continue;
             }
 
-            size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+            if (mapping != NULL && dst_tensor->buffer == mapping->buffer) {
+                // already bound into the mapping by a previous pass, loading it would copy it onto itself
+                continue;
+            }
+
+            if (use_mmap && bind_to_mmap && on_tensor_loaded_cb == nullptr) {
+                if (dst_tensor->data == NULL && dst_tensor->buffer == NULL) {
+                    size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+                    uint8_t* src          = mapped_data(tensor_storage, nbytes_to_read);
+                    if (can_bind_to_mmap && src != NULL &&
+                        tensor_storage.type == dst_tensor->type &&
+                        !tensor_storage.is_bf16 &&
+                        dst_tensor->view_src == NULL &&
+                        ggml_nbytes(dst_tensor) == tensor_storage.nbytes() &&
+                        (uintptr_t)src % get_type_alignment(dst_tensor->type) == 0) {
+                        ggml_backend_tensor_alloc(mapping->buffer, dst_tensor, src);
+                        mapped_size += nbytes_to_read;
+                        mapped_count++;
+                    } else {
+                        // the caller allocates it and loads it in the next pass
+                        copied_count++;
+                    }
+                    continue;
+                }
+            }
+
+            if (on_tensor_loaded_cb == nullptr && dst_tensor->data == NULL) {
+                // not allocated (e.g. lazily loaded params), nothing to load into
+                continue;
+            }
 
-            if (dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer)) {
-                // for the CPU and Metal backend, we can copy directly into the tensor
-                if (tensor_storage.type == dst_tensor->type) {
-                    GGML_ASSERT(ggml_nbytes(dst_tensor) == tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)dst_tensor->data, nbytes_to_read);
+            load_jobs.push_back(std::make_pair(&tensor_storage, dst_tensor));
+        }
 
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements());
+        // zip entries can only be read sequentially
+        int n_workers = zip != NULL ? 1 : std::max(1, std::min(n_threads, (int)load_jobs.size()));
+        // threads left over (e.g. for zip files) are used to convert the rows of a tensor in parallel
+        int n_convert_threads = std::max(1, n_threads / n_workers);
+        if (n_workers > 1) {
+            // largest first, so one huge tensor doesn't end up alone at the end
+            std::stable_sort(load_jobs.begin(), load_jobs.end(),
+                             [](const std::pair<const TensorStorage*, ggml_tensor*>& a,
+                                const std::pair<const TensorStorage*, ggml_tensor*>& b) {
+                                 return a.first->nbytes() > b.first->nbytes();
+                             });
+        }
+        std::atomic<size_t> next_job(0);
+        std::atomic<bool> failed(!success);
+
+        // uploads to device buffers run on their own thread, overlapping the reads
+        std::unique_ptr<TensorUploader> uploader;
+        if (async_upload) {
+            for (auto& load_job : load_jobs) {
+                ggml_tensor* dst_tensor = load_job.second;
+                if (dst_tensor->buffer != NULL && !ggml_backend_buffer_is_host(dst_tensor->buffer)) {
+                    uploader.reset(new TensorUploader(backend));
+                    break;
+                }
+            }
+        }
+        std::mutex upload_mutex;
+
+        auto load_worker = [&]() {
+            std::ifstream file(file_path, std::ios::binary);
+            if (!file.is_open()) {
+                LOG_ERROR("failed to open '%s'", file_path.c_str());
+                failed = true;
+                return;
+            }
+
+            std::vector<uint8_t> read_buffer;
+            std::vector<uint8_t> convert_buffer;
+            std::vector<uint8_t> stage_buffer;
+            TensorUploader::Slot upload_slots[2];
+            int next_upload_slot = 0;
+
+            auto read_data = [&](const TensorStorage& tensor_storage, char* buf, size_t n) {
+                if (zip != NULL) {
+                    zip_entry_openbyindex(zip, tensor_storage.index_in_zip);
+                    size_t entry_size = zip_entry_size(zip);
+                    if (entry_size != n) {
+                        read_buffer.resize(entry_size);
+                        zip_entry_noallocread(zip, (void*)read_buffer.data(), entry_size);
+                        memcpy((void*)buf, (void*)(read_buffer.data() + tensor_storage.offset), n);
+                    } else {
+                        zip_entry_noallocread(zip, (void*)buf, n);
                     }
+                    zip_entry_close(zip);
+                } else if (mapped_data(tensor_storage, n) != NULL) {
+                    memcpy((void*)buf, (void*)mapped_data(tensor_storage, n), n);
                 } else {
-                    read_buffer.resize(tensor_storage.nbytes());
-                    read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
-                    if (tensor_storage.is_bf16) {
-                        // inplace op
-                        bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
+                    file.seekg(tensor_storage.offset);
+                    file.read(buf, n);
+                    if (!file) {
+                        LOG_ERROR("read tensor data failed: '%s'", file_path.c_str());
+                        return false;
                     }
-
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type, dst_tensor->data,
-                                   dst_tensor->type, (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
                 }
-            } else {
+                return true;
+            };
+
+            // returns the (bf16 expanded) source data, taken straight from the mapping when possible
+            auto get_src_data = [&](const TensorStorage& tensor_storage) -> void* {
+                size_t nbytes_to_read = tensor_storage.nbytes_to_read();
+                uint8_t* src          = mapped_data(tensor_storage, nbytes_to_read);
+                if (src != NULL && !tensor_storage.is_bf16) {
+                    return (void*)src;
+                }
                 read_buffer.resize(tensor_storage.nbytes());
-                read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read);
-
+                if (src != NULL) {
+                    bf16_to_f32_vec((uint16_t*)src, (float*)read_buffer.data(), tensor_storage.nelements());
+                    return (void*)read_buffer.data();
+                }
+                if (!read_data(tensor_storage, (char*)read_buffer.data(), nbytes_to_read)) {
+                    return NULL;
+                }
                 if (tensor_storage.is_bf16) {
                     // inplace op
                     bf16_to_f32_vec((uint16_t*)read_buffer.data(), (float*)read_buffer.data(), tensor_storage.nelements());
                 }
+                return (void*)read_buffer.data();
+            };
 
-                if (tensor_storage.type == dst_tensor->type) {
-                    // copy to device memory
-                    ggml_backend_tensor_set(dst_tensor, read_buffer.data(), 0, ggml_nbytes(dst_tensor));
-                } else {
-                    // convert first, then copy to device memory
-                    convert_buffer.resize(ggml_nbytes(dst_tensor));
-                    convert_tensor((void*)read_buffer.data(), tensor_storage.type,
-                                   (void*)convert_buffer.data(), dst_tensor->type,
-                                   (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0]);
-                    ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
+            while (!failed) {
+                size_t job_index = next_job++;
+                if (job_index >= load_jobs.size()) {
+                    break;
+                }
+                const TensorStorage& tensor_storage = *load_jobs[job_index].first;
+                ggml_tensor* dst_tensor             = load_jobs[job_index].second;
+                size_t nbytes_to_read               = tensor_storage.nbytes_to_read();
+
+                // unallocated tensors are streamed through a per worker buffer
+                bool staged = false;
+                if (on_tensor_loaded_cb != nullptr && dst_tensor->data == NULL && dst_tensor->buffer == NULL) {
+                    stage_buffer.resize(ggml_nbytes(dst_tensor));
+                    dst_tensor->data = stage_buffer.data();
+                    staged           = true;
+                }
+
+                try {
+                    if (dst_tensor->buffer == NULL || ggml_backend_buffer_is_host(dst_tensor->buffer)) {
+                        // for the CPU and Metal backend, we can copy directly into the tensor
+                        if (tensor_storage.type == dst_tensor->type) {
+                            GGML_ASSERT(ggml_nbytes(dst_tensor) == tensor_storage.nbytes());
+                            if (!read_data(tensor_storage, (char*)dst_tensor->data, nbytes_to_read)) {
+                                throw std::runtime_error("read tensor data failed");
+                            }
+
+                            if (tensor_storage.is_bf16) {
+                                // inplace op
+                                bf16_to_f32_vec((uint16_t*)dst_tensor->data, (float*)dst_tensor->data, tensor_storage.nelements());
+                            }
+                        } else {
+                            void* src = get_src_data(tensor_storage);
+                            if (src == NULL) {
+                                throw std::runtime_error("read tensor data failed");
+                            }
+                            convert_tensor(src, tensor_storage.type, dst_tensor->data,
+                                           dst_tensor->type, (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0],
+                                           n_convert_threads);
+                        }
+                    } else {
+                        void* src = get_src_data(tensor_storage);
+                        if (src == NULL) {
+                            throw std::runtime_error("read tensor data failed");
+                        }
+
+                        if (uploader != NULL) {
+                            // double buffered: this slot was used two tensors ago
+                            TensorUploader::Slot& slot = upload_slots[next_upload_slot];
+                            next_upload_slot           = (next_upload_slot + 1) % 2;
+                            uploader->wait(slot);
+                            if (tensor_storage.type != dst_tensor->type) {
+                                slot.data.resize(ggml_nbytes(dst_tensor));
+                                convert_tensor(src, tensor_storage.type,
+                                               (void*)slot.data.data(), dst_tensor->type,
+                                               (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0],
+                                               n_convert_threads);
+                                src = slot.data.data();
+                            } else if (src == read_buffer.data()) {
+                                // hand the read buffer over instead of copying it
+                                slot.data.swap(read_buffer);
+                            }
+                            uploader->submit(slot, dst_tensor, src, ggml_nbytes(dst_tensor));
+                            if (on_tensor_loaded_cb != nullptr) {
+                                uploader->wait(slot);
+                            }
+                        } else if (tensor_storage.type == dst_tensor->type) {
+                            // copy to device memory
+                            std::lock_guard<std::mutex> lock(upload_mutex);
+                            ggml_backend_tensor_set(dst_tensor, src, 0, ggml_nbytes(dst_tensor));
+                        } else {
+                            // convert first, then copy to device memory
+                            convert_buffer.resize(ggml_nbytes(dst_tensor));
+                            convert_tensor(src, tensor_storage.type,
+                                           (void*)convert_buffer.data(), dst_tensor->type,
+                                           (int)tensor_storage.nelements() / (int)tensor_storage.ne[0], (int)tensor_storage.ne[0],
+                                           n_convert_threads);
+                            std::lock_guard<std::mutex> lock(upload_mutex);
+                            ggml_backend_tensor_set(dst_tensor, convert_buffer.data(), 0, ggml_nbytes(dst_tensor));
+                        }
+                    }
+                    if (on_tensor_loaded_cb != nullptr && !on_tensor_loaded_cb(tensor_storage, dst_tensor)) {
+                        LOG_WARN("process loaded tensor failed: '%s'", tensor_storage.name.c_str());
+                        failed = true;
+                    }
+                } catch (const std::exception& e) {
+                    LOG_ERROR("load tensor '%s' failed: %s", tensor_storage.name.c_str(), e.what());
+                    failed = true;
+                }
+                if (staged) {
+                    dst_tensor->data = NULL;
                 }
             }
+            if (uploader != NULL) {
+                // the staging slots go away with this worker
+                uploader->wait(upload_slots[0]);
+                uploader->wait(upload_slots[1]);
+            }
+        };
+
+        if (n_workers == 1) {
+            load_worker();
+        } else {
+            std::vector<std::thread> workers;
+            for (int i = 0; i < n_workers; i++) {
+                workers.emplace_back(load_worker);
+            }
+            for (auto& worker : workers) {
+                worker.join();
+            }
         }
+        uploader.reset();
 
         if (zip != NULL) {
             zip_close(zip);
         }
 
-        if (!success) {
+        if (failed) {
+            success = false;
             break;
         }
     }
+    if (mapped_count > 0 || copied_count > 0) {
+        LOG_INFO("mapped %d tensors (%.2fMB) without copying, %d tensors fall back to a copy",
+                 mapped_count, mapped_size / 1024.f / 1024.f, copied_count);
+    }
     return success;
 }
 
@@ -1571,27 +2265,84 @@ bool ModelLoader::load_tensors(std::map<std::string, struct ggml_tensor*>& tenso
     return true;
 }
 
+bool ModelLoader::set_tensor_type_rules(const std::string& rules) {
+    tensor_type_rules.clear();
+    std::stringstream ss(rules);
+    std::string rule;
+    while (std::getline(ss, rule, ',')) {
+        rule = trim(rule);
+        if (rule.size() == 0) {
+            continue;
+        }
+        size_t pos = rule.rfind('=');
+        if (pos == std::string::npos) {
+            LOG_ERROR("invalid tensor type rule '%s', expected pattern=type", rule.c_str());
+            return false;
+        }
+        std::string pattern   = trim(rule.substr(0, pos));
+        std::string type_name = trim(rule.substr(pos + 1));
+        std::transform(type_name.begin(), type_name.end(), type_name.begin(), ::tolower);
+
+        ggml_type tensor_type = GGML_TYPE_COUNT;
+        for (int i = 0; i < GGML_TYPE_COUNT; i++) {
+            const char* name = ggml_type_name((ggml_type)i);
+            if (name == NULL) {
+                continue;
+            }
+            std::string lower_name = name;
+            std::transform(lower_name.begin(), lower_name.end(), lower_name.begin(), ::tolower);
+            if (lower_name == type_name) {
+                tensor_type = (ggml_type)i;
+                break;
+            }
+        }
+        if (tensor_type == GGML_TYPE_COUNT) {
+            LOG_ERROR("invalid type '%s' in tensor type rule '%s'", type_name.c_str(), rule.c_str());
+            return false;
+        }
+
+        try {
+            tensor_type_rules.push_back({pattern, std::regex(pattern), tensor_type});
+        } catch (const std::regex_error& e) {
+            LOG_ERROR("invalid pattern in tensor type rule '%s': %s", rule.c_str(), e.what());
+            return false;
+        }
+        LOG_DEBUG("tensor type rule: '%s' => %s", pattern.c_str(), ggml_type_name(tensor_type));
+    }
+    return true;
+}
+
+ggml_type ModelLoader::get_tensor_type(const TensorStorage& tensor_storage, ggml_type type) {
+    ggml_type tensor_type = tensor_storage.type;
+    if (type != GGML_TYPE_COUNT) {
+        tensor_type = type;
+    }
+    for (auto& rule : tensor_type_rules) {
+        if (std::regex_search(tensor_storage.name, rule.regex)) {
+            tensor_type = rule.type;
+            break;
+        }
+    }
+    if (ggml_is_quantized(tensor_type) && tensor_storage.ne[0] % ggml_blck_size(tensor_type) != 0) {
+        tensor_type = GGML_TYPE_F16;
+    }
+    return tensor_type;
+}
+
 bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type) {
     auto backend    = ggml_backend_cpu_init();
     size_t mem_size = 1 * 1024 * 1024;  // for padding
     mem_size += tensor_storages.size() * ggml_tensor_overhead();
-    mem_size += get_params_mem_size(backend, type);
-    LOG_INFO("model tensors mem size: %.2fMB", mem_size / 1024.f / 1024.f);
-    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, false});
+    // tensor metadata only, the data is streamed to the file tensor by tensor
+    ggml_context* ggml_ctx = ggml_init({mem_size, NULL, true});
 
     gguf_context* gguf_ctx = gguf_init_empty();
 
-    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+    std::unordered_map<std::string, ggml_tensor*> out_tensors;
+    auto on_new_tensor_meta_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
         const std::string& name = tensor_storage.name;
 
-        ggml_type tensor_type = tensor_storage.type;
-        if (type != GGML_TYPE_COUNT) {
-            if (ggml_is_quantized(type) && tensor_storage.ne[0] % 32 != 0) {
-                tensor_type = GGML_TYPE_F16;
-            } else {
-                tensor_type = type;
-            }
-        }
+        ggml_type tensor_type = get_tensor_type(tensor_storage, type);
 
         ggml_tensor* tensor = ggml_new_tensor(ggml_ctx, tensor_type, tensor_storage.n_dims, tensor_storage.ne);
         if (tensor == NULL) {
@@ -1606,19 +2357,78 @@ bool ModelLoader::save_to_gguf_file(const std::string& file_path, ggml_type type
         // tensor_storage.ne[0], tensor_storage.ne[1], tensor_storage.ne[2], tensor_storage.ne[3],
         // tensor->n_dims, tensor->ne[0], tensor->ne[1], tensor->ne[2], tensor->ne[3]);
 
-        *dst_tensor = tensor;
-
         gguf_add_tensor(gguf_ctx, tensor);
+        out_tensors[name] = tensor;
 
         return true;
     };
 
-    bool success = load_tensors(on_new_tensor_cb, backend);
+    // first pass: tensor infos only, nothing is read
+    bool success = load_tensors(on_new_tensor_meta_cb, backend);
+
+    std::ofstream file;
+    size_t meta_size = 0;
+    if (success) {
+        LOG_INFO("trying to save tensors to %s", file_path.c_str());
+        file.open(file_path, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            LOG_ERROR("failed to open '%s'", file_path.c_str());
+            success = false;
+        }
+    }
+    if (success) {
+        std::vector<uint8_t> meta(gguf_get_meta_size(gguf_ctx));
+        gguf_get_meta_data(gguf_ctx, meta.data());
+        file.write((const char*)meta.data(), meta.size());
+        meta_size = meta.size();
+    }
+
+    // second pass: convert each tensor through a per worker buffer and write it at its final offset
+    std::mutex file_mutex;
+    auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+        *dst_tensor = out_tensors[tensor_storage.name];
+        return true;
+    };
+    auto on_tensor_loaded_cb = [&](const TensorStorage& tensor_storage, ggml_tensor* tensor) -> bool {
+        int tensor_index = gguf_find_tensor(gguf_ctx, ggml_get_name(tensor));
+        if (tensor_index < 0) {
+            return false;
+        }
+        size_t offset = meta_size + gguf_get_tensor_offset(gguf_ctx, tensor_index);
+
+        std::lock_guard<std::mutex> lock(file_mutex);
+        file.seekp(offset);
+        file.write((const char*)tensor->data, ggml_nbytes(tensor));
+        if (!file) {
+            LOG_ERROR("write tensor data failed: '%s'", file_path.c_str());
+            return false;
+        }
+        return true;
+    };
+    if (success) {
+        success = load_tensors(on_new_tensor_cb, backend, on_tensor_loaded_cb);
+    }
     ggml_backend_free(backend);
     LOG_INFO("load tensors done");
-    LOG_INFO("trying to save tensors to %s", file_path.c_str());
-    if (success) {
-        gguf_write_to_file(gguf_ctx, file_path.c_str(), false);
+
+    int n_tensors = gguf_get_n_tensors(gguf_ctx);
+    if (success && n_tensors > 0) {
+        // the data section ends with the padding of the last tensor
+        ggml_tensor* last_tensor = out_tensors[gguf_get_tensor_name(gguf_ctx, n_tensors - 1)];
+        size_t data_end          = gguf_get_tensor_offset(gguf_ctx, n_tensors - 1) + ggml_nbytes(last_tensor);
+        size_t padding           = GGML_PAD(data_end, gguf_get_alignment(gguf_ctx)) - data_end;
+        if (padding > 0) {
+            std::vector<char> zeros(padding, 0);
+            file.seekp(meta_size + data_end);
+            file.write(zeros.data(), padding);
+        }
+        if (!file) {
+            LOG_ERROR("write '%s' failed", file_path.c_str());
+            success = false;
+        }
+    }
+    if (file.is_open()) {
+        file.close();
     }
     ggml_free(ggml_ctx);
     gguf_free(gguf_ctx);
@@ -1631,44 +2441,53 @@ int64_t ModelLoader::get_params_mem_size(ggml_backend_t backend, ggml_type type)
         alignment = ggml_backend_get_alignment(backend);
     }
     int64_t mem_size = 0;
-    std::vector<TensorStorage> processed_tensor_storages;
-    for (auto& tensor_storage : tensor_storages) {
-        if (is_unused_tensor(tensor_storage.name)) {
-            continue;
-        }
-        preprocess_tensor(tensor_storage, processed_tensor_storages);
-    }
+    std::vector<TensorStorage> processed_tensor_storages = remove_duplicates(tensor_storages);
 
     for (auto& tensor_storage : processed_tensor_storages) {
-        ggml_type tensor_type = tensor_storage.type;
-        if (type != GGML_TYPE_COUNT) {
-            if (ggml_is_quantized(type) && tensor_storage.ne[0] % 32 != 0) {
-                tensor_type = GGML_TYPE_F16;
-            } else {
-                tensor_type = type;
-            }
-        }
-        tensor_storage.type = tensor_type;
+        tensor_storage.type = get_tensor_type(tensor_storage, type);
         mem_size += tensor_storage.nbytes() + alignment;
     }
 
     return mem_size;
 }
 
-bool convert(const char* input_path, const char* vae_path, const char* output_path, sd_type_t output_type) {
+bool convert(const char* input_path,
+             const char* vae_path,
+             const char* output_path,
+             sd_type_t output_type,
+             const char* tensor_type_rules,
+             const char* tensor_prefixes) {
     ModelLoader model_loader;
 
+    if (tensor_type_rules != NULL && !model_loader.set_tensor_type_rules(tensor_type_rules)) {
+        return false;
+    }
+    if (tensor_prefixes != NULL) {
+        model_loader.set_tensor_prefixes_from_string(tensor_prefixes);
+    }
+
+    bool has_vae = vae_path != NULL && strlen(vae_path) > 0;
+    if (has_vae && tensor_prefixes == NULL) {
+        // replaced by the separate VAE
+        model_loader.set_tensor_prefixes({}, {"first_stage_model."});
+    }
     if (!model_loader.init_from_file(input_path)) {
         LOG_ERROR("init model loader from file failed: '%s'", input_path);
         return false;
     }
 
-    if (vae_path != NULL && strlen(vae_path) > 0) {
+    if (has_vae) {
+        if (tensor_prefixes == NULL) {
+            model_loader.set_tensor_prefixes({"first_stage_model."});
+        }
         if (!model_loader.init_from_file(vae_path, "vae.")) {
             LOG_ERROR("init model loader from file failed: '%s'", vae_path);
             return false;
         }
     }
+    model_loader.set_n_threads(get_num_physical_cores());
+    // read through the mapping only, every tensor is streamed through a per worker buffer
+    model_loader.set_use_mmap(true);
     bool success = model_loader.save_to_gguf_file(output_path, (ggml_type)output_type);
     return success;
 }
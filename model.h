@@ -1,18 +1,23 @@
 #ifndef __MODEL_H__
 #define __MODEL_H__
 
+#include <condition_variable>
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <regex>
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include "ggml/ggml-backend.h"
 #include "ggml/ggml.h"
 #include "json.hpp"
+#include "util.h"
 #include "zip.h"
 
 #define SD_MAX_DIMS 5
@@ -121,11 +126,159 @@ struct TensorStorage {
 };
 
 typedef std::function<bool(const TensorStorage&, ggml_tensor**)> on_new_tensor_cb_t;
+// called from the loader threads once the tensor data is available
+typedef std::function<bool(const TensorStorage&, ggml_tensor*)> on_tensor_loaded_cb_t;
+
+// a mapped model file, wrapped in a CPU backend buffer so tensors can point into it
+struct ModelFileMapping {
+    MmapFile file;
+    ggml_backend_buffer_t buffer = NULL;
+
+    ~ModelFileMapping() {
+        if (buffer != NULL) {
+            ggml_backend_buffer_free(buffer);
+        }
+    }
+};
+
+// Copies host data into (device) tensors on a dedicated thread, so the loader workers
+// can read and convert the next tensor while the previous one is being uploaded.
+// Each worker owns two staging slots and only reuses a slot once its upload is done.
+// Pending copies are issued as one batch with ggml_backend_tensor_set_async and a single
+// synchronize when the tensor lives in the backend's own buffer type; otherwise (CPU,
+// foreign buffers, no backend) the blocking ggml_backend_tensor_set is used.
+class TensorUploader {
+public:
+    struct Slot {
+        std::vector<uint8_t> data;
+        bool busy = false;
+    };
+
+private:
+    struct Job {
+        Slot* slot;
+        ggml_tensor* tensor;
+        const void* data;
+        size_t size;
+    };
+
+    ggml_backend_t backend;
+    std::vector<Job> jobs;
+    bool stop = false;
+    std::mutex mutex;
+    std::condition_variable job_cond;
+    std::condition_variable done_cond;
+    std::thread thread;
+
+    size_t uploaded_size = 0;
+    int uploaded_count   = 0;
+    int async_count      = 0;
+
+    bool can_set_async(ggml_tensor* tensor) {
+        if (backend == NULL || ggml_backend_is_cpu(backend) || tensor->buffer == NULL) {
+            return false;
+        }
+        return ggml_backend_buffer_get_type(tensor->buffer) == ggml_backend_get_default_buffer_type(backend);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            job_cond.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (jobs.empty()) {
+                break;
+            }
+            std::vector<Job> batch;
+            batch.swap(jobs);
+            lock.unlock();
+
+            bool need_sync = false;
+            for (auto& job : batch) {
+                if (can_set_async(job.tensor)) {
+                    ggml_backend_tensor_set_async(backend, job.tensor, job.data, 0, job.size);
+                    need_sync = true;
+                    async_count++;
+                } else {
+                    ggml_backend_tensor_set(job.tensor, job.data, 0, job.size);
+                }
+                uploaded_size += job.size;
+                uploaded_count++;
+            }
+            if (need_sync) {
+                ggml_backend_synchronize(backend);
+            }
+
+            lock.lock();
+            for (auto& job : batch) {
+                job.slot->busy = false;
+            }
+            done_cond.notify_all();
+        }
+    }
+
+public:
+    TensorUploader(ggml_backend_t backend)
+        : backend(backend) {
+        thread = std::thread(&TensorUploader::run, this);
+    }
+
+    // waits for the queued uploads
+    ~TensorUploader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        job_cond.notify_one();
+        thread.join();
+        if (uploaded_count > 0) {
+            LOG_DEBUG("uploaded %d tensors (%.2fMB), %d asynchronously",
+                      uploaded_count, uploaded_size / 1024.f / 1024.f, async_count);
+        }
+    }
+
+    // blocks until the previous upload from the slot is done
+    void wait(Slot& slot) {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cond.wait(lock, [&slot] { return !slot.busy; });
+    }
+
+    // data must stay valid until the slot is free again, it is either slot.data or
+    // memory that outlives the uploader (e.g. a file mapping)
+    void submit(Slot& slot, ggml_tensor* tensor, const void* data, size_t size) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot.busy = true;
+            jobs.push_back({&slot, tensor, data, size});
+        }
+        job_cond.notify_one();
+    }
+};
+
+struct TensorTypeRule {
+    std::string pattern;
+    std::regex regex;
+    ggml_type type;
+};
 
 class ModelLoader {
 protected:
     std::vector<std::string> file_paths_;
-    std::vector<TensorStorage> tensor_storages;
+    std::vector<TensorStorage> tensor_storages;  // preprocessed (converted names, split qkv)
+
+    int n_threads     = 1;
+    bool use_mmap     = false;
+    bool bind_to_mmap = false;
+    bool async_upload = true;
+    std::vector<std::shared_ptr<ModelFileMapping>> file_mappings;  // indexed by file_index
+
+    std::shared_ptr<ModelFileMapping> get_file_mapping(size_t file_index);
+
+    std::vector<TensorTypeRule> tensor_type_rules;
+
+    std::vector<std::string> tensor_prefixes;
+    std::vector<std::string> excluded_tensor_prefixes;
+
+    void apply_tensor_prefixes(const std::string& file_path, size_t storage_index_begin);
 
     bool parse_data_pkl(uint8_t* buffer,
                         size_t buffer_size,
@@ -139,17 +292,67 @@ protected:
     bool init_from_ckpt_file(const std::string& file_path, const std::string& prefix = "");
     bool init_from_diffusers_file(const std::string& file_path, const std::string& prefix = "");
 
+    bool load_model_index(const std::string& file_path, const std::string& prefix);
+    bool save_model_index(const std::string& file_path,
+                          const std::string& prefix,
+                          size_t file_index_begin,
+                          size_t storage_index_begin);
+
 public:
     bool init_from_file(const std::string& file_path, const std::string& prefix = "");
+
+    // Only tensors whose (converted) name starts with one of the prefixes and with none of the
+    // excluded ones are kept from files opened afterwards, e.g. {"first_stage_model."} for the
+    // VAE of a full checkpoint. The data of the other tensors is never read. An empty list keeps
+    // everything.
+    void set_tensor_prefixes(const std::vector<std::string>& prefixes,
+                             const std::vector<std::string>& excluded_prefixes = {}) {
+        tensor_prefixes          = prefixes;
+        excluded_tensor_prefixes = excluded_prefixes;
+    }
+    // comma separated, a prefix starting with '-' is excluded, e.g. "-first_stage_model."
+    void set_tensor_prefixes_from_string(const std::string& prefixes);
+
+    // With mmap enabled, safetensors/gguf tensor data is read from a mapping of the file.
+    void set_use_mmap(bool enable) { use_mmap = enable; }
+    // For callers that allocate the params themselves after a first load_tensors pass:
+    // in that pass a tensor that is not allocated yet (data == NULL) and whose type already
+    // matches is bound directly into the mapping (zero-copy, CPU only); other unallocated
+    // tensors are skipped, so the caller can allocate them and run load_tensors again.
+    // Without it, the mapping is only read from (e.g. streamed through a per worker buffer).
+    void set_bind_to_mmap(bool enable) { bind_to_mmap = enable; }
+    // tensors are read, converted and uploaded by up to n_threads workers
+    void set_n_threads(int n) { n_threads = n > 0 ? n : 1; }
+    // reads of the next tensors overlap the upload of the previous ones to device buffers
+    void set_async_upload(bool enable) { async_upload = enable; }
+    // the mappings must outlive every tensor bound into them
+    std::vector<std::shared_ptr<ModelFileMapping>> get_file_mappings();
     SDVersion get_sd_version();
     ggml_type get_sd_wtype();
     std::string load_merges();
-    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb, ggml_backend_t backend);
+    // Destination tensors that are not allocated (data == NULL) are skipped, unless
+    // on_tensor_loaded_cb is set: then they get temporary per worker memory that is
+    // valid during the callback.
+    bool load_tensors(on_new_tensor_cb_t on_new_tensor_cb,
+                      ggml_backend_t backend,
+                      on_tensor_loaded_cb_t on_tensor_loaded_cb = nullptr);
     bool load_tensors(std::map<std::string, struct ggml_tensor*>& tensors,
                       ggml_backend_t backend,
                       std::set<std::string> ignore_tensors = {});
+    // comma separated "pattern=type" rules, e.g. "first_stage_model\.=f16,attn=q4_K";
+    // the first pattern (regex) found in a tensor name overrides the global type
+    bool set_tensor_type_rules(const std::string& rules);
+    ggml_type get_tensor_type(const TensorStorage& tensor_storage, ggml_type type);
     bool save_to_gguf_file(const std::string& file_path, ggml_type type);
     int64_t get_params_mem_size(ggml_backend_t backend, ggml_type type = GGML_TYPE_COUNT);
     ~ModelLoader() = default;
 };
+
+// the distinct top level names ("name.") of the tensors, e.g. to keep only the tensors of one
+// module from a file that also holds other ones
+std::vector<std::string> get_tensor_prefixes(const std::map<std::string, struct ggml_tensor*>& tensors);
+
+// converts a diffusers tensor name (seq '.') or LoRA tensor name (seq '_') to the
+// compvis one, names no rule matches are returned unchanged
+std::string convert_diffusers_name_to_compvis(std::string key, char seq);
 #endif  // __MODEL_H__
\ No newline at end of file
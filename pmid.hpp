@@ -276,7 +276,7 @@ public:
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  struct ggml_tensor* id_pixel_values,
                  struct ggml_tensor* prompt_embeds,
                  std::vector<bool>& class_tokens_mask,
@@ -288,7 +288,7 @@ public:
         };
 
         // GGMLModule::compute(get_graph, n_threads, updated_prompt_embeds);
-        GGMLModule::compute(get_graph, n_threads, true, updated_prompt_embeds, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, true, updated_prompt_embeds, output_ctx);
     }
 };
 
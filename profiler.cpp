@@ -0,0 +1,199 @@
+#include "profiler.h"
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "json.hpp"
+#include "stable-diffusion.h"
+#include "util.h"
+
+struct NodeRecord {
+    std::string module;
+    std::string op;
+    std::string name;
+    int64_t ne[4]    = {1, 1, 1, 1};
+    ggml_type type   = GGML_TYPE_F32;
+    size_t bytes     = 0;  // read and written: the sources and the result
+    int64_t start_us = 0;
+    int64_t dur_us   = 0;
+    int request      = 0;
+    int step         = 0;
+};
+
+static std::atomic<bool> profiling_enabled(false);
+static std::atomic<int> last_request_id(0);
+static std::mutex records_mutex;
+static std::vector<NodeRecord> records;
+
+static thread_local int current_request = 0;
+static thread_local int current_step    = 0;
+
+bool profiler_enabled() {
+    return profiling_enabled;
+}
+
+void profiler_set_enabled(bool enable) {
+    profiling_enabled = enable;
+}
+
+void profiler_begin_request() {
+    current_request = ++last_request_id;
+    current_step    = 0;
+}
+
+void profiler_set_step(int step) {
+    current_step = step;
+}
+
+void profiler_record(const std::string& module, const struct ggml_tensor* node, int64_t start_us, int64_t duration_us) {
+    NodeRecord record;
+    record.module = module;
+    record.op     = ggml_op_desc(node);
+    record.name   = node->name;
+    for (int i = 0; i < 4; i++) {
+        record.ne[i] = node->ne[i];
+    }
+    record.type = node->type;
+    // views only change the shape or strides, no data is moved
+    bool is_view = node->op == GGML_OP_VIEW || node->op == GGML_OP_RESHAPE ||
+                   node->op == GGML_OP_PERMUTE || node->op == GGML_OP_TRANSPOSE;
+    if (!is_view) {
+        record.bytes = ggml_nbytes(node);
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            if (node->src[i] != NULL) {
+                record.bytes += ggml_nbytes(node->src[i]);
+            }
+        }
+    }
+    record.start_us = start_us;
+    record.dur_us   = duration_us;
+    record.request  = current_request;
+    record.step     = current_step;
+
+    std::lock_guard<std::mutex> lock(records_mutex);
+    records.push_back(record);
+}
+
+void profiler_clear() {
+    std::lock_guard<std::mutex> lock(records_mutex);
+    records.clear();
+}
+
+static void add_to_summary(nlohmann::json& summary, const NodeRecord& record) {
+    if (summary.is_null()) {
+        summary = {{"count", 0}, {"us", 0}, {"bytes", 0}};
+    }
+    summary["count"] = summary["count"].get<int64_t>() + 1;
+    summary["us"]    = summary["us"].get<int64_t>() + record.dur_us;
+    summary["bytes"] = summary["bytes"].get<uint64_t>() + record.bytes;
+}
+
+static nlohmann::json get_summary(const std::vector<NodeRecord>& records) {
+    // request => step => op
+    std::map<int, std::map<int, nlohmann::json>> steps;
+    std::map<int, nlohmann::json> modules;
+    std::map<int, nlohmann::json> ops;
+    std::map<int, int64_t> request_us;
+    nlohmann::json total_ops;
+    for (const NodeRecord& record : records) {
+        nlohmann::json& step = steps[record.request][record.step];
+        add_to_summary(step["total"], record);
+        add_to_summary(step["ops"][record.op], record);
+        add_to_summary(modules[record.request][record.module], record);
+        add_to_summary(ops[record.request][record.op], record);
+        add_to_summary(total_ops[record.op], record);
+        request_us[record.request] += record.dur_us;
+    }
+
+    nlohmann::json requests = nlohmann::json::array();
+    for (auto& kv : steps) {
+        nlohmann::json request;
+        request["request"] = kv.first;
+        request["us"]      = request_us[kv.first];
+        request["modules"] = modules[kv.first];
+        request["ops"]     = ops[kv.first];
+        request["steps"]   = nlohmann::json::array();
+        for (auto& step : kv.second) {
+            nlohmann::json entry = step.second;
+            entry["step"]        = step.first;
+            request["steps"].push_back(entry);
+        }
+        requests.push_back(request);
+    }
+    return {{"requests", requests}, {"ops", total_ops}};
+}
+
+static nlohmann::json get_chrome_trace(const std::vector<NodeRecord>& records) {
+    nlohmann::json events = nlohmann::json::array();
+    std::map<std::string, int> module_tids;
+    for (const NodeRecord& record : records) {
+        auto it = module_tids.find(record.module);
+        if (it == module_tids.end()) {
+            it = module_tids.insert({record.module, (int)module_tids.size() + 1}).first;
+        }
+        nlohmann::json event;
+        event["name"] = record.op;
+        event["cat"]  = record.module;
+        event["ph"]   = "X";
+        event["ts"]   = record.start_us;
+        event["dur"]  = record.dur_us;
+        event["pid"]  = record.request;
+        event["tid"]  = it->second;
+        event["args"] = {{"name", record.name},
+                         {"shape", {record.ne[0], record.ne[1], record.ne[2], record.ne[3]}},
+                         {"type", ggml_type_name(record.type)},
+                         {"bytes", record.bytes},
+                         {"step", record.step}};
+        events.push_back(event);
+    }
+    std::set<int> pids;
+    for (const NodeRecord& record : records) {
+        pids.insert(record.request);
+    }
+    for (auto& kv : module_tids) {
+        for (int pid : pids) {
+            events.push_back({{"name", "thread_name"},
+                              {"ph", "M"},
+                              {"pid", pid},
+                              {"tid", kv.second},
+                              {"args", {{"name", kv.first}}}});
+        }
+    }
+    return {{"traceEvents", events}, {"displayTimeUnit", "ms"}};
+}
+
+bool profiler_export(const std::string& file_path, bool chrome_trace) {
+    std::vector<NodeRecord> snapshot;
+    {
+        std::lock_guard<std::mutex> lock(records_mutex);
+        snapshot = records;
+    }
+    std::ofstream file(file_path);
+    if (!file.is_open()) {
+        LOG_ERROR("failed to open '%s'", file_path.c_str());
+        return false;
+    }
+    if (chrome_trace) {
+        file << get_chrome_trace(snapshot).dump();
+    } else {
+        file << get_summary(snapshot).dump(2);
+    }
+    LOG_INFO("profile of %zu graph nodes saved to '%s'", snapshot.size(), file_path.c_str());
+    return file.good();
+}
+
+void sd_set_profiling(bool enable) {
+    profiler_set_enabled(enable);
+}
+
+bool sd_export_profile(const char* file_path, bool chrome_trace) {
+    return profiler_export(file_path, chrome_trace);
+}
+
+void sd_clear_profile() {
+    profiler_clear();
+}
@@ -0,0 +1,28 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <cstdint>
+#include <string>
+
+#include "ggml/ggml.h"
+
+// Per node timings of the graphs computed by the GGMLModules (clip, unet, control net, vae,
+// esrgan, lora...), switched on at runtime with sd_set_profiling(). While enabled, graphs
+// are computed one node at a time, so the totals are a bit higher than in normal runs.
+
+bool profiler_enabled();
+void profiler_set_enabled(bool enable);
+
+// the records of the calling thread are labelled with its current request and sampling step
+// (0 outside of sampling, e.g. text encoding and vae decoding)
+void profiler_begin_request();
+void profiler_set_step(int step);
+
+void profiler_record(const std::string& module, const struct ggml_tensor* node, int64_t start_us, int64_t duration_us);
+
+// a summary per request, step, module and op type, or every node as a Chrome trace
+// (chrome://tracing, Perfetto)
+bool profiler_export(const std::string& file_path, bool chrome_trace);
+void profiler_clear();
+
+#endif  // __PROFILER_H__
@@ -0,0 +1,160 @@
+#ifndef __RESIDENCY_HPP__
+#define __RESIDENCY_HPP__
+
+#include "ggml_extend.hpp"
+#include "model.h"
+
+/*
+    Keeps the params of a set of GGMLModules within a memory budget.
+    A module's params buffer is only allocated and loaded from the model file when the
+    module is computed; the least recently used modules are evicted to stay within budget.
+*/
+struct ParamsResidencyManager {
+    typedef std::function<bool(GGMLModule*, std::map<std::string, struct ggml_tensor*>&)> on_params_loaded_cb_t;
+
+    struct Entry {
+        GGMLModule* module = NULL;
+        std::map<std::string, struct ggml_tensor*> tensors;
+        uint64_t last_used = 0;
+    };
+
+    std::shared_ptr<ModelLoader> model_loader;
+    size_t mem_budget = 0;
+    std::vector<Entry> entries;
+    uint64_t clock = 0;
+    int load_count = 0;
+
+    // called after a module has been (re)loaded, e.g. to re-apply LoRAs
+    on_params_loaded_cb_t on_params_loaded;
+
+    ParamsResidencyManager(std::shared_ptr<ModelLoader> model_loader, size_t mem_budget)
+        : model_loader(model_loader), mem_budget(mem_budget) {}
+
+    ~ParamsResidencyManager() {
+        for (auto& entry : entries) {
+            entry.module->on_compute_begin = nullptr;
+        }
+    }
+
+    // takes the tensors of model_tensors that belong to the module
+    void add(GGMLModule* module, const std::map<std::string, struct ggml_tensor*>& model_tensors) {
+        std::set<struct ggml_tensor*> params;
+        struct ggml_context* params_ctx = module->get_params_ctx();
+        for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+            params.insert(t);
+        }
+        Entry entry;
+        entry.module = module;
+        for (auto& kv : model_tensors) {
+            if (params.find(kv.second) != params.end()) {
+                entry.tensors[kv.first] = kv.second;
+            }
+        }
+        entries.push_back(entry);
+        module->on_compute_begin = [this, module]() -> bool {
+            return acquire(module);
+        };
+    }
+
+    Entry* find(GGMLModule* module) {
+        for (auto& entry : entries) {
+            if (entry.module == module) {
+                return &entry;
+            }
+        }
+        return NULL;
+    }
+
+    size_t get_resident_size() {
+        size_t size = 0;
+        for (auto& entry : entries) {
+            size += entry.module->get_params_buffer_size();
+        }
+        return size;
+    }
+
+    size_t get_required_size(Entry& entry) {
+        size_t size = 0;
+        for (auto& kv : entry.tensors) {
+            if (kv.second->data == NULL) {
+                size += ggml_nbytes(kv.second);
+            }
+        }
+        return size;
+    }
+
+    void evict(Entry& entry) {
+        LOG_DEBUG("evicting %s params (%.2fMB)",
+                  entry.module->get_desc().c_str(),
+                  entry.module->get_params_buffer_size() / 1024.0 / 1024.0);
+        entry.module->free_params_buffer();
+    }
+
+    bool acquire(GGMLModule* module) {
+        Entry* entry = find(module);
+        if (entry == NULL) {
+            return true;
+        }
+        entry->last_used = ++clock;
+        if (module->params_allocated()) {
+            return true;
+        }
+
+        size_t required_size = get_required_size(*entry);
+        while (get_resident_size() + required_size > mem_budget) {
+            Entry* lru = NULL;
+            for (auto& other : entries) {
+                if (other.module == module || other.module->get_params_buffer_size() == 0) {
+                    continue;
+                }
+                if (lru == NULL || other.last_used < lru->last_used) {
+                    lru = &other;
+                }
+            }
+            if (lru == NULL) {
+                LOG_WARN("%s params (%.2fMB) exceed the params memory budget (%.2fMB)",
+                         module->get_desc().c_str(),
+                         required_size / 1024.0 / 1024.0,
+                         mem_budget / 1024.0 / 1024.0);
+                break;
+            }
+            evict(*lru);
+        }
+
+        int64_t t0 = ggml_time_ms();
+        if (!module->alloc_params_buffer()) {
+            return false;
+        }
+        auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+            auto it = entry->tensors.find(tensor_storage.name);
+            if (it == entry->tensors.end()) {
+                return true;
+            }
+            if (ggml_nelements(it->second) != tensor_storage.nelements()) {
+                LOG_ERROR("tensor '%s' has wrong shape in model file", tensor_storage.name.c_str());
+                return false;
+            }
+            *dst_tensor = it->second;
+            return true;
+        };
+        if (!model_loader->load_tensors(on_new_tensor_cb, NULL)) {
+            LOG_ERROR("load %s params failed", module->get_desc().c_str());
+            module->free_params_buffer();
+            return false;
+        }
+        if (on_params_loaded && !on_params_loaded(module, entry->tensors)) {
+            return false;
+        }
+        load_count++;
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("loaded %s params (%.2fMB), taking %.2fs, resident %.2fMB / budget %.2fMB",
+                 module->get_desc().c_str(),
+                 module->get_params_buffer_size() / 1024.0 / 1024.0,
+                 (t1 - t0) * 1.0f / 1000,
+                 get_resident_size() / 1024.0 / 1024.0,
+                 mem_budget / 1024.0 / 1024.0);
+        return true;
+    }
+};
+
+#endif  // __RESIDENCY_HPP__
@@ -0,0 +1,984 @@
+#ifndef __SAMPLER_HPP__
+#define __SAMPLER_HPP__
+
+#include <mutex>
+#include <thread>
+
+#include "ggml_extend.hpp"
+#include "stable-diffusion.h"
+
+/*================================================= Latent kernels ==================================================*/
+
+// below this many elements per thread, spawning the threads costs more than the update
+#define SD_LATENT_MIN_ELEMENTS_PER_THREAD (256 * 1024)
+
+// Calls fn(begin, end) on disjoint ranges covering [0, n), on up to n_threads threads.
+// fn is a plain indexed loop over float pointers, which the compiler vectorizes.
+template <typename F>
+__STATIC_INLINE__ void latent_parallel_for(int64_t n, int n_threads, F fn) {
+    n_threads = (int)std::min<int64_t>(std::max(n_threads, 1), n / SD_LATENT_MIN_ELEMENTS_PER_THREAD);
+    if (n_threads <= 1) {
+        fn((int64_t)0, n);
+        return;
+    }
+    int64_t chunk = (n + n_threads - 1) / n_threads;
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; i++) {
+        int64_t begin = i * chunk;
+        int64_t end   = std::min(n, begin + chunk);
+        workers.emplace_back([=]() { fn(begin, end); });
+    }
+    fn((int64_t)0, std::min(n, chunk));
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+// Sum of fn(begin, end) over disjoint ranges covering [0, n), added up in range order so the
+// result doesn't depend on the thread timing.
+template <typename F>
+__STATIC_INLINE__ double latent_parallel_sum(int64_t n, int n_threads, F fn) {
+    std::mutex mutex;
+    std::map<int64_t, double> partial_sums;
+    latent_parallel_for(n, n_threads, [&](int64_t begin, int64_t end) {
+        double sum = fn(begin, end);
+        std::lock_guard<std::mutex> lock(mutex);
+        partial_sums[begin] = sum;
+    });
+    double sum = 0;
+    for (auto& kv : partial_sums) {
+        sum += kv.second;
+    }
+    return sum;
+}
+
+/*================================================= Samplers ==================================================*/
+
+// Ref: https://github.com/crowsonkb/k-diffusion/blob/master/k_diffusion/sampling.py
+
+// what a sampler works with, set up by StableDiffusionGGML::sample()
+struct SamplerContext {
+    ggml_context* work_ctx = NULL;  // for the sampler's buffers
+    ggml_tensor* x         = NULL;  // the latent, noised with sigmas[0], updated in place
+    ggml_tensor* denoised  = NULL;  // output of the last denoise() call
+    std::vector<float> sigmas;
+    int n_threads = 1;
+    // denoises input at sigma into denoised, step is the 1-based step of the progress
+    // (negative: not the last evaluation of the step); false if the sampling was stopped
+    std::function<bool(ggml_tensor* input, float sigma, int step)> denoise;
+    // fills noise with the ancestral noise of the latents
+    std::function<void(ggml_tensor* noise)> set_noise_randn;
+    // adaptive samplers: relative tolerance of the local error, max number of denoise() calls (0 for no limit)
+    float rtol  = 0.05f;
+    int max_nfe = 0;
+
+    size_t steps() const { return sigmas.size() - 1; }
+    int64_t n() const { return ggml_nelements(x); }
+};
+
+class Sampler {
+public:
+    virtual ~Sampler() = default;
+    // steps ctx.x along ctx.sigmas, false if the sampling was stopped
+    virtual bool sample(SamplerContext& ctx) = 0;
+};
+
+typedef std::function<std::shared_ptr<Sampler>()> sampler_factory_t;
+
+__STATIC_INLINE__ std::map<int, sampler_factory_t>& get_sampler_registry() {
+    static std::map<int, sampler_factory_t> registry;
+    return registry;
+}
+
+// a sampler registers itself with a static SamplerRegistration next to its definition
+struct SamplerRegistration {
+    SamplerRegistration(sample_method_t method, sampler_factory_t factory) {
+        get_sampler_registry()[method] = factory;
+    }
+};
+
+__STATIC_INLINE__ std::shared_ptr<Sampler> get_sampler(sample_method_t method) {
+    auto it = get_sampler_registry().find(method);
+    if (it == get_sampler_registry().end()) {
+        return NULL;
+    }
+    return it->second();
+}
+
+// sigma_up, sigma_down of an ancestral step from sigma to sigma_next
+__STATIC_INLINE__ std::pair<float, float> get_ancestral_step(float sigma, float sigma_next) {
+    float sigma_up   = std::min(sigma_next,
+                                std::sqrt(sigma_next * sigma_next * (sigma * sigma - sigma_next * sigma_next) / (sigma * sigma)));
+    float sigma_down = std::sqrt(sigma_next * sigma_next - sigma_up * sigma_up);
+    return std::make_pair(sigma_up, sigma_down);
+}
+
+// sample_euler_ancestral
+class EulerAncestralSampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* noise        = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float sigma_up, sigma_down;
+            std::tie(sigma_up, sigma_down) = get_ancestral_step(sigmas[i], sigmas[i + 1]);
+            bool add_noise                 = sigmas[i + 1] > 0;
+            if (add_noise) {
+                ctx.set_noise_randn(noise);
+            }
+
+            // d = (x - denoised) / sigma; x = x + d * dt (Euler method) + noise * s_noise * sigma_up
+            float sigma         = sigmas[i];
+            float dt            = sigma_down - sigmas[i];
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+            float* vec_noise    = (float*)noise->data;
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_x[j] = vec_x[j] + d * dt;
+                    if (add_noise) {
+                        vec_x[j] = vec_x[j] + vec_noise[j] * sigma_up;
+                    }
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration euler_a_registration(EULER_A, [] { return std::make_shared<EulerAncestralSampler>(); });
+
+// Implemented without any sigma churn
+class EulerSampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            // d = (x - denoised) / sigma; x = x + d * dt
+            float sigma         = sigmas[i];
+            float dt            = sigmas[i + 1] - sigma;
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_x[j] = vec_x[j] + d * dt;
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration euler_registration(EULER, [] { return std::make_shared<EulerSampler>(); });
+
+class HeunSampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* d            = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        struct ggml_tensor* x2           = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], -(i + 1))) {
+                return false;
+            }
+
+            float sigma         = sigmas[i];
+            float sigma_next    = sigmas[i + 1];
+            float dt            = sigma_next - sigma;
+            bool euler_step     = sigma_next == 0;
+            float* vec_d        = (float*)d->data;
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_x2       = (float*)x2->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+
+            // d = (x - denoised) / sigma; Euler step x = x + d * dt, or its prediction x2 for the Heun step
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigma;
+                    if (euler_step) {
+                        vec_x[j] = vec_x[j] + vec_d[j] * dt;
+                    } else {
+                        vec_x2[j] = vec_x[j] + vec_d[j] * dt;
+                    }
+                }
+            });
+            if (euler_step) {
+                continue;
+            }
+
+            if (!ctx.denoise(x2, sigma_next, i + 1)) {
+                return false;
+            }
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d2 = (vec_x2[j] - vec_denoised[j]) / sigma_next;
+                    vec_x[j] = vec_x[j] + (vec_d[j] + d2) / 2 * dt;
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration heun_registration(HEUN, [] { return std::make_shared<HeunSampler>(); });
+
+class DPM2Sampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* x2           = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float sigma         = sigmas[i];
+            float sigma_next    = sigmas[i + 1];
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_x2       = (float*)x2->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+
+            if (sigma_next == 0) {
+                // Euler step
+                // d = (x - denoised) / sigma; x = x + d * dt
+                float dt = sigma_next - sigma;
+                latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + d * dt;
+                    }
+                });
+                continue;
+            }
+
+            // DPM-Solver-2
+            float sigma_mid = exp(0.5f * (log(sigma) + log(sigma_next)));
+            float dt_1      = sigma_mid - sigma;
+            float dt_2      = sigma_next - sigma;
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d   = (vec_x[j] - vec_denoised[j]) / sigma;
+                    vec_x2[j] = vec_x[j] + d * dt_1;
+                }
+            });
+
+            if (!ctx.denoise(x2, sigma_mid, i + 1)) {
+                return false;
+            }
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d2 = (vec_x2[j] - vec_denoised[j]) / sigma_mid;
+                    vec_x[j] = vec_x[j] + d2 * dt_2;
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration dpm2_registration(DPM2, [] { return std::make_shared<DPM2Sampler>(); });
+
+class DPMPP2SAncestralSampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* noise        = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        struct ggml_tensor* x2           = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        auto t_fn     = [](float sigma) -> float { return -log(sigma); };
+        auto sigma_fn = [](float t) -> float { return exp(-t); };
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float sigma_up, sigma_down;
+            std::tie(sigma_up, sigma_down) = get_ancestral_step(sigmas[i], sigmas[i + 1]);
+            bool add_noise                 = sigmas[i + 1] > 0;
+            float sigma                    = sigmas[i];
+            float* vec_x                   = (float*)ctx.x->data;
+            float* vec_x2                  = (float*)x2->data;
+            float* vec_noise               = (float*)noise->data;
+            float* vec_denoised            = (float*)ctx.denoised->data;
+
+            if (sigma_down == 0) {
+                // Euler step
+                // TODO: If sigma_down == 0, isn't this wrong?
+                // But
+                // https://github.com/crowsonkb/k-diffusion/blob/master/k_diffusion/sampling.py#L525
+                // has this exactly the same way.
+                float dt = sigma_down - sigma;
+                if (add_noise) {
+                    ctx.set_noise_randn(noise);
+                }
+                latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                    for (int64_t j = begin; j < end; j++) {
+                        float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                        vec_x[j] = vec_x[j] + d * dt;
+                        if (add_noise) {
+                            vec_x[j] = vec_x[j] + vec_noise[j] * sigma_up;
+                        }
+                    }
+                });
+                continue;
+            }
+
+            // DPM-Solver++(2S)
+            float t      = t_fn(sigma);
+            float t_next = t_fn(sigma_down);
+            float h      = t_next - t;
+            float s      = t + 0.5f * h;
+
+            // First half-step
+            float a1 = sigma_fn(s) / sigma_fn(t);
+            float b1 = exp(-h * 0.5f) - 1;
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    vec_x2[j] = a1 * vec_x[j] - b1 * vec_denoised[j];
+                }
+            });
+
+            if (!ctx.denoise(x2, sigmas[i + 1], i + 1)) {
+                return false;
+            }
+
+            // Second half-step, with the noise addition
+            float a2 = sigma_fn(t_next) / sigma_fn(t);
+            float b2 = exp(-h) - 1;
+            if (add_noise) {
+                ctx.set_noise_randn(noise);
+            }
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    vec_x[j] = a2 * vec_x[j] - b2 * vec_denoised[j];
+                    if (add_noise) {
+                        vec_x[j] = vec_x[j] + vec_noise[j] * sigma_up;
+                    }
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration dpmpp2s_a_registration(DPMPP2S_A, [] { return std::make_shared<DPMPP2SAncestralSampler>(); });
+
+// DPM++ (2M) from Karras et al (2022), with v2: the modified DPM++ (2M) from
+// https://github.com/AUTOMATIC1111/stable-diffusion-webui/discussions/8457
+class DPMPP2MSampler : public Sampler {
+protected:
+    bool v2 = false;
+
+public:
+    DPMPP2MSampler(bool v2 = false)
+        : v2(v2) {}
+
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* old_denoised = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        auto t_fn = [](float sigma) -> float { return -log(sigma); };
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float t                 = t_fn(sigmas[i]);
+            float t_next            = t_fn(sigmas[i + 1]);
+            float h                 = t_next - t;
+            float a                 = sigmas[i + 1] / sigmas[i];
+            float b                 = exp(-h) - 1.f;
+            float r                 = 1.f;  // unused for the edge cases
+            bool first_order        = i == 0 || sigmas[i + 1] == 0;  // simpler step for the edge cases
+            float* vec_x            = (float*)ctx.x->data;
+            float* vec_denoised     = (float*)ctx.denoised->data;
+            float* vec_old_denoised = (float*)old_denoised->data;
+
+            if (!first_order) {
+                float h_last = t - t_fn(sigmas[i - 1]);
+                r            = h_last / h;
+                if (v2) {
+                    float h_min = std::min(h_last, h);
+                    float h_max = std::max(h_last, h);
+                    r           = h_max / h_min;
+                    b           = exp(-(h_max + h_min) / 2.f) - 1.f;
+                }
+            }
+
+            // x = a * x - b * denoised_d; old_denoised = denoised
+            float w_denoised     = first_order ? 1.f : 1.f + 1.f / (2.f * r);
+            float w_old_denoised = first_order ? 0.f : 1.f / (2.f * r);
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float denoised_d    = w_denoised * vec_denoised[j] - w_old_denoised * vec_old_denoised[j];
+                    vec_x[j]            = a * vec_x[j] - b * denoised_d;
+                    vec_old_denoised[j] = vec_denoised[j];
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration dpmpp2m_registration(DPMPP2M, [] { return std::make_shared<DPMPP2MSampler>(); });
+static SamplerRegistration dpmpp2mv2_registration(DPMPP2Mv2, [] { return std::make_shared<DPMPP2MSampler>(true); });
+
+// Latent Consistency Models
+class LCMSampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* noise        = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            // x = denoised, += sigmas[i + 1] * noise_sampler(sigmas[i], sigmas[i + 1])
+            float sigma_next    = sigmas[i + 1];
+            bool add_noise      = sigma_next > 0;
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_noise    = (float*)noise->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+            if (add_noise) {
+                ctx.set_noise_randn(noise);
+            }
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    vec_x[j] = vec_denoised[j];
+                    if (add_noise) {
+                        vec_x[j] = vec_x[j] + sigma_next * vec_noise[j];
+                    }
+                }
+            });
+        }
+        return true;
+    }
+};
+static SamplerRegistration lcm_registration(LCM, [] { return std::make_shared<LCMSampler>(); });
+
+/*================================================= Multistep samplers ==================================================*/
+
+// These reuse the model outputs of the previous steps for a higher order step, so they take
+// a single UNet evaluation per step and need fewer steps than the single-step samplers.
+
+#define SD_MULTISTEP_MAX_ORDER 4
+
+// Linear multistep in sigma: x_next = x + sum_k c[k] * d[k], with d[0] = (x - denoised) / sigma
+// the derivative of this step and d[k] the one of k steps back
+class LinearMultistepSampler : public Sampler {
+protected:
+    int max_order;
+
+    // order <= i + 1 is the number of derivatives c of step i applies to
+    virtual int get_order(const std::vector<float>& sigmas, int i) {
+        return std::min(max_order, i + 1);
+    }
+
+    virtual std::vector<float> get_coeffs(const std::vector<float>& sigmas, int i, int order) = 0;
+
+public:
+    LinearMultistepSampler(int max_order)
+        : max_order(std::max(1, std::min(max_order, SD_MULTISTEP_MAX_ORDER))) {}
+
+    bool sample(SamplerContext& ctx) {
+        const std::vector<float>& sigmas = ctx.sigmas;
+        std::vector<ggml_tensor*> old_d;  // old_d[k]: the derivative of k + 1 steps back
+        for (int k = 0; k < max_order - 1; k++) {
+            old_d.push_back(ggml_dup_tensor(ctx.work_ctx, ctx.x));
+        }
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            int order                = get_order(sigmas, i);
+            std::vector<float> coeff = get_coeffs(sigmas, i, order);
+            float c[SD_MULTISTEP_MAX_ORDER];
+            float* vec_old_d[SD_MULTISTEP_MAX_ORDER];
+            for (int k = 0; k < order; k++) {
+                c[k] = coeff[k];
+            }
+            for (size_t k = 0; k < old_d.size(); k++) {
+                vec_old_d[k] = (float*)old_d[k]->data;
+            }
+            float sigma         = sigmas[i];
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+            float* vec_oldest   = old_d.empty() ? NULL : vec_old_d[old_d.size() - 1];
+
+            // x = x + sum_k c[k] * d[k]; the oldest derivative buffer takes d
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float d  = (vec_x[j] - vec_denoised[j]) / sigma;
+                    float dx = c[0] * d;
+                    for (int k = 1; k < order; k++) {
+                        dx += c[k] * vec_old_d[k - 1][j];
+                    }
+                    vec_x[j] = vec_x[j] + dx;
+                    if (vec_oldest != NULL) {
+                        vec_oldest[j] = d;
+                    }
+                }
+            });
+            std::rotate(old_d.rbegin(), old_d.rbegin() + 1, old_d.rend());
+        }
+        return true;
+    }
+};
+
+// improved PNDM, the Adams-Bashforth steps of https://arxiv.org/abs/2204.13902
+class IPNDMSampler : public LinearMultistepSampler {
+protected:
+    std::vector<float> get_coeffs(const std::vector<float>& sigmas, int i, int order) {
+        float dt = sigmas[i + 1] - sigmas[i];
+        switch (order) {
+            case 1:
+                return {dt};
+            case 2:
+                return {dt * 3.f / 2.f, -dt / 2.f};
+            case 3:
+                return {dt * 23.f / 12.f, -dt * 16.f / 12.f, dt * 5.f / 12.f};
+            default:
+                return {dt * 55.f / 24.f, -dt * 59.f / 24.f, dt * 37.f / 24.f, -dt * 9.f / 24.f};
+        }
+    }
+
+public:
+    IPNDMSampler()
+        : LinearMultistepSampler(4) {}
+};
+static SamplerRegistration ipndm_registration(IPNDM, [] { return std::make_shared<IPNDMSampler>(); });
+
+// DEIS (https://arxiv.org/abs/2204.13902): integrates the Lagrange polynomial through the
+// previous derivatives over [sigma, sigma_next] ("tab" mode)
+class DEISSampler : public LinearMultistepSampler {
+protected:
+    int get_order(const std::vector<float>& sigmas, int i) {
+        return sigmas[i + 1] > 0 ? std::min(max_order, i + 1) : 1;
+    }
+
+    std::vector<float> get_coeffs(const std::vector<float>& sigmas, int i, int order) {
+        float sigma      = sigmas[i];
+        float sigma_next = sigmas[i + 1];
+        if (order == 1) {
+            return {sigma_next - sigma};
+        }
+        // the Lagrange bases are at most cubic, so the two point Gauss-Legendre rule is exact
+        float mid     = (sigma + sigma_next) / 2.f;
+        float half    = (sigma_next - sigma) / 2.f;
+        float taus[2] = {mid - half / std::sqrt(3.f), mid + half / std::sqrt(3.f)};
+        std::vector<float> coeffs(order, 0.f);
+        for (int j = 0; j < order; j++) {
+            for (float tau : taus) {
+                float basis = 1.f;
+                for (int k = 0; k < order; k++) {
+                    if (k != j) {
+                        basis *= (tau - sigmas[i - k]) / (sigmas[i - j] - sigmas[i - k]);
+                    }
+                }
+                coeffs[j] += half * basis;
+            }
+        }
+        return coeffs;
+    }
+
+public:
+    DEISSampler()
+        : LinearMultistepSampler(3) {}
+};
+static SamplerRegistration deis_registration(DEIS, [] { return std::make_shared<DEISSampler>(); });
+
+// DPM-Solver++(3M) SDE, with eta = 1 and the ancestral noise of the latents
+class DPMPP3MSDESampler : public Sampler {
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* noise          = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        struct ggml_tensor* old_denoised_1 = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        struct ggml_tensor* old_denoised_2 = ggml_dup_tensor(ctx.work_ctx, ctx.x);
+        const std::vector<float>& sigmas   = ctx.sigmas;
+        const float eta                    = 1.f;
+        float h_1                          = 0.f;
+        float h_2                          = 0.f;
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float* vec_x              = (float*)ctx.x->data;
+            float* vec_denoised       = (float*)ctx.denoised->data;
+            float* vec_noise          = (float*)noise->data;
+            float* vec_old_denoised_1 = (float*)old_denoised_1->data;
+            float* vec_old_denoised_2 = (float*)old_denoised_2->data;
+
+            if (sigmas[i + 1] == 0) {
+                memcpy(vec_x, vec_denoised, ggml_nbytes(ctx.x));
+                continue;
+            }
+
+            float h     = log(sigmas[i]) - log(sigmas[i + 1]);
+            float h_eta = h * (eta + 1.f);
+            float a     = sigmas[i + 1] / sigmas[i] * exp(-h * eta);
+            float b     = -expm1(-h_eta);
+            float phi_2 = expm1(-h_eta) / h_eta + 1.f;
+            float phi_3 = phi_2 / h_eta - 0.5f;
+            float s_up  = sigmas[i + 1] * std::sqrt(-expm1(-2.f * h * eta));
+            int order   = std::min(i, 2);  // the number of previous model outputs
+            float r0    = h_1 / h;
+            float r1    = h_2 / h;
+            ctx.set_noise_randn(noise);
+
+            // x = a * x + b * denoised + phi_2 * d1 - phi_3 * d2 + noise * s_up;
+            // old_denoised_2 takes denoised and becomes old_denoised_1
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float x = a * vec_x[j] + b * vec_denoised[j];
+                    if (order == 2) {
+                        float d1_0 = (vec_denoised[j] - vec_old_denoised_1[j]) / r0;
+                        float d1_1 = (vec_old_denoised_1[j] - vec_old_denoised_2[j]) / r1;
+                        float d1   = d1_0 + (d1_0 - d1_1) * r0 / (r0 + r1);
+                        float d2   = (d1_0 - d1_1) / (r0 + r1);
+                        x          = x + phi_2 * d1 - phi_3 * d2;
+                    } else if (order == 1) {
+                        x = x + phi_2 * (vec_denoised[j] - vec_old_denoised_1[j]) / r0;
+                    }
+                    vec_x[j]              = x + vec_noise[j] * s_up;
+                    vec_old_denoised_2[j] = vec_denoised[j];
+                }
+            });
+            std::swap(old_denoised_1, old_denoised_2);
+            h_2 = h_1;
+            h_1 = h;
+        }
+        return true;
+    }
+};
+static SamplerRegistration dpmpp3m_sde_registration(DPMPP3M_SDE, [] { return std::make_shared<DPMPP3MSDESampler>(); });
+
+// Solves the order x order system a * x = b (row major) by Gaussian elimination with partial pivoting
+__STATIC_INLINE__ std::vector<double> solve_linear_system(std::vector<double> a, std::vector<double> b) {
+    int n = (int)b.size();
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < n; row++) {
+            if (std::fabs(a[row * n + col]) > std::fabs(a[pivot * n + col])) {
+                pivot = row;
+            }
+        }
+        for (int k = 0; k < n; k++) {
+            std::swap(a[col * n + k], a[pivot * n + k]);
+        }
+        std::swap(b[col], b[pivot]);
+        for (int row = col + 1; row < n; row++) {
+            double f = a[row * n + col] / a[col * n + col];
+            for (int k = col; k < n; k++) {
+                a[row * n + k] -= f * a[col * n + k];
+            }
+            b[row] -= f * b[col];
+        }
+    }
+    std::vector<double> x(n);
+    for (int row = n - 1; row >= 0; row--) {
+        double v = b[row];
+        for (int k = row + 1; k < n; k++) {
+            v -= a[row * n + k] * x[k];
+        }
+        x[row] = v / a[row * n + row];
+    }
+    return x;
+}
+
+// UniPC (https://arxiv.org/abs/2302.04867), the B(h) = e^h - 1 (bh2) variant in data prediction.
+// Every step corrects the previous prediction with the model output of this step (UniC),
+// then predicts the next latent (UniP), so the corrector costs no extra evaluation.
+class UniPCSampler : public Sampler {
+protected:
+    int order;
+
+    // Weights w of the step from lambda_s[0] to lambda_t, with lambda = -log(sigma):
+    // x_t = sigma_t / sigma_s0 * x_s0 + sum_k w[k] * m[k], m[k] the model output at lambda_s[k]
+    // and for the corrector m[order] the one at lambda_t
+    static std::vector<float> get_weights(const std::vector<float>& lambda_s, float lambda_t, int order, bool corrector) {
+        double h       = lambda_t - lambda_s[0];
+        double hh      = -h;
+        double h_phi_1 = expm1(hh);
+        double B_h     = expm1(hh);
+
+        std::vector<double> rks;
+        for (int k = 1; k < order; k++) {
+            rks.push_back((lambda_s[k] - lambda_s[0]) / h);
+        }
+        rks.push_back(1.0);
+
+        std::vector<double> R(order * order), b(order);
+        double h_phi_k     = h_phi_1 / hh - 1.0;
+        double factorial_i = 1.0;
+        for (int i = 0; i < order; i++) {
+            for (int k = 0; k < order; k++) {
+                R[i * order + k] = std::pow(rks[k], i);
+            }
+            b[i] = h_phi_k * factorial_i / B_h;
+            factorial_i *= i + 2;
+            h_phi_k = h_phi_k / hh - 1.0 / factorial_i;
+        }
+
+        int n_rhos = corrector ? order : order - 1;
+        std::vector<double> rhos;
+        if (n_rhos == 1) {
+            rhos = {0.5};
+        } else if (n_rhos > 1) {
+            std::vector<double> R_n, b_n(b.begin(), b.begin() + n_rhos);
+            for (int i = 0; i < n_rhos; i++) {
+                R_n.insert(R_n.end(), R.begin() + i * order, R.begin() + i * order + n_rhos);
+            }
+            rhos = solve_linear_system(R_n, b_n);
+        }
+
+        // - h_phi_1 * m[0] - B_h * (sum_k rhos[k - 1] * (m[k] - m[0]) / rks[k - 1] + rhos[order - 1] * (m_t - m[0]))
+        std::vector<float> w(corrector ? order + 1 : order, 0.f);
+        double w0 = -h_phi_1;
+        for (int k = 1; k < order; k++) {
+            double wk = -B_h * rhos[k - 1] / rks[k - 1];
+            w[k]      = (float)wk;
+            w0 -= wk;
+        }
+        if (corrector) {
+            double wt = -B_h * rhos[order - 1];
+            w[order]  = (float)wt;
+            w0 -= wt;
+        }
+        w[0] = (float)w0;
+        return w;
+    }
+
+public:
+    UniPCSampler(int order = 2)
+        : order(std::max(1, std::min(order, SD_MULTISTEP_MAX_ORDER - 1))) {}
+
+    bool sample(SamplerContext& ctx) {
+        const std::vector<float>& sigmas = ctx.sigmas;
+        struct ggml_tensor* x_last       = ggml_dup_tensor(ctx.work_ctx, ctx.x);  // the corrected latent of the last step
+        std::vector<ggml_tensor*> old_denoised;                                     // old_denoised[k]: of k + 1 steps back
+        for (int k = 0; k < order; k++) {
+            old_denoised.push_back(ggml_dup_tensor(ctx.work_ctx, ctx.x));
+        }
+        std::vector<float> lambdas;
+        for (float sigma : sigmas) {
+            lambdas.push_back(sigma > 0 ? -log(sigma) : INFINITY);
+        }
+        int last_order = 0;  // of the last prediction, 0 for no correction
+
+        for (int i = 0; i < ctx.steps(); i++) {
+            if (!ctx.denoise(ctx.x, sigmas[i], i + 1)) {
+                return false;
+            }
+
+            float* vec_x        = (float*)ctx.x->data;
+            float* vec_denoised = (float*)ctx.denoised->data;
+            float* vec_x_last   = (float*)x_last->data;
+
+            if (sigmas[i + 1] == 0) {
+                // the correction of x doesn't change the final prediction
+                memcpy(vec_x, vec_denoised, ggml_nbytes(ctx.x));
+                continue;
+            }
+
+            // m[0] the denoised of this step, m[k] the one of k steps back
+            float* m[SD_MULTISTEP_MAX_ORDER + 1];
+            m[0] = vec_denoised;
+            for (int k = 0; k < order; k++) {
+                m[k + 1] = (float*)old_denoised[k]->data;
+            }
+
+            // UniC from sigmas[i - 1] to sigmas[i], weights on m[0..last_order]
+            float ratio_c = 0.f;
+            float w_c[SD_MULTISTEP_MAX_ORDER + 1];
+            if (last_order > 0) {
+                std::vector<float> lambda_s(lambdas.rend() - i, lambdas.rend() - i + last_order);
+                std::vector<float> w = get_weights(lambda_s, lambdas[i], last_order, true);
+                ratio_c              = sigmas[i] / sigmas[i - 1];
+                w_c[0]               = w[last_order];
+                for (int k = 0; k < last_order; k++) {
+                    w_c[k + 1] = w[k];
+                }
+            }
+
+            // UniP from sigmas[i] to sigmas[i + 1], weights on m[0..p - 1], lower order for the last steps
+            int p = std::min(std::min(order, i + 1), (int)ctx.steps() - i);
+            std::vector<float> lambda_s(lambdas.rend() - i - 1, lambdas.rend() - i - 1 + p);
+            std::vector<float> w = get_weights(lambda_s, lambdas[i + 1], p, false);
+            float ratio_p        = sigmas[i + 1] / sigmas[i];
+            float w_p[SD_MULTISTEP_MAX_ORDER];
+            for (int k = 0; k < p; k++) {
+                w_p[k] = w[k];
+            }
+
+            // x_last = UniC(x_last); x = UniP(x_last); the oldest denoised buffer takes denoised
+            int c         = last_order;
+            float* oldest = m[order];
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    float x_c = vec_x[j];
+                    if (c > 0) {
+                        x_c = ratio_c * vec_x_last[j];
+                        for (int k = 0; k <= c; k++) {
+                            x_c += w_c[k] * m[k][j];
+                        }
+                    }
+                    float x = ratio_p * x_c;
+                    for (int k = 0; k < p; k++) {
+                        x += w_p[k] * m[k][j];
+                    }
+                    vec_x_last[j] = x_c;
+                    vec_x[j]      = x;
+                    oldest[j]     = m[0][j];
+                }
+            });
+            std::rotate(old_denoised.rbegin(), old_denoised.rbegin() + 1, old_denoised.rend());
+            last_order = p;
+        }
+        return true;
+    }
+};
+static SamplerRegistration unipc_registration(UNIPC, [] { return std::make_shared<UniPCSampler>(); });
+
+/*================================================= Adaptive samplers ==================================================*/
+
+// DPM-Solver-12 with adaptive step size (https://arxiv.org/abs/2206.00927, DPM-Solver++ data prediction).
+// Only the first and the last sigma of the schedule are used: each step takes a first order
+// (DDIM) and a second order (midpoint, as DPM++ 2S) step of size h in lambda = -log(sigma)
+// from the same denoised, their difference estimates the local error. The step is accepted if
+// that is within ctx.rtol (relative) / atol (absolute), and h is scaled for the next one.
+// A rejected step reuses the denoised of its start. With ctx.max_nfe, the last step is taken
+// to the end of the schedule when the budget runs out.
+class DPMAdaptiveSampler : public Sampler {
+protected:
+    float atol          = 0.0078f;
+    float h_init        = 0.05f;
+    float accept_safety = 0.81f;
+
+public:
+    bool sample(SamplerContext& ctx) {
+        struct ggml_tensor* denoised_t   = ggml_dup_tensor(ctx.work_ctx, ctx.x);  // the denoised at the start of the step
+        struct ggml_tensor* x_mid        = ggml_dup_tensor(ctx.work_ctx, ctx.x);  // the midpoint, then the second order step
+        struct ggml_tensor* x_low        = ggml_dup_tensor(ctx.work_ctx, ctx.x);  // the first order step
+        const std::vector<float>& sigmas = ctx.sigmas;
+
+        bool to_zero    = sigmas.back() == 0;
+        float sigma_min = to_zero ? sigmas[sigmas.size() - 2] : sigmas.back();
+        float t_start   = -log(sigmas[0]);
+        float t_end     = -log(sigma_min);
+        int n_progress  = (int)ctx.steps();
+        // denoise() steps follow the progress along lambda, the last one is at the end of the schedule
+        auto progress_step = [&](float t) -> int {
+            if (n_progress <= 1 || t_end <= t_start) {
+                return 1;
+            }
+            int step = 1 + (int)((n_progress - 1) * (t - t_start) / (t_end - t_start));
+            return std::min(step, n_progress - 1);
+        };
+
+        float t           = t_start;
+        float h           = h_init;
+        int nfe           = 0;
+        int n_accepted    = 0;
+        int n_rejected    = 0;
+        bool has_denoised = false;  // denoised_t is that of x at t (after a rejected step)
+        while (t < t_end - 1e-5f) {
+            int step      = progress_step(t);
+            // the last step if the budget has no room for another one after this
+            int cost      = (has_denoised ? 1 : 2) + (to_zero ? 1 : 0);
+            bool last_try = ctx.max_nfe > 0 && nfe + cost + 2 > ctx.max_nfe;
+            float h_try   = last_try ? t_end - t : std::min(h, t_end - t);
+
+            float* vec_x          = (float*)ctx.x->data;
+            float* vec_denoised   = (float*)ctx.denoised->data;
+            float* vec_denoised_t = (float*)denoised_t->data;
+            float* vec_x_mid      = (float*)x_mid->data;
+            float* vec_x_low      = (float*)x_low->data;
+
+            if (!has_denoised) {
+                if (!ctx.denoise(ctx.x, exp(-t), -step)) {
+                    return false;
+                }
+                nfe++;
+            }
+
+            // x_mid = a_s * x - b_s * denoised_t; x_low = a * x - b * denoised_t
+            float a_s   = exp(-h_try / 2.f);
+            float b_s   = expm1(-h_try / 2.f);
+            float a     = exp(-h_try);
+            float b     = expm1(-h_try);
+            bool copy_t = !has_denoised;
+            latent_parallel_for(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t j = begin; j < end; j++) {
+                    if (copy_t) {
+                        vec_denoised_t[j] = vec_denoised[j];
+                    }
+                    vec_x_mid[j] = a_s * vec_x[j] - b_s * vec_denoised_t[j];
+                    vec_x_low[j] = a * vec_x[j] - b * vec_denoised_t[j];
+                }
+            });
+
+            if (!ctx.denoise(x_mid, exp(-(t + h_try / 2.f)), step)) {
+                return false;
+            }
+            nfe++;
+
+            // x_mid = a * x - b * denoised_mid; error = rms((x_low - x_mid) / max(atol, rtol * max(|x_low|, |x|)))
+            float abs_tol  = atol;
+            float rel_tol  = ctx.rtol;
+            double err_sum = latent_parallel_sum(ctx.n(), ctx.n_threads, [=](int64_t begin, int64_t end) {
+                double sum = 0;
+                for (int64_t j = begin; j < end; j++) {
+                    vec_x_mid[j] = a * vec_x[j] - b * vec_denoised[j];
+                    float delta  = std::max(abs_tol, rel_tol * std::max(std::fabs(vec_x_low[j]), std::fabs(vec_x[j])));
+                    float e      = (vec_x_low[j] - vec_x_mid[j]) / delta;
+                    sum += e * e;
+                }
+                return sum;
+            });
+            float error = (float)std::sqrt(err_sum / ctx.n());
+
+            // integral controller of order 2, limited
+            float factor = error > 0 ? std::pow(1.f / error, 0.5f) : 10.f;
+            factor       = 1.f + std::atan(factor - 1.f);
+            if (factor >= accept_safety || last_try) {
+                memcpy(vec_x, vec_x_mid, ggml_nbytes(ctx.x));
+                t += h_try;
+                has_denoised = false;
+                n_accepted++;
+            } else {
+                has_denoised = true;
+                n_rejected++;
+            }
+            h = h_try * factor;
+        }
+
+        if (to_zero) {
+            if (!ctx.denoise(ctx.x, sigma_min, n_progress)) {
+                return false;
+            }
+            nfe++;
+            memcpy(ctx.x->data, ctx.denoised->data, ggml_nbytes(ctx.x));
+        }
+        LOG_DEBUG("adaptive sampling: %d steps accepted, %d rejected, %d evaluations", n_accepted, n_rejected, nfe);
+        return true;
+    }
+};
+static SamplerRegistration dpm_adaptive_registration(DPM_ADAPTIVE, [] { return std::make_shared<DPMAdaptiveSampler>(); });
+
+#endif  // __SAMPLER_HPP__
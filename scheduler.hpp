@@ -0,0 +1,268 @@
+#ifndef __SCHEDULER_HPP__
+#define __SCHEDULER_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "ggml_extend.hpp"
+#include "unet.hpp"
+
+/*
+    Continuous batching of the UNet evaluations of concurrent requests.
+    Every request samples in its own thread with the usual samplers; instead of computing
+    the UNet itself, it hands its inputs (one per cond/uncond pass) to the batcher and waits.
+    Once every sampling request is waiting, the evaluations are stacked along the batch dim
+    (grouped by input shapes, each with its own timestep) and computed together.
+    A request joins the running batch with its first evaluation and leaves when its own
+    sigma schedule is done, so requests of different lengths and start times share steps.
+*/
+struct UNetEval {
+    ggml_tensor* x        = NULL;  // [1, C, H, W]
+    float t               = 0.f;
+    ggml_tensor* c        = NULL;
+    ggml_tensor* c_concat = NULL;
+    ggml_tensor* c_vector = NULL;
+    ggml_tensor* out      = NULL;  // same shape as x
+};
+
+class UNetBatcher {
+protected:
+    struct Pending {
+        std::vector<UNetEval>* evals;
+        bool done;
+        bool failed;
+    };
+
+    std::shared_ptr<UNetModel> unet;
+    std::mutex& model_mutex;  // held while computing, the modules of the model aren't reentrant
+    int n_threads;
+    int max_batch;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Pending*> queue;
+    int n_sampling = 0;
+    bool computing = false;
+
+    // requests with different LoRAs can't share the weights
+    int n_admitted = 0;
+    std::string lora_key;
+    // the requests waiting in admit(), oldest first: (ticket, lora key)
+    std::deque<std::pair<uint64_t, std::string>> admit_queue;
+    uint64_t next_ticket = 0;
+
+    static std::string get_group_key(const UNetEval& eval) {
+        std::string key;
+        for (ggml_tensor* t : {eval.x, eval.c, eval.c_concat, eval.c_vector}) {
+            if (t == NULL) {
+                key += "-;";
+            } else {
+                key += format("%d,%d,%d,%d;", (int)t->ne[0], (int)t->ne[1], (int)t->ne[2], (int)t->ne[3]);
+            }
+        }
+        return key;
+    }
+
+    bool compute_group(const std::vector<UNetEval*>& evals) {
+        size_t mem_size = 1024 * 1024;
+        for (UNetEval* eval : evals) {
+            for (ggml_tensor* t : {eval->x, eval->c, eval->c_concat, eval->c_vector, eval->out}) {
+                if (t != NULL) {
+                    mem_size += ggml_nbytes(t) + ggml_tensor_overhead();
+                }
+            }
+        }
+        struct ggml_init_params params;
+        params.mem_size   = mem_size;
+        params.mem_buffer = NULL;
+        params.no_alloc   = false;
+
+        struct ggml_context* ctx = ggml_init(params);
+        if (!ctx) {
+            LOG_ERROR("ggml_init() failed");
+            return false;
+        }
+
+        std::vector<ggml_tensor*> x, c, c_concat, c_vector;
+        std::vector<float> timesteps_vec;
+        for (UNetEval* eval : evals) {
+            x.push_back(eval->x);
+            c.push_back(eval->c);
+            c_concat.push_back(eval->c_concat);
+            c_vector.push_back(eval->c_vector);
+            timesteps_vec.push_back(eval->t);
+        }
+        ggml_tensor* batch_x        = ggml_stack_batch(ctx, x, 3);
+        ggml_tensor* batch_c        = ggml_stack_batch(ctx, c, 2);
+        ggml_tensor* batch_c_concat = evals[0]->c_concat != NULL ? ggml_stack_batch(ctx, c_concat, 3) : NULL;
+        ggml_tensor* batch_c_vector = evals[0]->c_vector != NULL ? ggml_stack_batch(ctx, c_vector, 1) : NULL;
+        ggml_tensor* timesteps      = vector_to_ggml_tensor(ctx, timesteps_vec);
+        ggml_tensor* batch_out      = ggml_dup_tensor(ctx, batch_x);
+        GGML_ASSERT(batch_x != NULL && batch_c != NULL);
+        GGML_ASSERT((evals[0]->c_concat == NULL) == (batch_c_concat == NULL));
+        GGML_ASSERT((evals[0]->c_vector == NULL) == (batch_c_vector == NULL));
+
+        bool ok = false;
+        {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            ok = unet->compute(n_threads, batch_x, timesteps, batch_c, batch_c_concat, batch_c_vector, -1, {}, 0.f, &batch_out);
+        }
+
+        if (ok) {
+            size_t nbytes = ggml_nbytes(evals[0]->out);
+            for (size_t i = 0; i < evals.size(); i++) {
+                memcpy(evals[i]->out->data, (char*)batch_out->data + i * nbytes, nbytes);
+            }
+        }
+        ggml_free(ctx);
+        return ok;
+    }
+
+    void compute(const std::vector<Pending*>& pending, size_t max_batch) {
+        std::map<std::string, std::vector<UNetEval*>> groups;
+        std::map<UNetEval*, Pending*> owners;
+        size_t n_evals = 0;
+        for (Pending* p : pending) {
+            for (UNetEval& eval : *p->evals) {
+                groups[get_group_key(eval)].push_back(&eval);
+                owners[&eval] = p;
+                n_evals++;
+            }
+        }
+        int64_t t0 = ggml_time_ms();
+        for (auto& kv : groups) {
+            std::vector<UNetEval*>& evals = kv.second;
+            for (size_t begin = 0; begin < evals.size(); begin += max_batch) {
+                size_t end = std::min(evals.size(), begin + max_batch);
+                if (!compute_group(std::vector<UNetEval*>(evals.begin() + begin, evals.begin() + end))) {
+                    // fails the requests of the group, the others still get their outputs
+                    for (size_t i = begin; i < end; i++) {
+                        owners[evals[i]]->failed = true;
+                    }
+                }
+            }
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_DEBUG("batched %zu unet evaluations of %zu requests in %zu groups, taking %" PRId64 " ms",
+                  n_evals, pending.size(), groups.size(), t1 - t0);
+    }
+
+public:
+    UNetBatcher(std::shared_ptr<UNetModel> unet, std::mutex& model_mutex, int n_threads, int max_batch = 8)
+        : unet(unet), model_mutex(model_mutex), n_threads(n_threads), max_batch(max_batch > 0 ? max_batch : 1) {}
+
+    void set_max_batch(int n) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_batch = n > 0 ? n : 1;
+    }
+
+    // Blocks until the request may run with lora_key (its LoRAs). Requests with another
+    // key are drained first, the caller applies its LoRAs afterwards. Keys take turns in
+    // arrival order: once a request with another key waits, no more requests join the
+    // running key, so a steady stream of one key can't starve the others.
+    // Returns false without admitting if *cancelled is set while waiting (see notify()).
+    bool admit(const std::string& key, const std::atomic<bool>* cancelled = NULL) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t ticket = next_ticket++;
+        admit_queue.push_back(std::make_pair(ticket, key));
+        cv.wait(lock, [&] {
+            if (cancelled != NULL && *cancelled) {
+                return true;
+            }
+            if (n_admitted > 0 && key != lora_key) {
+                return false;
+            }
+            // only behind older requests with the same key
+            for (auto& waiting : admit_queue) {
+                if (waiting.first == ticket) {
+                    return true;
+                }
+                if (waiting.second != key) {
+                    return false;
+                }
+            }
+            return false;
+        });
+        for (auto it = admit_queue.begin(); it != admit_queue.end(); it++) {
+            if (it->first == ticket) {
+                admit_queue.erase(it);
+                break;
+            }
+        }
+        // the next requests with the same key may follow, or the ones behind a cancelled one
+        cv.notify_all();
+        if (cancelled != NULL && *cancelled) {
+            return false;
+        }
+        lora_key = key;
+        n_admitted++;
+        return true;
+    }
+
+    // wakes the requests waiting in admit(), e.g. after one was cancelled
+    void notify() {
+        std::lock_guard<std::mutex> lock(mutex);
+        cv.notify_all();
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_admitted--;
+        cv.notify_all();
+    }
+
+    // a request starts / ends sampling
+    void join() {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_sampling++;
+    }
+
+    // the last request to leave frees the UNet compute buffer, like an unbatched sample() does
+    void leave() {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_sampling--;
+            last = n_sampling == 0;
+            cv.notify_all();
+        }
+        if (last) {
+            std::lock_guard<std::mutex> lock(model_mutex);
+            unet->free_compute_buffer();
+        }
+    }
+
+    // Evaluates the UNet for evals (of a request between join() and leave()), batched with
+    // the evaluations of the other sampling requests. The last request to arrive computes.
+    // Returns false if the outputs could not be computed.
+    bool eval(std::vector<UNetEval>& evals) {
+        std::unique_lock<std::mutex> lock(mutex);
+        Pending pending = {&evals, false, false};
+        queue.push_back(&pending);
+        cv.notify_all();
+        while (!pending.done) {
+            if (!computing && (int)queue.size() >= n_sampling) {
+                std::vector<Pending*> batch;
+                batch.swap(queue);
+                computing    = true;
+                size_t n_max = max_batch;
+                lock.unlock();
+                compute(batch, n_max);
+                lock.lock();
+                for (Pending* p : batch) {
+                    p->done = true;
+                }
+                computing = false;
+                cv.notify_all();
+            } else {
+                cv.wait(lock);
+            }
+        }
+        return !pending.failed;
+    }
+};
+
+#endif  // __SCHEDULER_HPP__
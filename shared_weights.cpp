@@ -0,0 +1,55 @@
+#include <mutex>
+
+#include "shared_weights.hpp"
+
+// key => pool, the pools are owned by the contexts
+static std::map<std::string, std::weak_ptr<SharedWeights>> shared_weights_registry;
+static std::mutex shared_weights_mutex;
+static bool weight_sharing = false;
+
+bool weight_sharing_enabled() {
+    return weight_sharing;
+}
+
+void set_weight_sharing_enabled(bool enable) {
+    weight_sharing = enable;
+}
+
+std::shared_ptr<SharedWeights> attach_shared_weights(const std::string& key,
+                                                     std::map<std::string, struct ggml_tensor*>& params,
+                                                     std::function<bool(SharedWeights&)> load) {
+    std::lock_guard<std::mutex> lock(shared_weights_mutex);
+    auto it = shared_weights_registry.find(key);
+    if (it != shared_weights_registry.end()) {
+        std::shared_ptr<SharedWeights> shared_weights = it->second.lock();
+        if (shared_weights != NULL) {
+            if (shared_weights->bind(params)) {
+                LOG_INFO("using shared params '%s'", key.c_str());
+                return shared_weights;
+            }
+            LOG_WARN("params don't match the shared params '%s', loading a private copy", key.c_str());
+            return NULL;
+        }
+    }
+
+    std::shared_ptr<SharedWeights> shared_weights = std::make_shared<SharedWeights>();
+    shared_weights->key = key;
+
+    struct ggml_init_params ctx_params;
+    ctx_params.mem_size   = params.size() * ggml_tensor_overhead();
+    ctx_params.mem_buffer = NULL;
+    ctx_params.no_alloc   = true;
+    shared_weights->ctx   = ggml_init(ctx_params);
+    GGML_ASSERT(shared_weights->ctx != NULL);
+    for (auto& kv : params) {
+        ggml_tensor* tensor = ggml_dup_tensor(shared_weights->ctx, kv.second);
+        ggml_set_name(tensor, kv.first.c_str());
+        shared_weights->tensors[kv.first] = tensor;
+    }
+
+    if (!load(*shared_weights) || !shared_weights->bind(params)) {
+        return NULL;
+    }
+    shared_weights_registry[key] = shared_weights;
+    return shared_weights;
+}
@@ -0,0 +1,68 @@
+#ifndef __SHARED_WEIGHTS_HPP__
+#define __SHARED_WEIGHTS_HPP__
+
+#include "ggml_extend.hpp"
+#include "model.h"
+
+/*
+    Params shared read-only between sd contexts that load the same model files.
+    The pool owns one copy of the params (in its own CPU buffer or bound into the
+    mapped model files); the module tensors of every attached context point into it,
+    so N contexts don't need N times the memory. It is released with the last context.
+    A context that has to modify params (e.g. to apply a LoRA) copies just those first
+    and binds them to the pool again once they are back to the original values.
+*/
+struct SharedWeights {
+    std::string key;
+    struct ggml_context* ctx     = NULL;
+    ggml_backend_buffer_t buffer = NULL;
+    std::map<std::string, struct ggml_tensor*> tensors;
+    std::vector<std::shared_ptr<ModelFileMapping>> file_mappings;
+
+    ~SharedWeights() {
+        if (buffer != NULL) {
+            ggml_backend_buffer_free(buffer);
+        }
+        if (ctx != NULL) {
+            ggml_free(ctx);
+        }
+        LOG_DEBUG("released shared params '%s'", key.c_str());
+    }
+
+    // points the params of a context to the shared ones, if every tensor matches
+    bool bind(std::map<std::string, struct ggml_tensor*>& params) {
+        if (params.size() != tensors.size()) {
+            return false;
+        }
+        for (auto& kv : params) {
+            auto it = tensors.find(kv.first);
+            if (it == tensors.end() || !ggml_are_same_shape(it->second, kv.second) || it->second->type != kv.second->type) {
+                return false;
+            }
+            if (kv.second->data != NULL) {
+                return false;
+            }
+        }
+        for (auto& kv : params) {
+            ggml_tensor* src = tensors[kv.first];
+            ggml_backend_tensor_alloc(src->buffer, kv.second, src->data);
+        }
+        return true;
+    }
+};
+
+// off by default, sd_set_weight_sharing()
+bool weight_sharing_enabled();
+void set_weight_sharing_enabled(bool enable);
+
+/*
+    Returns the pool for key, binding params into it. If there is none yet, a pool is
+    created with unallocated copies of params and filled by load().
+    Loading happens under the registry lock, so contexts created concurrently with the
+    same key load the model files once.
+*/
+std::shared_ptr<SharedWeights> attach_shared_weights(const std::string& key,
+                                                     std::map<std::string, struct ggml_tensor*>& params,
+                                                     std::function<bool(SharedWeights&)> load);
+
+#endif  // __SHARED_WEIGHTS_HPP__
@@ -12,6 +12,10 @@
 #include "esrgan.hpp"
 #include "lora.hpp"
 #include "pmid.hpp"
+#include "residency.hpp"
+#include "sampler.hpp"
+#include "scheduler.hpp"
+#include "shared_weights.hpp"
 #include "tae.hpp"
 #include "unet.hpp"
 #include "vae.hpp"
@@ -40,6 +44,11 @@ const char* sampling_methods_str[] = {
     "DPM++ (2M)",
     "modified DPM++ (2M)",
     "LCM",
+    "UniPC",
+    "DPM++ (3M) SDE",
+    "DEIS",
+    "iPNDM",
+    "DPM adaptive",
 };
 
 /*================================================== Helper Functions ================================================*/
@@ -73,6 +82,7 @@ public:
     bool vae_decode_only         = false;
     bool free_params_immediately = false;
 
+    rng_type_t rng_type      = STD_DEFAULT_RNG;
     std::shared_ptr<RNG> rng = std::make_shared<STDDefaultRNG>();
     int n_threads            = -1;
     float scale_factor       = 0.18215f;
@@ -90,6 +100,16 @@ public:
     bool use_tiny_autoencoder = false;
     bool vae_tiling           = false;
     bool stacked_id           = false;
+    bool batch_cfg            = false;  // cond and uncond in one UNet pass
+    bool batch_generation     = false;  // the latents of a batch_count > 1 request in one UNet/VAE pass
+    float adaptive_rtol       = 0.05f;  // DPM_ADAPTIVE
+    int adaptive_max_nfe      = 0;
+    float cfg_sigma_min       = 0.f;  // guidance interval, none if cfg_sigma_max is 0
+    float cfg_sigma_max       = 0.f;
+    float cfg_end             = 1.f;  // fraction of the steps with guidance
+    int cfg_uncond_interval   = 1;    // compute the uncond pass every n steps, reuse it in between
+    int deep_cache_interval   = 0;    // full UNet pass every n steps, 0 or 1 for every step
+    int deep_cache_branch     = 0;
 
     std::map<std::string, struct ggml_tensor*> tensors;
 
@@ -99,6 +119,31 @@ public:
 
     std::shared_ptr<Denoiser> denoiser = std::make_shared<CompVisDenoiser>();
 
+    // keeps the mapped model files alive for the tensors bound into them
+    std::vector<std::shared_ptr<ModelFileMapping>> model_file_mappings;
+
+    // set when params are loaded on demand within a memory budget
+    std::shared_ptr<ParamsResidencyManager> params_residency;
+
+    // set when the params are shared with other contexts loading the same model
+    std::shared_ptr<SharedWeights> shared_weights;
+    // copies of the shared params modified by LoRAs in this context
+    std::map<std::string, ggml_backend_buffer_t> unshared_params;
+    std::set<std::string> pinned_unshared_params;
+    std::vector<std::shared_ptr<GGMLModule>> param_modules;
+
+    // work_ctx of the requests
+    WorkArena work_arena;
+
+    // queued requests (sd_submit_txt2img) run concurrently, the modules are used under model_mutex;
+    // txt2img/img2img/img2vid hold it for the whole call (SyncGeneration)
+    std::mutex model_mutex;
+    std::shared_ptr<UNetBatcher> batcher;
+
+    // of the last txt2img/img2img/img2vid call, see sd_get_metrics()
+    sd_metrics_t last_metrics;
+    bool has_metrics = false;
+
     std::string trigger_word = "img";  // should be user settable
 
     StableDiffusionGGML() = default;
@@ -108,18 +153,26 @@ public:
                         bool free_params_immediately,
                         std::string lora_model_dir,
                         rng_type_t rng_type)
-        : n_threads(n_threads),
-          vae_decode_only(vae_decode_only),
+        : vae_decode_only(vae_decode_only),
           free_params_immediately(free_params_immediately),
+          rng_type(rng_type),
+          n_threads(n_threads),
           lora_model_dir(lora_model_dir) {
-        if (rng_type == STD_DEFAULT_RNG) {
-            rng = std::make_shared<STDDefaultRNG>();
-        } else if (rng_type == CUDA_RNG) {
-            rng = std::make_shared<PhiloxRNG>();
+        rng = new_rng();
+    }
+
+    // a generator of the configured type, e.g. for per image noise of a batch
+    std::shared_ptr<RNG> new_rng() {
+        if (rng_type == CUDA_RNG) {
+            return std::make_shared<PhiloxRNG>();
         }
+        return std::make_shared<STDDefaultRNG>();
     }
 
     ~StableDiffusionGGML() {
+        for (auto& kv : unshared_params) {
+            ggml_backend_buffer_free(kv.second);
+        }
         if (clip_backend != backend) {
             ggml_backend_free(clip_backend);
         }
@@ -143,7 +196,9 @@ public:
                         schedule_t schedule,
                         bool clip_on_cpu,
                         bool control_net_cpu,
-                        bool vae_on_cpu) {
+                        bool vae_on_cpu,
+                        bool use_mmap,
+                        size_t params_mem_budget) {
         use_tiny_autoencoder = taesd_path.size() > 0;
 #ifdef SD_USE_CUBLAS
         LOG_DEBUG("Using CUDA backend");
@@ -168,9 +223,14 @@ public:
 #endif
         LOG_INFO("loading model from '%s'", model_path.c_str());
         ModelLoader model_loader;
+        model_loader.set_n_threads(n_threads);
 
         vae_tiling = vae_tiling_;
 
+        if (vae_path.size() > 0) {
+            // replaced by the separate VAE
+            model_loader.set_tensor_prefixes({}, {"first_stage_model."});
+        }
         if (!model_loader.init_from_file(model_path)) {
             LOG_ERROR("init model loader from file failed: '%s'", model_path.c_str());
             return false;
@@ -178,9 +238,15 @@ public:
 
         if (vae_path.size() > 0) {
             LOG_INFO("loading vae from '%s'", vae_path.c_str());
+            model_loader.set_tensor_prefixes({"first_stage_model."});
             if (!model_loader.init_from_file(vae_path, "vae.")) {
-                LOG_WARN("loading vae from '%s' failed", vae_path.c_str());
+                LOG_WARN("loading vae from '%s' failed, using the vae of the model", vae_path.c_str());
+                if (!model_loader.init_from_file(model_path)) {
+                    LOG_ERROR("init model loader from file failed: '%s'", model_path.c_str());
+                    return false;
+                }
             }
+            model_loader.set_tensor_prefixes({});
         }
 
         version = model_loader.get_sd_version();
@@ -211,16 +277,13 @@ public:
 
         if (version == VERSION_SVD) {
             clip_vision = std::make_shared<FrozenCLIPVisionEmbedder>(backend, model_data_type);
-            clip_vision->alloc_params_buffer();
             clip_vision->get_param_tensors(tensors, "cond_stage_model.");
 
             diffusion_model = std::make_shared<UNetModel>(backend, model_data_type, version);
-            diffusion_model->alloc_params_buffer();
             diffusion_model->get_param_tensors(tensors, "model.diffusion_model");
 
             first_stage_model = std::make_shared<AutoEncoderKL>(backend, model_data_type, vae_decode_only, true);
             LOG_DEBUG("vae_decode_only %d", vae_decode_only);
-            first_stage_model->alloc_params_buffer();
             first_stage_model->get_param_tensors(tensors, "first_stage_model");
         } else {
             clip_backend = backend;
@@ -229,13 +292,11 @@ public:
                 clip_backend = ggml_backend_cpu_init();
             }
             cond_stage_model = std::make_shared<FrozenCLIPEmbedderWithCustomWords>(clip_backend, model_data_type, version);
-            cond_stage_model->alloc_params_buffer();
             cond_stage_model->get_param_tensors(tensors, "cond_stage_model.");
 
             cond_stage_model->embd_dir = embeddings_path;
 
             diffusion_model = std::make_shared<UNetModel>(backend, model_data_type, version);
-            diffusion_model->alloc_params_buffer();
             diffusion_model->get_param_tensors(tensors, "model.diffusion_model");
 
             ggml_type vae_type = model_data_type;
@@ -251,7 +312,6 @@ public:
                     vae_backend = backend;
                 }
                 first_stage_model = std::make_shared<AutoEncoderKL>(vae_backend, vae_type, vae_decode_only);
-                first_stage_model->alloc_params_buffer();
                 first_stage_model->get_param_tensors(tensors, "first_stage_model");
             } else {
                 tae_first_stage = std::make_shared<TinyAutoEncoder>(backend, model_data_type, vae_decode_only);
@@ -284,10 +344,6 @@ public:
                 }
             }
             if (stacked_id) {
-                if (!pmid_model->alloc_params_buffer()) {
-                    LOG_ERROR(" pmid model params buffer allocation failed");
-                    return false;
-                }
                 // LOG_INFO("pmid param memory buffer size = %.2fMB ",
                 //     pmid_model->params_buffer_size / 1024.0 / 1024.0);
                 pmid_model->get_param_tensors(tensors, "pmid");
@@ -306,6 +362,21 @@ public:
             cond_stage_model->tokenizer.load_from_merges(merges_utf8_str);
         }
 
+        // the stages run one after another, so the modules of a backend can share one compute buffer
+        std::map<ggml_backend_t, std::shared_ptr<ComputeBufferPool>> compute_buffer_pools;
+        std::vector<std::shared_ptr<GGMLModule>> compute_modules = {cond_stage_model, clip_vision, diffusion_model, first_stage_model,
+                                                                    tae_first_stage, control_net, pmid_model};
+        for (auto& module : compute_modules) {
+            if (!module) {
+                continue;
+            }
+            std::shared_ptr<ComputeBufferPool>& pool = compute_buffer_pools[module->get_backend()];
+            if (pool == NULL) {
+                pool = std::make_shared<ComputeBufferPool>(module->get_backend());
+            }
+            module->set_compute_buffer_pool(pool);
+        }
+
         struct ggml_init_params params;
         params.mem_size   = static_cast<size_t>(10 * 1024) * 1024;  // 10M
         params.mem_buffer = NULL;
@@ -337,11 +408,118 @@ public:
         if (version == VERSION_SVD) {
             ignore_tensors.insert("conditioner.embedders.3");
         }
-        bool success = model_loader.load_tensors(tensors, backend, ignore_tensors);
-        if (!success) {
-            LOG_ERROR("load tensors from model loader failed");
-            ggml_free(ctx);
-            return false;
+
+        param_modules = {clip_vision, cond_stage_model, diffusion_model, first_stage_model};
+
+        if (params_mem_budget > 0) {
+            // clip/unet/vae params are allocated and loaded on first use, the load below only validates them
+            auto residency_loader = std::make_shared<ModelLoader>(model_loader);
+            residency_loader->set_use_mmap(use_mmap);  // read through the mapping, never bind into it
+            params_residency = std::make_shared<ParamsResidencyManager>(residency_loader, params_mem_budget);
+            for (auto& module : param_modules) {
+                if (module) {
+                    params_residency->add(module.get(), tensors);
+                }
+            }
+            params_residency->on_params_loaded = [this](GGMLModule* module, std::map<std::string, struct ggml_tensor*>& module_tensors) {
+                // LoRAs applied while the module was evicted
+                for (auto& kv : curr_lora_state) {
+                    apply_lora(kv.first, kv.second, module_tensors);
+                }
+                return true;
+            };
+            param_modules.clear();
+            LOG_INFO("params memory budget: %.2fMB, loading params on demand", params_mem_budget / 1024.0 / 1024.0);
+        }
+
+        if (stacked_id) {
+            param_modules.push_back(pmid_model);
+        }
+        param_modules.erase(std::remove(param_modules.begin(), param_modules.end(), nullptr), param_modules.end());
+
+        if (weight_sharing_enabled() && params_residency == NULL && ggml_backend_is_cpu(backend)) {
+            std::map<std::string, struct ggml_tensor*> params = get_module_params();
+            // everything that decides which params are created and how they are loaded
+            std::string key = format("%s|%s|%s|%d|%d|%s",
+                                     model_path.c_str(),
+                                     vae_path.c_str(),
+                                     stacked_id ? id_embeddings_path.c_str() : "",
+                                     use_tiny_autoencoder,
+                                     vae_decode_only,
+                                     ggml_type_name(model_data_type));
+            shared_weights = attach_shared_weights(key, params, [&](SharedWeights& pool) -> bool {
+                if (use_mmap) {
+                    model_loader.set_use_mmap(true);
+                    model_loader.set_bind_to_mmap(true);
+                    if (!model_loader.load_tensors(pool.tensors, backend, ignore_tensors)) {
+                        return false;
+                    }
+                    pool.file_mappings = model_loader.get_file_mappings();
+                }
+                pool.buffer = ggml_backend_alloc_ctx_tensors(pool.ctx, backend);
+                for (auto& kv : pool.tensors) {
+                    if (kv.second->data == NULL) {
+                        LOG_ERROR("shared params buffer allocation failed");
+                        return false;
+                    }
+                }
+                return model_loader.load_tensors(pool.tensors, backend, ignore_tensors);
+            });
+            if (shared_weights == NULL) {
+                LOG_WARN("sharing params failed, loading them for this context only");
+            }
+        }
+
+        // params buffers are allocated after the mmap pass, so tensors bound into the
+        // mapped model file don't take any extra memory
+        bool mmap_weights = use_mmap && ggml_backend_is_cpu(backend) && params_residency == NULL && shared_weights == NULL;
+        if (mmap_weights) {
+            model_loader.set_use_mmap(true);
+            model_loader.set_bind_to_mmap(true);
+            if (!model_loader.load_tensors(tensors, backend, ignore_tensors)) {
+                LOG_ERROR("map tensors from model loader failed");
+                ggml_free(ctx);
+                return false;
+            }
+            model_file_mappings = model_loader.get_file_mappings();
+        }
+
+        for (auto& module : param_modules) {
+            if (!module->alloc_params_buffer()) {
+                LOG_ERROR("%s params buffer allocation failed", module->get_desc().c_str());
+                ggml_free(ctx);
+                return false;
+            }
+        }
+
+        if (shared_weights == NULL) {
+            bool success = model_loader.load_tensors(tensors, backend, ignore_tensors);
+            if (!success) {
+                LOG_ERROR("load tensors from model loader failed");
+                ggml_free(ctx);
+                return false;
+            }
+        } else {
+            // the pool only holds the module params, the others (alphas_cumprod) are per context
+            std::map<std::string, struct ggml_tensor*> params = get_module_params();
+            auto on_new_tensor_cb = [&](const TensorStorage& tensor_storage, ggml_tensor** dst_tensor) -> bool {
+                auto it = tensors.find(tensor_storage.name);
+                if (it == tensors.end() || params.find(it->first) != params.end()) {
+                    return true;
+                }
+                if (ggml_nelements(it->second) != tensor_storage.nelements()) {
+                    LOG_ERROR("tensor '%s' has wrong shape in model file", tensor_storage.name.c_str());
+                    return false;
+                }
+                *dst_tensor = it->second;
+                return true;
+            };
+            model_loader.set_bind_to_mmap(false);
+            if (!model_loader.load_tensors(on_new_tensor_cb, backend)) {
+                LOG_ERROR("load tensors from model loader failed");
+                ggml_free(ctx);
+                return false;
+            }
         }
 
         // LOG_DEBUG("model size = %.2fMB", total_size / 1024.0 / 1024.0);
@@ -500,7 +678,9 @@ public:
         return result < -1;
     }
 
-    void apply_lora(const std::string& lora_name, float multiplier) {
+    void apply_lora(const std::string& lora_name,
+                    float multiplier,
+                    std::map<std::string, struct ggml_tensor*>& target_tensors) {
         int64_t t0                 = ggml_time_ms();
         std::string st_file_path   = path_join(lora_model_dir, lora_name + ".safetensors");
         std::string ckpt_file_path = path_join(lora_model_dir, lora_name + ".ckpt");
@@ -520,14 +700,128 @@ public:
         }
 
         lora.multiplier = multiplier;
-        lora.apply(tensors, n_threads);
+        bool applied    = false;
+        if (params_residency) {
+            // only the resident params, evicted modules get their LoRAs when loaded again
+            std::map<std::string, struct ggml_tensor*> resident_tensors;
+            for (auto& kv : target_tensors) {
+                if (kv.second->data != NULL) {
+                    resident_tensors[kv.first] = kv.second;
+                }
+            }
+            lora.warn_unused_tensors = false;
+            applied                  = lora.apply(resident_tensors, n_threads);
+        } else {
+            if (!unshare_params(lora.get_target_tensors(target_tensors))) {
+                LOG_WARN("can not apply lora '%s' to shared params", lora_name.c_str());
+                return;
+            }
+            applied = lora.apply(target_tensors, n_threads);
+        }
         lora.free_params_buffer();
+        if (!applied) {
+            LOG_WARN("apply lora '%s' failed", lora_name.c_str());
+            return;
+        }
 
         int64_t t1 = ggml_time_ms();
 
         LOG_INFO("lora '%s' applied, taking %.2fs", lora_name.c_str(), (t1 - t0) * 1.0f / 1000);
     }
 
+    // the entries of tensors that are params of param_modules
+    std::map<std::string, struct ggml_tensor*> get_module_params() {
+        std::set<struct ggml_tensor*> module_params;
+        for (auto& module : param_modules) {
+            struct ggml_context* params_ctx = module->get_params_ctx();
+            for (ggml_tensor* t = ggml_get_first_tensor(params_ctx); t != NULL; t = ggml_get_next_tensor(params_ctx, t)) {
+                module_params.insert(t);
+            }
+        }
+        std::map<std::string, struct ggml_tensor*> params;
+        for (auto& kv : tensors) {
+            if (module_params.find(kv.second) != module_params.end()) {
+                params[kv.first] = kv.second;
+            }
+        }
+        return params;
+    }
+
+    // points an unshared param back to the shared one
+    void rebind_shared_param(const std::string& name) {
+        ggml_tensor* src    = shared_weights->tensors[name];
+        ggml_tensor* tensor = tensors[name];
+        tensor->data        = NULL;
+        tensor->buffer      = NULL;
+        ggml_backend_tensor_alloc(src->buffer, tensor, src->data);
+    }
+
+    // gives this context its own copy of the shared params in names, before they are modified.
+    // pinned copies are kept for the life of the context (the PhotoMaker LoRA is never removed)
+    bool unshare_params(const std::set<std::string>& names, bool pinned = false) {
+        if (shared_weights == NULL) {
+            return true;
+        }
+        int64_t t0 = ggml_time_ms();
+        std::vector<std::string> copied;
+        size_t copied_size = 0;
+        for (auto& name : names) {
+            auto it = shared_weights->tensors.find(name);
+            if (it == shared_weights->tensors.end() || unshared_params.find(name) != unshared_params.end()) {
+                continue;
+            }
+            ggml_tensor* src             = it->second;
+            ggml_backend_buffer_t buffer = ggml_backend_buft_alloc_buffer(ggml_backend_buffer_get_type(src->buffer), ggml_nbytes(src));
+            if (buffer == NULL) {
+                LOG_ERROR("params buffer allocation failed for %s", name.c_str());
+                // keep using the shared params
+                for (auto& copied_name : copied) {
+                    rebind_shared_param(copied_name);
+                    ggml_backend_buffer_free(unshared_params[copied_name]);
+                    unshared_params.erase(copied_name);
+                }
+                return false;
+            }
+            ggml_tensor* tensor = tensors[name];
+            tensor->data        = NULL;
+            tensor->buffer      = NULL;
+            ggml_backend_tensor_alloc(buffer, tensor, ggml_backend_buffer_get_base(buffer));
+            ggml_backend_tensor_set(tensor, src->data, 0, ggml_nbytes(src));
+            unshared_params[name] = buffer;
+            copied.push_back(name);
+            copied_size += ggml_nbytes(src);
+        }
+        if (pinned) {
+            for (auto& name : names) {
+                if (unshared_params.find(name) != unshared_params.end()) {
+                    pinned_unshared_params.insert(name);
+                }
+            }
+        }
+        int64_t t1 = ggml_time_ms();
+        LOG_INFO("copied %lu shared params (%.2fMB) for this context, taking %.2fs",
+                 copied.size(), copied_size / 1024.0 / 1024.0, (t1 - t0) * 1.0f / 1000);
+        return true;
+    }
+
+    // drops the copies of the unshared params, except the pinned ones
+    void reshare_params() {
+        size_t count = 0;
+        for (auto it = unshared_params.begin(); it != unshared_params.end();) {
+            if (pinned_unshared_params.find(it->first) != pinned_unshared_params.end()) {
+                it++;
+                continue;
+            }
+            rebind_shared_param(it->first);
+            ggml_backend_buffer_free(it->second);
+            it = unshared_params.erase(it);
+            count++;
+        }
+        if (count > 0) {
+            LOG_INFO("%lu params bound to the shared params again", count);
+        }
+    }
+
     void apply_loras(const std::unordered_map<std::string, float>& lora_state) {
         if (lora_state.size() > 0 && model_data_type != GGML_TYPE_F16 && model_data_type != GGML_TYPE_F32) {
             LOG_WARN("In quantized models when applying LoRA, the images have poor quality.");
@@ -551,10 +845,13 @@ public:
         LOG_INFO("Attempting to apply %lu LoRAs", lora_state.size());
 
         for (auto& kv : lora_state_diff) {
-            apply_lora(kv.first, kv.second);
+            apply_lora(kv.first, kv.second, tensors);
         }
 
         curr_lora_state = lora_state;
+        if (curr_lora_state.size() == 0) {
+            reshare_params();
+        }
     }
 
     std::string remove_trigger_from_prompt(ggml_context* work_ctx,
@@ -606,7 +903,9 @@ public:
                             ggml_tensor* prompts_embeds,
                             std::vector<bool>& class_tokens_mask) {
         ggml_tensor* res = NULL;
-        pmid_model->compute(n_threads, init_img, prompts_embeds, class_tokens_mask, &res, work_ctx);
+        if (!pmid_model->compute(n_threads, init_img, prompts_embeds, class_tokens_mask, &res, work_ctx)) {
+            return NULL;
+        }
 
         return res;
     }
@@ -664,9 +963,13 @@ public:
                 // printf("\n");
             }
 
-            cond_stage_model->compute(n_threads, input_ids, input_ids2, max_token_idx, false, &chunk_hidden_states, work_ctx);
+            if (!cond_stage_model->compute(n_threads, input_ids, input_ids2, max_token_idx, false, &chunk_hidden_states, work_ctx)) {
+                return {NULL, NULL};
+            }
             if (version == VERSION_XL && chunk_idx == 0) {
-                cond_stage_model->compute(n_threads, input_ids, input_ids2, max_token_idx, true, &pooled, work_ctx);
+                if (!cond_stage_model->compute(n_threads, input_ids, input_ids2, max_token_idx, true, &pooled, work_ctx)) {
+                    return {NULL, NULL};
+                }
             }
             // if (pooled != NULL) {
             //     print_ggml_tensor(chunk_hidden_states);
@@ -772,7 +1075,9 @@ public:
                 resized_image.data = NULL;
 
                 // print_ggml_tensor(pixel_values);
-                clip_vision->compute(n_threads, pixel_values, &c_crossattn, work_ctx);
+                if (!clip_vision->compute(n_threads, pixel_values, &c_crossattn, work_ctx)) {
+                    return std::make_tuple<ggml_tensor*, ggml_tensor*, ggml_tensor*>(NULL, NULL, NULL);
+                }
                 // print_ggml_tensor(c_crossattn);
             }
         }
@@ -806,6 +1111,9 @@ public:
                 }
                 print_ggml_tensor(init_img);
                 ggml_tensor* moments = encode_first_stage(work_ctx, init_img);
+                if (moments == NULL) {
+                    return std::make_tuple<ggml_tensor*, ggml_tensor*, ggml_tensor*>(NULL, NULL, NULL);
+                }
                 print_ggml_tensor(moments);
                 c_concat = get_first_stage_encoding(work_ctx, moments);
             }
@@ -827,6 +1135,41 @@ public:
         return {c_crossattn, c_concat, y};
     }
 
+    void reset_metrics(sd_metrics_t* metrics) {
+        memset(metrics, 0, sizeof(sd_metrics_t));
+    }
+
+    // the sample() on_step callback recording the denoiser calls into metrics
+    std::function<bool(int, float, ggml_tensor*)> collect_step_metrics(sd_metrics_t* metrics) {
+        return [metrics](int step, float step_ms, ggml_tensor* denoised) -> bool {
+            if (metrics->n_unet_evals < SD_METRICS_MAX_UNET_EVALS) {
+                metrics->unet_eval_ms[metrics->n_unet_evals] = step_ms;
+            }
+            metrics->n_unet_evals++;
+            return true;
+        };
+    }
+
+    void fill_module_metrics(sd_metrics_t* metrics) {
+        std::shared_ptr<GGMLModule> modules[SD_MODULE_COUNT];
+        modules[SD_MODULE_CLIP]        = cond_stage_model;
+        modules[SD_MODULE_CLIP_VISION] = clip_vision;
+        modules[SD_MODULE_UNET]        = diffusion_model;
+        modules[SD_MODULE_VAE]         = use_tiny_autoencoder ? std::shared_ptr<GGMLModule>(tae_first_stage) : std::shared_ptr<GGMLModule>(first_stage_model);
+        modules[SD_MODULE_CONTROL_NET] = control_net;
+        modules[SD_MODULE_PMID]        = pmid_model;
+        for (int i = 0; i < SD_MODULE_COUNT; i++) {
+            if (modules[i] == NULL) {
+                continue;
+            }
+            metrics->compute_buffer_peak[i]   = modules[i]->get_compute_buffer_peak();
+            metrics->compute_buffer_allocs[i] = modules[i]->get_compute_buffer_allocs();
+            metrics->params_buffer_size[i]    = modules[i]->get_params_buffer_size();
+        }
+        metrics->work_mem_high_water = work_arena.get_high_water();
+        metrics->work_mem_allocs     = work_arena.get_n_allocs();
+    }
+
     ggml_tensor* sample(ggml_context* work_ctx,
                         ggml_tensor* x_t,
                         ggml_tensor* noise,
@@ -844,7 +1187,10 @@ public:
                         const std::vector<float>& sigmas,
                         int start_merge_step,
                         ggml_tensor* c_id,
-                        ggml_tensor* c_vec_id) {
+                        ggml_tensor* c_vec_id,
+                        const std::vector<std::shared_ptr<RNG>>& batch_rngs   = {},
+                        UNetBatcher* batcher                                  = NULL,
+                        std::function<bool(int, float, ggml_tensor*)> on_step = nullptr) {
         size_t steps = sigmas.size() - 1;
         // x_t = load_tensor_from_file(work_ctx, "./rand0.bin");
         // print_ggml_tensor(x_t);
@@ -853,6 +1199,15 @@ public:
 
         struct ggml_tensor* noised_input = ggml_dup_tensor(work_ctx, x_t);
 
+        // ancestral noise, one rng per latent of the batch if given
+        auto set_noise_randn = [&](ggml_tensor* noise) {
+            if (batch_rngs.empty()) {
+                ggml_tensor_set_f32_randn(noise, rng);
+            } else {
+                ggml_tensor_set_f32_randn(noise, batch_rngs);
+            }
+        };
+
         bool has_unconditioned = cfg_scale != 1.0 && uc != NULL;
 
         if (noise == NULL) {
@@ -872,7 +1227,81 @@ public:
         }
         struct ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
 
-        auto denoise = [&](ggml_tensor* input, float sigma, int step) {
+        // batched CFG: cond and uncond stacked along the batch dim, one UNet (and ControlNet) pass per step
+        struct BatchedCond {
+            ggml_tensor* c        = NULL;
+            ggml_tensor* c_concat = NULL;
+            ggml_tensor* c_vector = NULL;
+        };
+        auto stack_cond = [&](ggml_tensor* cond, ggml_tensor* cond_vector, BatchedCond& batched) -> bool {
+            batched.c = ggml_stack_batch(work_ctx, {cond, uc}, 2);
+            if (batched.c == NULL) {
+                return false;
+            }
+            if (c_concat != NULL || uc_concat != NULL) {
+                batched.c_concat = ggml_stack_batch(work_ctx, {c_concat, uc_concat}, 3);
+                if (batched.c_concat == NULL) {
+                    return false;
+                }
+            }
+            if (cond_vector != NULL || uc_vector != NULL) {
+                batched.c_vector = ggml_stack_batch(work_ctx, {cond_vector, uc_vector}, 1);
+                if (batched.c_vector == NULL) {
+                    return false;
+                }
+            }
+            return true;
+        };
+        BatchedCond batched_cond;
+        BatchedCond batched_cond_id;  // photomaker, after start_merge_step
+        bool batched = batcher == NULL && batch_cfg && has_unconditioned && version != VERSION_SVD && x->ne[3] == 1 &&
+                       stack_cond(c, c_vector, batched_cond) &&
+                       (start_merge_step == -1 || stack_cond(c_id, c_vec_id, batched_cond_id));
+        struct ggml_tensor* batched_input = NULL;
+        struct ggml_tensor* batched_out   = NULL;
+        if (batched) {
+            batched_input = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, x->ne[0], x->ne[1], x->ne[2], 2);
+            batched_out   = ggml_dup_tensor(work_ctx, batched_input);
+        } else if (batch_cfg && has_unconditioned) {
+            LOG_DEBUG("cond and uncond inputs can't be stacked, using separate passes");
+        }
+
+        bool stopped = false;
+        bool failed  = false;
+
+        // CFG schedule: the uncond pass is skipped outside of the guidance interval and the cfg_end
+        // fraction of the steps, and reused between the steps it is computed (every cfg_uncond_interval)
+        bool has_uncond_out = false;
+        auto is_guided      = [&](float sigma, int step_index) -> bool {
+            if (!has_unconditioned) {
+                return false;
+            }
+            if (cfg_sigma_max > 0 && (sigma < cfg_sigma_min || sigma > cfg_sigma_max)) {
+                return false;
+            }
+            return step_index < cfg_end * steps;
+        };
+
+        // DeepCache: a full UNet pass every deep_cache_interval steps keeps the deep features,
+        // the passes of the steps in between only compute the blocks above deep_cache_branch.
+        // Slots: 0 cond, 1 uncond, 2 batched cond + uncond
+        std::vector<int> deep_cache_step(3, -1);  // the full step the features of a slot are from
+        auto set_deep_cache = [&](int slot, int step_index, int64_t n) {
+            if (deep_cache_interval <= 1 || batcher != NULL) {
+                return;
+            }
+            int full_step = step_index - step_index % deep_cache_interval;
+            bool reuse    = step_index != full_step && deep_cache_step[slot] == full_step &&
+                         diffusion_model->has_deep_cache(slot, n);
+            if (!reuse) {
+                deep_cache_step[slot] = full_step;
+            }
+            diffusion_model->set_deep_cache(reuse ? DEEP_CACHE_REUSE : DEEP_CACHE_FILL, slot, deep_cache_branch);
+        };
+
+        // returns false if on_step stopped the sampling or the params are not available
+        auto denoise = [&](ggml_tensor* input, float sigma, int step) -> bool {
+            profiler_set_step(std::abs(step));
             if (step == 1) {
                 pretty_progress(0, (int)steps, 0);
             }
@@ -902,474 +1331,203 @@ public:
 
             std::vector<struct ggml_tensor*> controls;
 
-            if (control_hint != NULL) {
-                control_net->compute(n_threads, noised_input, control_hint, timesteps, c, c_vector);
-                controls = control_net->controls;
-                // print_ggml_tensor(controls[12]);
-                // GGML_ASSERT(0);
-            }
-
-            if (start_merge_step == -1 || step <= start_merge_step) {
-                // cond
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         c,
-                                         c_concat,
-                                         c_vector,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_cond);
-            } else {
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         c_id,
-                                         c_concat,
-                                         c_vec_id,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_cond);
-            }
-
-            float* negative_data = NULL;
-            if (has_unconditioned) {
-                // uncond
-                if (control_hint != NULL) {
-                    control_net->compute(n_threads, noised_input, control_hint, timesteps, uc, uc_vector);
-                    controls = control_net->controls;
-                }
-                diffusion_model->compute(n_threads,
-                                         noised_input,
-                                         timesteps,
-                                         uc,
-                                         uc_concat,
-                                         uc_vector,
-                                         -1,
-                                         controls,
-                                         control_strength,
-                                         &out_uncond);
-                negative_data = (float*)out_uncond->data;
-            }
-            float* vec_denoised  = (float*)denoised->data;
-            float* vec_input     = (float*)input->data;
-            float* positive_data = (float*)out_cond->data;
-            int ne_elements      = (int)ggml_nelements(denoised);
-            for (int i = 0; i < ne_elements; i++) {
-                float latent_result = positive_data[i];
-                if (has_unconditioned) {
-                    // out_uncond + cfg_scale * (out_cond - out_uncond)
-                    int64_t ne3 = out_cond->ne[3];
-                    if (min_cfg != cfg_scale && ne3 != 1) {
-                        int64_t i3  = i / out_cond->ne[0] * out_cond->ne[1] * out_cond->ne[2];
-                        float scale = min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / ne3);
-                    } else {
-                        latent_result = negative_data[i] + cfg_scale * (positive_data[i] - negative_data[i]);
-                    }
+            int step_index  = std::abs(step) - 1;
+            bool guided     = is_guided(sigma, step_index);
+            bool run_uncond = guided && (!has_uncond_out || step_index % cfg_uncond_interval == 0);
+            has_uncond_out  = has_uncond_out || run_uncond;
+
+            float* negative_data = guided ? (float*)out_uncond->data : NULL;
+            if (batcher != NULL) {
+                // computed together with the other requests, see UNetBatcher
+                std::vector<UNetEval> evals(run_uncond ? 2 : 1);
+                bool merged        = start_merge_step != -1 && step > start_merge_step;
+                evals[0].x         = noised_input;
+                evals[0].t         = t;
+                evals[0].c         = merged ? c_id : c;
+                evals[0].c_concat  = c_concat;
+                evals[0].c_vector  = merged ? c_vec_id : c_vector;
+                evals[0].out       = out_cond;
+                if (run_uncond) {
+                    evals[1].x        = noised_input;
+                    evals[1].t        = t;
+                    evals[1].c        = uc;
+                    evals[1].c_concat = uc_concat;
+                    evals[1].c_vector = uc_vector;
+                    evals[1].out      = out_uncond;
                 }
-                // v = latent_result, eps = latent_result
-                // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
-                vec_denoised[i] = latent_result * c_out + vec_input[i] * c_skip;
-            }
-            int64_t t1 = ggml_time_us();
-            if (step > 0) {
-                pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
-                // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
-            }
-        };
-
-        // sample_euler_ancestral
-        switch (method) {
-            case EULER_A: {
-                struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* d     = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    float sigma = sigmas[i];
-
-                    // denoise
-                    denoise(x, sigma, i + 1);
-
-                    // d = (x - denoised) / sigma
-                    {
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        for (int i = 0; i < ggml_nelements(d); i++) {
-                            vec_d[i] = (vec_x[i] - vec_denoised[i]) / sigma;
-                        }
-                    }
-
-                    // get_ancestral_step
-                    float sigma_up   = std::min(sigmas[i + 1],
-                                                std::sqrt(sigmas[i + 1] * sigmas[i + 1] * (sigmas[i] * sigmas[i] - sigmas[i + 1] * sigmas[i + 1]) / (sigmas[i] * sigmas[i])));
-                    float sigma_down = std::sqrt(sigmas[i + 1] * sigmas[i + 1] - sigma_up * sigma_up);
-
-                    // Euler method
-                    float dt = sigma_down - sigmas[i];
-                    // x = x + d * dt
-                    {
-                        float* vec_d = (float*)d->data;
-                        float* vec_x = (float*)x->data;
-
-                        for (int i = 0; i < ggml_nelements(x); i++) {
-                            vec_x[i] = vec_x[i] + vec_d[i] * dt;
-                        }
-                    }
-
-                    if (sigmas[i + 1] > 0) {
-                        // x = x + noise_sampler(sigmas[i], sigmas[i + 1]) * s_noise * sigma_up
-                        ggml_tensor_set_f32_randn(noise, rng);
-                        // noise = load_tensor_from_file(work_ctx, "./rand" + std::to_string(i+1) + ".bin");
-                        {
-                            float* vec_x     = (float*)x->data;
-                            float* vec_noise = (float*)noise->data;
-
-                            for (int i = 0; i < ggml_nelements(x); i++) {
-                                vec_x[i] = vec_x[i] + vec_noise[i] * sigma_up;
-                            }
-                        }
-                    }
+                if (!batcher->eval(evals)) {
+                    failed = true;
+                    return false;
                 }
-            } break;
-            case EULER:  // Implemented without any sigma churn
-            {
-                struct ggml_tensor* d = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    float sigma = sigmas[i];
-
-                    // denoise
-                    denoise(x, sigma, i + 1);
+            } else if (batched && run_uncond) {
+                const BatchedCond& cond = (start_merge_step == -1 || step <= start_merge_step) ? batched_cond : batched_cond_id;
+                size_t nbytes           = ggml_nbytes(noised_input);
+                memcpy(batched_input->data, noised_input->data, nbytes);
+                memcpy((char*)batched_input->data + nbytes, noised_input->data, nbytes);
+                std::vector<float> batched_timesteps_vec(2, t);
+                auto batched_timesteps = vector_to_ggml_tensor(work_ctx, batched_timesteps_vec);
 
-                    // d = (x - denoised) / sigma
-                    {
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        for (int j = 0; j < ggml_nelements(d); j++) {
-                            vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigma;
-                        }
-                    }
-
-                    float dt = sigmas[i + 1] - sigma;
-                    // x = x + d * dt
-                    {
-                        float* vec_d = (float*)d->data;
-                        float* vec_x = (float*)x->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                        }
+                if (control_hint != NULL) {
+                    // the hint (batch 1) is broadcast over both halves
+                    if (!control_net->compute(n_threads, batched_input, control_hint, batched_timesteps, cond.c, cond.c_vector)) {
+                        failed = true;
+                        return false;
                     }
+                    controls = control_net->controls;
                 }
-            } break;
-            case HEUN: {
-                struct ggml_tensor* d  = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* x2 = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    // denoise
-                    denoise(x, sigmas[i], -(i + 1));
-
-                    // d = (x - denoised) / sigma
-                    {
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigmas[i];
-                        }
-                    }
-
-                    float dt = sigmas[i + 1] - sigmas[i];
-                    if (sigmas[i + 1] == 0) {
-                        // Euler step
-                        // x = x + d * dt
-                        float* vec_d = (float*)d->data;
-                        float* vec_x = (float*)x->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                        }
-                    } else {
-                        // Heun step
-                        float* vec_d  = (float*)d->data;
-                        float* vec_d2 = (float*)d->data;
-                        float* vec_x  = (float*)x->data;
-                        float* vec_x2 = (float*)x2->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x2[j] = vec_x[j] + vec_d[j] * dt;
-                        }
-
-                        denoise(x2, sigmas[i + 1], i + 1);
-                        float* vec_denoised = (float*)denoised->data;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            float d2 = (vec_x2[j] - vec_denoised[j]) / sigmas[i + 1];
-                            vec_d[j] = (vec_d[j] + d2) / 2;
-                            vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                        }
-                    }
+                set_deep_cache(2, step_index, batched_input->ne[3]);
+                if (!diffusion_model->compute(n_threads,
+                                              batched_input,
+                                              batched_timesteps,
+                                              cond.c,
+                                              cond.c_concat,
+                                              cond.c_vector,
+                                              -1,
+                                              controls,
+                                              control_strength,
+                                              &batched_out)) {
+                    failed = true;
+                    return false;
                 }
-            } break;
-            case DPM2: {
-                struct ggml_tensor* d  = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* x2 = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    // denoise
-                    denoise(x, sigmas[i], i + 1);
-
-                    // d = (x - denoised) / sigma
-                    {
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigmas[i];
-                        }
-                    }
-
-                    if (sigmas[i + 1] == 0) {
-                        // Euler step
-                        // x = x + d * dt
-                        float dt     = sigmas[i + 1] - sigmas[i];
-                        float* vec_d = (float*)d->data;
-                        float* vec_x = (float*)x->data;
-
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                        }
-                    } else {
-                        // DPM-Solver-2
-                        float sigma_mid = exp(0.5f * (log(sigmas[i]) + log(sigmas[i + 1])));
-                        float dt_1      = sigma_mid - sigmas[i];
-                        float dt_2      = sigmas[i + 1] - sigmas[i];
-
-                        float* vec_d  = (float*)d->data;
-                        float* vec_x  = (float*)x->data;
-                        float* vec_x2 = (float*)x2->data;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x2[j] = vec_x[j] + vec_d[j] * dt_1;
-                        }
-
-                        denoise(x2, sigma_mid, i + 1);
-                        float* vec_denoised = (float*)denoised->data;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            float d2 = (vec_x2[j] - vec_denoised[j]) / sigma_mid;
-                            vec_x[j] = vec_x[j] + d2 * dt_2;
-                        }
+                memcpy(out_cond->data, batched_out->data, nbytes);
+                memcpy(out_uncond->data, (char*)batched_out->data + nbytes, nbytes);
+            } else {
+                if (control_hint != NULL) {
+                    if (!control_net->compute(n_threads, noised_input, control_hint, timesteps, c, c_vector)) {
+                        failed = true;
+                        return false;
                     }
+                    controls = control_net->controls;
+                    // print_ggml_tensor(controls[12]);
+                    // GGML_ASSERT(0);
                 }
 
-            } break;
-            case DPMPP2S_A: {
-                struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* d     = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* x2    = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    // denoise
-                    denoise(x, sigmas[i], i + 1);
-
-                    // get_ancestral_step
-                    float sigma_up   = std::min(sigmas[i + 1],
-                                                std::sqrt(sigmas[i + 1] * sigmas[i + 1] * (sigmas[i] * sigmas[i] - sigmas[i + 1] * sigmas[i + 1]) / (sigmas[i] * sigmas[i])));
-                    float sigma_down = std::sqrt(sigmas[i + 1] * sigmas[i + 1] - sigma_up * sigma_up);
-                    auto t_fn        = [](float sigma) -> float { return -log(sigma); };
-                    auto sigma_fn    = [](float t) -> float { return exp(-t); };
-
-                    if (sigma_down == 0) {
-                        // Euler step
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        for (int j = 0; j < ggml_nelements(d); j++) {
-                            vec_d[j] = (vec_x[j] - vec_denoised[j]) / sigmas[i];
-                        }
-
-                        // TODO: If sigma_down == 0, isn't this wrong?
-                        // But
-                        // https://github.com/crowsonkb/k-diffusion/blob/master/k_diffusion/sampling.py#L525
-                        // has this exactly the same way.
-                        float dt = sigma_down - sigmas[i];
-                        for (int j = 0; j < ggml_nelements(d); j++) {
-                            vec_x[j] = vec_x[j] + vec_d[j] * dt;
-                        }
-                    } else {
-                        // DPM-Solver++(2S)
-                        float t      = t_fn(sigmas[i]);
-                        float t_next = t_fn(sigma_down);
-                        float h      = t_next - t;
-                        float s      = t + 0.5f * h;
-
-                        float* vec_d        = (float*)d->data;
-                        float* vec_x        = (float*)x->data;
-                        float* vec_x2       = (float*)x2->data;
-                        float* vec_denoised = (float*)denoised->data;
-
-                        // First half-step
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x2[j] = (sigma_fn(s) / sigma_fn(t)) * vec_x[j] - (exp(-h * 0.5f) - 1) * vec_denoised[j];
-                        }
-
-                        denoise(x2, sigmas[i + 1], i + 1);
-
-                        // Second half-step
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = (sigma_fn(t_next) / sigma_fn(t)) * vec_x[j] - (exp(-h) - 1) * vec_denoised[j];
-                        }
+                set_deep_cache(0, step_index, noised_input->ne[3]);
+                if (start_merge_step == -1 || step <= start_merge_step) {
+                    // cond
+                    if (!diffusion_model->compute(n_threads,
+                                                  noised_input,
+                                                  timesteps,
+                                                  c,
+                                                  c_concat,
+                                                  c_vector,
+                                                  -1,
+                                                  controls,
+                                                  control_strength,
+                                                  &out_cond)) {
+                        failed = true;
+                        return false;
                     }
-
-                    // Noise addition
-                    if (sigmas[i + 1] > 0) {
-                        ggml_tensor_set_f32_randn(noise, rng);
-                        {
-                            float* vec_x     = (float*)x->data;
-                            float* vec_noise = (float*)noise->data;
-
-                            for (int i = 0; i < ggml_nelements(x); i++) {
-                                vec_x[i] = vec_x[i] + vec_noise[i] * sigma_up;
-                            }
-                        }
+                } else {
+                    if (!diffusion_model->compute(n_threads,
+                                                  noised_input,
+                                                  timesteps,
+                                                  c_id,
+                                                  c_concat,
+                                                  c_vec_id,
+                                                  -1,
+                                                  controls,
+                                                  control_strength,
+                                                  &out_cond)) {
+                        failed = true;
+                        return false;
                     }
                 }
-            } break;
-            case DPMPP2M:  // DPM++ (2M) from Karras et al (2022)
-            {
-                struct ggml_tensor* old_denoised = ggml_dup_tensor(work_ctx, x);
-
-                auto t_fn = [](float sigma) -> float { return -log(sigma); };
-
-                for (int i = 0; i < steps; i++) {
-                    // denoise
-                    denoise(x, sigmas[i], i + 1);
-
-                    float t                 = t_fn(sigmas[i]);
-                    float t_next            = t_fn(sigmas[i + 1]);
-                    float h                 = t_next - t;
-                    float a                 = sigmas[i + 1] / sigmas[i];
-                    float b                 = exp(-h) - 1.f;
-                    float* vec_x            = (float*)x->data;
-                    float* vec_denoised     = (float*)denoised->data;
-                    float* vec_old_denoised = (float*)old_denoised->data;
-
-                    if (i == 0 || sigmas[i + 1] == 0) {
-                        // Simpler step for the edge cases
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = a * vec_x[j] - b * vec_denoised[j];
-                        }
-                    } else {
-                        float h_last = t - t_fn(sigmas[i - 1]);
-                        float r      = h_last / h;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            float denoised_d = (1.f + 1.f / (2.f * r)) * vec_denoised[j] - (1.f / (2.f * r)) * vec_old_denoised[j];
-                            vec_x[j]         = a * vec_x[j] - b * denoised_d;
-                        }
-                    }
 
-                    // old_denoised = denoised
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_old_denoised[j] = vec_denoised[j];
-                    }
-                }
-            } break;
-            case DPMPP2Mv2:  // Modified DPM++ (2M) from https://github.com/AUTOMATIC1111/stable-diffusion-webui/discussions/8457
-            {
-                struct ggml_tensor* old_denoised = ggml_dup_tensor(work_ctx, x);
-
-                auto t_fn = [](float sigma) -> float { return -log(sigma); };
-
-                for (int i = 0; i < steps; i++) {
-                    // denoise
-                    denoise(x, sigmas[i], i + 1);
-
-                    float t                 = t_fn(sigmas[i]);
-                    float t_next            = t_fn(sigmas[i + 1]);
-                    float h                 = t_next - t;
-                    float a                 = sigmas[i + 1] / sigmas[i];
-                    float* vec_x            = (float*)x->data;
-                    float* vec_denoised     = (float*)denoised->data;
-                    float* vec_old_denoised = (float*)old_denoised->data;
-
-                    if (i == 0 || sigmas[i + 1] == 0) {
-                        // Simpler step for the edge cases
-                        float b = exp(-h) - 1.f;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = a * vec_x[j] - b * vec_denoised[j];
-                        }
-                    } else {
-                        float h_last = t - t_fn(sigmas[i - 1]);
-                        float h_min  = std::min(h_last, h);
-                        float h_max  = std::max(h_last, h);
-                        float r      = h_max / h_min;
-                        float h_d    = (h_max + h_min) / 2.f;
-                        float b      = exp(-h_d) - 1.f;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            float denoised_d = (1.f + 1.f / (2.f * r)) * vec_denoised[j] - (1.f / (2.f * r)) * vec_old_denoised[j];
-                            vec_x[j]         = a * vec_x[j] - b * denoised_d;
+                if (run_uncond) {
+                    // uncond
+                    if (control_hint != NULL) {
+                        if (!control_net->compute(n_threads, noised_input, control_hint, timesteps, uc, uc_vector)) {
+                            failed = true;
+                            return false;
                         }
+                        controls = control_net->controls;
                     }
-
-                    // old_denoised = denoised
-                    for (int j = 0; j < ggml_nelements(x); j++) {
-                        vec_old_denoised[j] = vec_denoised[j];
+                    set_deep_cache(1, step_index, noised_input->ne[3]);
+                    if (!diffusion_model->compute(n_threads,
+                                                  noised_input,
+                                                  timesteps,
+                                                  uc,
+                                                  uc_concat,
+                                                  uc_vector,
+                                                  -1,
+                                                  controls,
+                                                  control_strength,
+                                                  &out_uncond)) {
+                        failed = true;
+                        return false;
                     }
                 }
-            } break;
-            case LCM:  // Latent Consistency Models
-            {
-                struct ggml_tensor* noise = ggml_dup_tensor(work_ctx, x);
-                struct ggml_tensor* d     = ggml_dup_tensor(work_ctx, x);
-
-                for (int i = 0; i < steps; i++) {
-                    float sigma = sigmas[i];
-
-                    // denoise
-                    denoise(x, sigma, i + 1);
-
-                    // x = denoised
-                    {
-                        float* vec_x        = (float*)x->data;
-                        float* vec_denoised = (float*)denoised->data;
-                        for (int j = 0; j < ggml_nelements(x); j++) {
-                            vec_x[j] = vec_denoised[j];
-                        }
-                    }
-
-                    if (sigmas[i + 1] > 0) {
-                        // x += sigmas[i + 1] * noise_sampler(sigmas[i], sigmas[i + 1])
-                        ggml_tensor_set_f32_randn(noise, rng);
-                        // noise = load_tensor_from_file(res_ctx, "./rand" + std::to_string(i+1) + ".bin");
-                        {
-                            float* vec_x     = (float*)x->data;
-                            float* vec_noise = (float*)noise->data;
-
-                            for (int j = 0; j < ggml_nelements(x); j++) {
-                                vec_x[j] = vec_x[j] + sigmas[i + 1] * vec_noise[j];
-                            }
+            }
+            float* vec_denoised  = (float*)denoised->data;
+            float* vec_input     = (float*)input->data;
+            float* positive_data = (float*)out_cond->data;
+            int64_t ne3          = out_cond->ne[3];
+            int64_t frame_size   = out_cond->ne[0] * out_cond->ne[1] * out_cond->ne[2];
+            bool cfg_ramp        = guided && min_cfg != cfg_scale && ne3 != 1;  // svd, per frame
+            latent_parallel_for(ggml_nelements(denoised), n_threads, [=](int64_t begin, int64_t end) {
+                for (int64_t i = begin; i < end; i++) {
+                    float latent_result = positive_data[i];
+                    if (guided) {
+                        // out_uncond + cfg_scale * (out_cond - out_uncond)
+                        float scale = cfg_scale;
+                        if (cfg_ramp) {
+                            int64_t i3 = i / frame_size;
+                            scale      = min_cfg + (cfg_scale - min_cfg) * (i3 * 1.0f / ne3);
                         }
+                        latent_result = negative_data[i] + scale * (positive_data[i] - negative_data[i]);
                     }
+                    // v = latent_result, eps = latent_result
+                    // denoised = (v * c_out + input * c_skip) or (input + eps * c_out)
+                    vec_denoised[i] = latent_result * c_out + vec_input[i] * c_skip;
                 }
-            } break;
+            });
+            int64_t t1 = ggml_time_us();
+            if (step > 0) {
+                pretty_progress(step, (int)steps, (t1 - t0) / 1000000.f);
+                // LOG_INFO("step %d sampling completed taking %.2fs", step, (t1 - t0) * 1.0f / 1000000);
+            }
+            if (on_step && !on_step(step, (t1 - t0) / 1000.f, denoised)) {
+                stopped = true;
+                return false;
+            }
+            return true;
+        };
 
-            default:
-                LOG_ERROR("Attempting to sample with nonexisting sample method %i", method);
-                abort();
+        std::shared_ptr<Sampler> sampler = get_sampler(method);
+        if (sampler == NULL) {
+            LOG_ERROR("Attempting to sample with nonexisting sample method %i", method);
+            abort();
+        }
+        SamplerContext sampler_ctx;
+        sampler_ctx.work_ctx        = work_ctx;
+        sampler_ctx.x               = x;
+        sampler_ctx.denoised        = denoised;
+        sampler_ctx.sigmas          = sigmas;
+        sampler_ctx.n_threads       = n_threads;
+        sampler_ctx.denoise         = denoise;
+        sampler_ctx.set_noise_randn = set_noise_randn;
+        sampler_ctx.rtol            = adaptive_rtol;
+        sampler_ctx.max_nfe         = adaptive_max_nfe;
+        sampler->sample(sampler_ctx);
+
+        profiler_set_step(0);
+        if (failed) {
+            LOG_ERROR("diffusion model compute failed");
+        }
+        if (stopped || failed) {
+            x = NULL;
+        }
+        if (batcher != NULL) {
+            // the compute buffer is kept for the other requests, UNetBatcher::leave() frees it
+            return x;
         }
         if (control_net) {
             control_net->free_control_ctx();
             control_net->free_compute_buffer();
         }
         diffusion_model->free_compute_buffer();
+        diffusion_model->free_deep_cache();
         return x;
     }
 
@@ -1414,6 +1572,7 @@ public:
                                                  decode ? 3 : (use_tiny_autoencoder ? 4 : 8),
                                                  x->ne[3]);  // channels
         int64_t t0          = ggml_time_ms();
+        bool ok             = true;
         if (!use_tiny_autoencoder) {
             if (decode) {
                 ggml_tensor_scale(x, 1.0f / scale_factor);
@@ -1423,28 +1582,31 @@ public:
             if (vae_tiling && decode) {  // TODO: support tiling vae encode
                 // split latent in 32x32 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
-                    first_stage_model->compute(n_threads, in, decode, &out);
+                    ok = ok && first_stage_model->compute(n_threads, in, decode, &out);
                 };
                 sd_tiling(x, result, 8, 32, 0.5f, on_tiling);
             } else {
-                first_stage_model->compute(n_threads, x, decode, &result);
+                ok = first_stage_model->compute(n_threads, x, decode, &result);
             }
             first_stage_model->free_compute_buffer();
-            if (decode) {
+            if (ok && decode) {
                 ggml_tensor_scale_output(result);
             }
         } else {
             if (vae_tiling && decode) {  // TODO: support tiling vae encode
                 // split latent in 64x64 tiles and compute in several steps
                 auto on_tiling = [&](ggml_tensor* in, ggml_tensor* out, bool init) {
-                    tae_first_stage->compute(n_threads, in, decode, &out);
+                    ok = ok && tae_first_stage->compute(n_threads, in, decode, &out);
                 };
                 sd_tiling(x, result, 8, 64, 0.5f, on_tiling);
             } else {
-                tae_first_stage->compute(n_threads, x, decode, &result);
+                ok = tae_first_stage->compute(n_threads, x, decode, &result);
             }
             tae_first_stage->free_compute_buffer();
         }
+        if (!ok) {
+            return NULL;
+        }
 
         int64_t t1 = ggml_time_ms();
         LOG_DEBUG("computing vae [mode: %s] graph completed, taking %.2fs", decode ? "DECODE" : "ENCODE", (t1 - t0) * 1.0f / 1000);
@@ -1485,7 +1647,11 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                      enum schedule_t s,
                      bool keep_clip_on_cpu,
                      bool keep_control_net_cpu,
-                     bool keep_vae_on_cpu) {
+                     bool keep_vae_on_cpu,
+                     bool use_mmap,
+                     size_t params_mem_budget,
+                     bool batch_cfg,
+                     bool batch_generation) {
     sd_ctx_t* sd_ctx = (sd_ctx_t*)malloc(sizeof(sd_ctx_t));
     if (sd_ctx == NULL) {
         return NULL;
@@ -1518,15 +1684,41 @@ sd_ctx_t* new_sd_ctx(const char* model_path_c_str,
                                     s,
                                     keep_clip_on_cpu,
                                     keep_control_net_cpu,
-                                    keep_vae_on_cpu)) {
+                                    keep_vae_on_cpu,
+                                    use_mmap,
+                                    params_mem_budget)) {
         delete sd_ctx->sd;
         sd_ctx->sd = NULL;
         free(sd_ctx);
         return NULL;
     }
+    sd_ctx->sd->batch_cfg        = batch_cfg;
+    sd_ctx->sd->batch_generation = batch_generation;
+    sd_ctx->sd->batcher          = std::make_shared<UNetBatcher>(sd_ctx->sd->diffusion_model,
+                                                                 sd_ctx->sd->model_mutex,
+                                                                 sd_ctx->sd->n_threads);
     return sd_ctx;
 }
 
+void sd_set_weight_sharing(bool enable) {
+    set_weight_sharing_enabled(enable);
+}
+
+size_t sd_get_work_mem_high_water(sd_ctx_t* sd_ctx) {
+    if (sd_ctx == NULL || sd_ctx->sd == NULL) {
+        return 0;
+    }
+    return sd_ctx->sd->work_arena.get_high_water();
+}
+
+bool sd_get_metrics(sd_ctx_t* sd_ctx, sd_metrics_t* metrics) {
+    if (sd_ctx == NULL || sd_ctx->sd == NULL || metrics == NULL || !sd_ctx->sd->has_metrics) {
+        return false;
+    }
+    *metrics = sd_ctx->sd->last_metrics;
+    return true;
+}
+
 void free_sd_ctx(sd_ctx_t* sd_ctx) {
     if (sd_ctx->sd != NULL) {
         delete sd_ctx->sd;
@@ -1535,6 +1727,26 @@ void free_sd_ctx(sd_ctx_t* sd_ctx) {
     free(sd_ctx);
 }
 
+// Held by txt2img/img2img/img2vid for the whole call: the queued requests (which may use other
+// LoRAs) are drained first and wait until it is done, the modules are used under model_mutex.
+class SyncGeneration {
+    StableDiffusionGGML* sd;
+    std::unique_lock<std::mutex> lock;
+
+public:
+    explicit SyncGeneration(StableDiffusionGGML* sd)
+        : sd(sd) {
+        // no LoRA key (name:multiplier;...) is equal to it, so it never shares a turn
+        sd->batcher->admit("<sync>");
+        lock = std::unique_lock<std::mutex>(sd->model_mutex);
+    }
+
+    ~SyncGeneration() {
+        lock.unlock();
+        sd->batcher->release();
+    }
+};
+
 sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                            struct ggml_context* work_ctx,
                            ggml_tensor* init_latent,
@@ -1553,6 +1765,7 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                            float style_ratio,
                            bool normalize_input,
                            std::string input_id_images_path) {
+    profiler_begin_request();
     if (seed < 0) {
         // Generally, when using the provided command line, the seed is always >0.
         // However, to prevent potential issues if 'stable-diffusion.cpp' is invoked as a library
@@ -1574,9 +1787,12 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     prompt = result_pair.second;
     LOG_DEBUG("prompt after extract and remove lora: \"%s\"", prompt.c_str());
 
+    sd_metrics_t* metrics = &sd_ctx->sd->last_metrics;
+
     int64_t t0 = ggml_time_ms();
     sd_ctx->sd->apply_loras(lora_f2m);
-    int64_t t1 = ggml_time_ms();
+    int64_t t1              = ggml_time_ms();
+    metrics->apply_loras_ms = (float)(t1 - t0);
     LOG_INFO("apply_loras completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
 
     // Photo Maker
@@ -1586,12 +1802,16 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     ggml_tensor* pooled_prompts_embeds = NULL;
     std::vector<bool> class_tokens_mask;
     if (sd_ctx->sd->stacked_id) {
-        if (!sd_ctx->sd->pmid_lora->applied) {
-            t0 = ggml_time_ms();
-            sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, sd_ctx->sd->n_threads);
+        if (!sd_ctx->sd->pmid_lora->applied &&
+            sd_ctx->sd->unshare_params(sd_ctx->sd->pmid_lora->get_target_tensors(sd_ctx->sd->tensors), true)) {
+            t0                             = ggml_time_ms();
+            sd_ctx->sd->pmid_lora->applied = sd_ctx->sd->pmid_lora->apply(sd_ctx->sd->tensors, sd_ctx->sd->n_threads);
             t1                             = ggml_time_ms();
-            sd_ctx->sd->pmid_lora->applied = true;
-            LOG_INFO("pmid_lora apply completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+            if (sd_ctx->sd->pmid_lora->applied) {
+                LOG_INFO("pmid_lora apply completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
+            } else {
+                LOG_WARN("pmid_lora apply failed");
+            }
             if (sd_ctx->sd->free_params_immediately) {
                 sd_ctx->sd->pmid_lora->free_params_buffer();
             }
@@ -1647,8 +1867,19 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
             pooled_prompts_embeds = std::get<1>(cond_tup);  // [adm_in_channels, ]
             class_tokens_mask     = std::get<2>(cond_tup);  //
 
-            prompts_embeds = sd_ctx->sd->id_encoder(work_ctx, init_img, prompts_embeds, class_tokens_mask);
-            t1             = ggml_time_ms();
+            if (prompts_embeds != NULL) {
+                prompts_embeds = sd_ctx->sd->id_encoder(work_ctx, init_img, prompts_embeds, class_tokens_mask);
+            }
+            t1 = ggml_time_ms();
+            if (prompts_embeds == NULL) {
+                LOG_ERROR("PhotoMaker ID stacking failed");
+                for (sd_image_t* img : input_id_images) {
+                    free(img->data);
+                }
+                sd_ctx->sd->work_arena.release(work_ctx);
+                return NULL;
+            }
+            metrics->get_learned_condition_ms += (float)(t1 - t0);
             LOG_INFO("Photomaker ID Stacking, taking %" PRId64 " ms", t1 - t0);
             if (sd_ctx->sd->free_params_immediately) {
                 sd_ctx->sd->pmid_model->free_params_buffer();
@@ -1689,7 +1920,13 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
         uc               = uncond_pair.first;
         uc_vector        = uncond_pair.second;  // [adm_in_channels, ]
     }
+    if (c == NULL || (cfg_scale != 1.0 && uc == NULL)) {
+        LOG_ERROR("get_learned_condition failed");
+        sd_ctx->sd->work_arena.release(work_ctx);
+        return NULL;
+    }
     t1 = ggml_time_ms();
+    metrics->get_learned_condition_ms += (float)(t1 - t0);
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
 
     if (sd_ctx->sd->free_params_immediately) {
@@ -1708,30 +1945,37 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
     int C = 4;
     int W = width / 8;
     int H = height / 8;
+
+    int start_merge_step = -1;
+    if (sd_ctx->sd->stacked_id) {
+        start_merge_step = int(sd_ctx->sd->pmid_model->style_strength / 100.f * sample_steps);
+        // if (start_merge_step > 30)
+        //     start_merge_step = 30;
+        LOG_INFO("PHOTOMAKER: start_merge_step: %d", start_merge_step);
+    }
+
     LOG_INFO("sampling using %s method", sampling_methods_str[sample_method]);
-    for (int b = 0; b < batch_count; b++) {
+    if (sd_ctx->sd->batch_generation && batch_count > 1) {
+        // all latents in one [N, C, H, W] tensor; latent b is drawn from its own rng seeded
+        // with seed + b, so it matches the serial run
         int64_t sampling_start = ggml_time_ms();
-        int64_t cur_seed       = seed + b;
-        LOG_INFO("generating image: %i/%i - seed %i", b + 1, batch_count, cur_seed);
+        LOG_INFO("generating %d images in one batch - seeds %" PRId64 "..%" PRId64, batch_count, seed, seed + batch_count - 1);
 
-        sd_ctx->sd->rng->manual_seed(cur_seed);
-        struct ggml_tensor* x_t   = NULL;
+        std::vector<std::shared_ptr<RNG>> rngs;
+        for (int b = 0; b < batch_count; b++) {
+            rngs.push_back(sd_ctx->sd->new_rng());
+            rngs[b]->manual_seed(seed + b);
+        }
+        struct ggml_tensor* x_t   = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, batch_count);
         struct ggml_tensor* noise = NULL;
         if (init_latent == NULL) {
-            x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-            ggml_tensor_set_f32_randn(x_t, sd_ctx->sd->rng);
+            ggml_tensor_set_f32_randn(x_t, rngs);
         } else {
-            x_t   = init_latent;
-            noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
-            ggml_tensor_set_f32_randn(noise, sd_ctx->sd->rng);
-        }
-
-        int start_merge_step = -1;
-        if (sd_ctx->sd->stacked_id) {
-            start_merge_step = int(sd_ctx->sd->pmid_model->style_strength / 100.f * sample_steps);
-            // if (start_merge_step > 30)
-            //     start_merge_step = 30;
-            LOG_INFO("PHOTOMAKER: start_merge_step: %d", start_merge_step);
+            for (int b = 0; b < batch_count; b++) {
+                memcpy((char*)x_t->data + b * x_t->nb[3], init_latent->data, ggml_nbytes(init_latent));
+            }
+            noise = ggml_dup_tensor(work_ctx, x_t);
+            ggml_tensor_set_f32_randn(noise, rngs);
         }
 
         struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
@@ -1751,52 +1995,127 @@ sd_image_t* generate_image(sd_ctx_t* sd_ctx,
                                                      sigmas,
                                                      start_merge_step,
                                                      prompts_embeds,
-                                                     pooled_prompts_embeds);
-        // struct ggml_tensor* x_0 = load_tensor_from_file(ctx, "samples_ddim.bin");
-        // print_ggml_tensor(x_0);
+                                                     pooled_prompts_embeds,
+                                                     rngs,
+                                                     NULL,
+                                                     sd_ctx->sd->collect_step_metrics(metrics));
+        if (x_0 == NULL) {
+            LOG_ERROR("sampling failed");
+            sd_ctx->sd->work_arena.release(work_ctx);
+            return NULL;
+        }
         int64_t sampling_end = ggml_time_ms();
         LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
         final_latents.push_back(x_0);
+    } else {
+        for (int b = 0; b < batch_count; b++) {
+            int64_t sampling_start = ggml_time_ms();
+            int64_t cur_seed       = seed + b;
+            LOG_INFO("generating image: %i/%i - seed %i", b + 1, batch_count, cur_seed);
+
+            sd_ctx->sd->rng->manual_seed(cur_seed);
+            struct ggml_tensor* x_t   = NULL;
+            struct ggml_tensor* noise = NULL;
+            if (init_latent == NULL) {
+                x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+                ggml_tensor_set_f32_randn(x_t, sd_ctx->sd->rng);
+            } else {
+                x_t   = init_latent;
+                noise = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+                ggml_tensor_set_f32_randn(noise, sd_ctx->sd->rng);
+            }
+
+            struct ggml_tensor* x_0 = sd_ctx->sd->sample(work_ctx,
+                                                         x_t,
+                                                         noise,
+                                                         c,
+                                                         NULL,
+                                                         c_vector,
+                                                         uc,
+                                                         NULL,
+                                                         uc_vector,
+                                                         image_hint,
+                                                         control_strength,
+                                                         cfg_scale,
+                                                         cfg_scale,
+                                                         sample_method,
+                                                         sigmas,
+                                                         start_merge_step,
+                                                         prompts_embeds,
+                                                         pooled_prompts_embeds,
+                                                         {},
+                                                         NULL,
+                                                         sd_ctx->sd->collect_step_metrics(metrics));
+            // struct ggml_tensor* x_0 = load_tensor_from_file(ctx, "samples_ddim.bin");
+            // print_ggml_tensor(x_0);
+            if (x_0 == NULL) {
+                LOG_ERROR("sampling failed");
+                sd_ctx->sd->work_arena.release(work_ctx);
+                return NULL;
+            }
+            int64_t sampling_end = ggml_time_ms();
+            LOG_INFO("sampling completed, taking %.2fs", (sampling_end - sampling_start) * 1.0f / 1000);
+            final_latents.push_back(x_0);
+        }
     }
 
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->diffusion_model->free_params_buffer();
     }
-    int64_t t3 = ggml_time_ms();
-    LOG_INFO("generating %" PRId64 " latent images completed, taking %.2fs", final_latents.size(), (t3 - t1) * 1.0f / 1000);
+    int64_t t3           = ggml_time_ms();
+    metrics->sampling_ms = (float)(t3 - t1);
+    LOG_INFO("generating %d latent images completed, taking %.2fs", batch_count, (t3 - t1) * 1.0f / 1000);
 
     // Decode to image
+    if (final_latents.size() == 1 && final_latents[0]->ne[3] > 1 && sd_ctx->sd->vae_tiling) {
+        // the tiled decode works on one latent at a time
+        ggml_tensor* x_0 = final_latents[0];
+        final_latents.clear();
+        for (int64_t b = 0; b < x_0->ne[3]; b++) {
+            ggml_tensor* latent = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, W, H, C, 1);
+            memcpy(latent->data, (char*)x_0->data + b * x_0->nb[3], ggml_nbytes(latent));
+            final_latents.push_back(latent);
+        }
+    }
     LOG_INFO("decoding %zu latents", final_latents.size());
     std::vector<struct ggml_tensor*> decoded_images;  // collect decoded images
     for (size_t i = 0; i < final_latents.size(); i++) {
         t1                      = ggml_time_ms();
         struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, final_latents[i] /* x_0 */);
         // print_ggml_tensor(img);
-        if (img != NULL) {
-            decoded_images.push_back(img);
+        if (img == NULL) {
+            LOG_ERROR("decode_first_stage failed");
+            sd_ctx->sd->work_arena.release(work_ctx);
+            return NULL;
         }
+        decoded_images.push_back(img);
         int64_t t2 = ggml_time_ms();
         LOG_INFO("latent %" PRId64 " decoded, taking %.2fs", i + 1, (t2 - t1) * 1.0f / 1000);
     }
 
-    int64_t t4 = ggml_time_ms();
+    int64_t t4                     = ggml_time_ms();
+    metrics->decode_first_stage_ms = (float)(t4 - t3);
     LOG_INFO("decode_first_stage completed, taking %.2fs", (t4 - t3) * 1.0f / 1000);
     if (sd_ctx->sd->free_params_immediately && !sd_ctx->sd->use_tiny_autoencoder) {
         sd_ctx->sd->first_stage_model->free_params_buffer();
     }
     sd_image_t* result_images = (sd_image_t*)calloc(batch_count, sizeof(sd_image_t));
     if (result_images == NULL) {
-        ggml_free(work_ctx);
+        sd_ctx->sd->work_arena.release(work_ctx);
         return NULL;
     }
 
+    int n_images = 0;
     for (size_t i = 0; i < decoded_images.size(); i++) {
-        result_images[i].width   = width;
-        result_images[i].height  = height;
-        result_images[i].channel = 3;
-        result_images[i].data    = sd_tensor_to_image(decoded_images[i]);
+        for (int b = 0; b < decoded_images[i]->ne[3] && n_images < batch_count; b++) {
+            result_images[n_images].width   = width;
+            result_images[n_images].height  = height;
+            result_images[n_images].channel = 3;
+            result_images[n_images].data    = sd_tensor_to_image(decoded_images[i], b);
+            n_images++;
+        }
     }
-    ggml_free(work_ctx);
+    sd_ctx->sd->work_arena.release(work_ctx);
 
     return result_images;
 }
@@ -1821,25 +2140,24 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
     if (sd_ctx == NULL) {
         return NULL;
     }
+    SyncGeneration sync_generation(sd_ctx->sd);
 
-    struct ggml_init_params params;
-    params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    size_t mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     if (sd_ctx->sd->stacked_id) {
-        params.mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+        mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     }
-    params.mem_size += width * height * 3 * sizeof(float);
-    params.mem_size *= batch_count;
-    params.mem_buffer = NULL;
-    params.no_alloc   = false;
-    // LOG_DEBUG("mem_size %u ", params.mem_size);
+    mem_size += width * height * 3 * sizeof(float);
+    mem_size *= batch_count;
+    // LOG_DEBUG("mem_size %u ", mem_size);
 
-    struct ggml_context* work_ctx = ggml_init(params);
+    struct ggml_context* work_ctx = sd_ctx->sd->work_arena.acquire(mem_size);
     if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+        LOG_ERROR("failed to get the work memory");
         return NULL;
     }
 
     size_t t0 = ggml_time_ms();
+    sd_ctx->sd->reset_metrics(&sd_ctx->sd->last_metrics);
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->schedule->get_sigmas(sample_steps);
 
@@ -1862,7 +2180,10 @@ sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                                                normalize_input,
                                                input_id_images_path_c_str);
 
-    size_t t1 = ggml_time_ms();
+    size_t t1                         = ggml_time_ms();
+    sd_ctx->sd->last_metrics.total_ms = (float)(t1 - t0);
+    sd_ctx->sd->fill_module_metrics(&sd_ctx->sd->last_metrics);
+    sd_ctx->sd->has_metrics = true;
 
     LOG_INFO("txt2img completed in %.2fs", (t1 - t0) * 1.0f / 1000);
 
@@ -1891,25 +2212,24 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     if (sd_ctx == NULL) {
         return NULL;
     }
+    SyncGeneration sync_generation(sd_ctx->sd);
 
-    struct ggml_init_params params;
-    params.mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    size_t mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     if (sd_ctx->sd->stacked_id) {
-        params.mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+        mem_size += static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
     }
-    params.mem_size += width * height * 3 * sizeof(float) * 2;
-    params.mem_size *= batch_count;
-    params.mem_buffer = NULL;
-    params.no_alloc   = false;
-    // LOG_DEBUG("mem_size %u ", params.mem_size);
+    mem_size += width * height * 3 * sizeof(float) * 2;
+    mem_size *= batch_count;
+    // LOG_DEBUG("mem_size %u ", mem_size);
 
-    struct ggml_context* work_ctx = ggml_init(params);
+    struct ggml_context* work_ctx = sd_ctx->sd->work_arena.acquire(mem_size);
     if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+        LOG_ERROR("failed to get the work memory");
         return NULL;
     }
 
     size_t t0 = ggml_time_ms();
+    sd_ctx->sd->reset_metrics(&sd_ctx->sd->last_metrics);
 
     if (seed < 0) {
         srand((int)time(NULL));
@@ -1922,12 +2242,20 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
     ggml_tensor* init_latent = NULL;
     if (!sd_ctx->sd->use_tiny_autoencoder) {
         ggml_tensor* moments = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
-        init_latent          = sd_ctx->sd->get_first_stage_encoding(work_ctx, moments);
+        if (moments != NULL) {
+            init_latent = sd_ctx->sd->get_first_stage_encoding(work_ctx, moments);
+        }
     } else {
         init_latent = sd_ctx->sd->encode_first_stage(work_ctx, init_img);
     }
+    if (init_latent == NULL) {
+        LOG_ERROR("encode_first_stage failed");
+        sd_ctx->sd->work_arena.release(work_ctx);
+        return NULL;
+    }
     // print_ggml_tensor(init_latent);
-    size_t t1 = ggml_time_ms();
+    size_t t1                                      = ggml_time_ms();
+    sd_ctx->sd->last_metrics.encode_first_stage_ms = (float)(t1 - t0);
     LOG_INFO("encode_first_stage completed, taking %.2fs", (t1 - t0) * 1.0f / 1000);
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->schedule->get_sigmas(sample_steps);
@@ -1955,9 +2283,12 @@ sd_image_t* img2img(sd_ctx_t* sd_ctx,
                                                normalize_input,
                                                input_id_images_path_c_str);
 
-    size_t t2 = ggml_time_ms();
+    size_t t2                         = ggml_time_ms();
+    sd_ctx->sd->last_metrics.total_ms = (float)(t2 - t0);
+    sd_ctx->sd->fill_module_metrics(&sd_ctx->sd->last_metrics);
+    sd_ctx->sd->has_metrics = true;
 
-    LOG_INFO("img2img completed in %.2fs", (t1 - t0) * 1.0f / 1000);
+    LOG_INFO("img2img completed in %.2fs", (t2 - t0) * 1.0f / 1000);
 
     return result_images;
 }
@@ -1981,20 +2312,19 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
     }
 
     LOG_INFO("img2vid %dx%d", width, height);
+    SyncGeneration sync_generation(sd_ctx->sd);
+    profiler_begin_request();
 
     std::vector<float> sigmas = sd_ctx->sd->denoiser->schedule->get_sigmas(sample_steps);
 
-    struct ggml_init_params params;
-    params.mem_size = static_cast<size_t>(10 * 1024) * 1024;  // 10 MB
-    params.mem_size += width * height * 3 * sizeof(float) * video_frames;
-    params.mem_buffer = NULL;
-    params.no_alloc   = false;
-    // LOG_DEBUG("mem_size %u ", params.mem_size);
+    size_t mem_size = static_cast<size_t>(10 * 1024) * 1024;  // 10 MB
+    mem_size += width * height * 3 * sizeof(float) * video_frames;
+    // LOG_DEBUG("mem_size %u ", mem_size);
 
     // draft context
-    struct ggml_context* work_ctx = ggml_init(params);
+    struct ggml_context* work_ctx = sd_ctx->sd->work_arena.acquire(mem_size);
     if (!work_ctx) {
-        LOG_ERROR("ggml_init() failed");
+        LOG_ERROR("failed to get the work memory");
         return NULL;
     }
 
@@ -2004,6 +2334,9 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
 
     sd_ctx->sd->rng->manual_seed(seed);
 
+    sd_metrics_t* metrics = &sd_ctx->sd->last_metrics;
+    sd_ctx->sd->reset_metrics(metrics);
+
     int64_t t0 = ggml_time_ms();
 
     ggml_tensor* c_crossattn = NULL;
@@ -2021,6 +2354,11 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                                                                               fps,
                                                                               motion_bucket_id,
                                                                               augmentation_level);
+    if (c_crossattn == NULL) {
+        LOG_ERROR("get_svd_condition failed");
+        sd_ctx->sd->work_arena.release(work_ctx);
+        return NULL;
+    }
 
     uc_crossattn = ggml_dup_tensor(work_ctx, c_crossattn);
     ggml_set_f32(uc_crossattn, 0.f);
@@ -2031,6 +2369,8 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
     uc_vector = ggml_dup_tensor(work_ctx, c_vector);
 
     int64_t t1 = ggml_time_ms();
+    // the init image is encoded with the svd condition
+    metrics->get_learned_condition_ms = (float)(t1 - t0);
     LOG_INFO("get_learned_condition completed, taking %" PRId64 " ms", t1 - t0);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->clip_vision->free_params_buffer();
@@ -2061,26 +2401,37 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
                                                  sigmas,
                                                  -1,
                                                  NULL,
-                                                 NULL);
+                                                 NULL,
+                                                 {},
+                                                 NULL,
+                                                 sd_ctx->sd->collect_step_metrics(metrics));
+    if (x_0 == NULL) {
+        LOG_ERROR("sampling failed");
+        sd_ctx->sd->work_arena.release(work_ctx);
+        return NULL;
+    }
 
-    int64_t t2 = ggml_time_ms();
+    int64_t t2           = ggml_time_ms();
+    metrics->sampling_ms = (float)(t2 - t1);
     LOG_INFO("sampling completed, taking %.2fs", (t2 - t1) * 1.0f / 1000);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->diffusion_model->free_params_buffer();
     }
 
-    struct ggml_tensor* img = sd_ctx->sd->decode_first_stage(work_ctx, x_0);
+    struct ggml_tensor* img        = sd_ctx->sd->decode_first_stage(work_ctx, x_0);
+    metrics->decode_first_stage_ms = (float)(ggml_time_ms() - t2);
     if (sd_ctx->sd->free_params_immediately) {
         sd_ctx->sd->first_stage_model->free_params_buffer();
     }
     if (img == NULL) {
-        ggml_free(work_ctx);
+        LOG_ERROR("decode_first_stage failed");
+        sd_ctx->sd->work_arena.release(work_ctx);
         return NULL;
     }
 
     sd_image_t* result_images = (sd_image_t*)calloc(video_frames, sizeof(sd_image_t));
     if (result_images == NULL) {
-        ggml_free(work_ctx);
+        sd_ctx->sd->work_arena.release(work_ctx);
         return NULL;
     }
 
@@ -2092,11 +2443,301 @@ SD_API sd_image_t* img2vid(sd_ctx_t* sd_ctx,
         result_images[i].channel = 3;
         result_images[i].data    = sd_tensor_to_image(img_i);
     }
-    ggml_free(work_ctx);
+    sd_ctx->sd->work_arena.release(work_ctx);
 
-    int64_t t3 = ggml_time_ms();
+    int64_t t3        = ggml_time_ms();
+    metrics->total_ms = (float)(t3 - t0);
+    sd_ctx->sd->fill_module_metrics(metrics);
+    sd_ctx->sd->has_metrics = true;
 
     LOG_INFO("img2vid completed in %.2fs", (t3 - t0) * 1.0f / 1000);
 
     return result_images;
 }
+
+/*================================================= Request Queue ==================================================*/
+
+struct sd_request_t {
+    sd_ctx_t* sd_ctx = NULL;
+    std::string prompt;
+    std::string negative_prompt;
+    int clip_skip                 = -1;
+    float cfg_scale               = 7.0f;
+    int width                     = 512;
+    int height                    = 512;
+    sample_method_t sample_method = EULER_A;
+    int sample_steps              = 20;
+    int64_t seed                  = 42;
+
+    sd_request_progress_cb_t progress_cb = NULL;
+    void* progress_cb_data               = NULL;
+
+    std::thread worker;
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> done{false};
+    sd_image_t* result = NULL;
+    sd_metrics_t metrics;
+};
+
+static sd_image_t* run_txt2img_request(sd_request_t* request) {
+    profiler_begin_request();
+    StableDiffusionGGML* sd = request->sd_ctx->sd;
+    UNetBatcher* batcher    = sd->batcher.get();
+    sd_metrics_t* metrics   = &request->metrics;
+    sd->reset_metrics(metrics);
+
+    auto result_pair                                = extract_and_remove_lora(request->prompt);
+    std::unordered_map<std::string, float> lora_f2m = result_pair.first;  // lora_name -> multiplier
+    std::string prompt                              = result_pair.second;
+    std::string lora_key;
+    for (auto& kv : std::map<std::string, float>(lora_f2m.begin(), lora_f2m.end())) {
+        lora_key += format("%s:%f;", kv.first.c_str(), kv.second);
+    }
+
+    size_t mem_size = static_cast<size_t>(10 * 1024 * 1024);  // 10 MB
+    mem_size += request->width * request->height * 3 * sizeof(float);
+
+    struct ggml_context* work_ctx = sd->work_arena.acquire(mem_size);
+    if (!work_ctx) {
+        LOG_ERROR("failed to get the work memory");
+        return NULL;
+    }
+
+    int64_t t0 = ggml_time_ms();
+
+    // wait for the requests with other LoRAs to finish
+    bool admitted = batcher->admit(lora_key, &request->cancelled);
+    if (!admitted || request->cancelled) {
+        if (admitted) {
+            batcher->release();
+        }
+        sd->work_arena.release(work_ctx);
+        LOG_INFO("request (seed %" PRId64 ") cancelled", request->seed);
+        return NULL;
+    }
+
+    std::vector<float> sigmas;
+    ggml_tensor* c                = NULL;
+    ggml_tensor* c_vector         = NULL;
+    struct ggml_tensor* uc        = NULL;
+    struct ggml_tensor* uc_vector = NULL;
+    {
+        std::lock_guard<std::mutex> lock(sd->model_mutex);
+        int64_t t_start = ggml_time_ms();
+        sd->apply_loras(lora_f2m);
+        int64_t t_end           = ggml_time_ms();
+        metrics->apply_loras_ms = (float)(t_end - t_start);
+        sigmas                  = sd->denoiser->schedule->get_sigmas(request->sample_steps);
+
+        auto cond_pair = sd->get_learned_condition(work_ctx, prompt, request->clip_skip, request->width, request->height);
+        c              = cond_pair.first;
+        c_vector       = cond_pair.second;  // [adm_in_channels, ]
+        if (request->cfg_scale != 1.0) {
+            bool force_zero_embeddings = false;
+            if (sd->version == VERSION_XL && request->negative_prompt.size() == 0) {
+                force_zero_embeddings = true;
+            }
+            auto uncond_pair = sd->get_learned_condition(work_ctx, request->negative_prompt, request->clip_skip,
+                                                         request->width, request->height, force_zero_embeddings);
+            uc               = uncond_pair.first;
+            uc_vector        = uncond_pair.second;  // [adm_in_channels, ]
+        }
+        metrics->get_learned_condition_ms = (float)(ggml_time_ms() - t_end);
+    }
+    if (c == NULL || (request->cfg_scale != 1.0 && uc == NULL)) {
+        LOG_ERROR("request (seed %" PRId64 "): get_learned_condition failed", request->seed);
+        batcher->release();
+        sd->work_arena.release(work_ctx);
+        return NULL;
+    }
+
+    std::vector<std::shared_ptr<RNG>> rngs = {sd->new_rng()};
+    rngs[0]->manual_seed(request->seed);
+    struct ggml_tensor* x_t = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, request->width / 8, request->height / 8, 4, 1);
+    ggml_tensor_set_f32_randn(x_t, rngs);
+
+    // checked after every UNet evaluation, a cancelled request stops there
+    auto collect_metrics = sd->collect_step_metrics(metrics);
+    auto on_step         = [&](int step, float step_ms, ggml_tensor* denoised) -> bool {
+        collect_metrics(step, step_ms, denoised);
+        if (request->cancelled) {
+            return false;
+        }
+        if (step > 0 && request->progress_cb != NULL) {
+            request->progress_cb(step,
+                                 request->sample_steps,
+                                 (const float*)denoised->data,
+                                 (int)denoised->ne[0],
+                                 (int)denoised->ne[1],
+                                 (int)denoised->ne[2],
+                                 request->progress_cb_data);
+        }
+        return !request->cancelled;
+    };
+
+    int64_t t1 = ggml_time_ms();
+    batcher->join();
+    struct ggml_tensor* x_0 = sd->sample(work_ctx,
+                                         x_t,
+                                         NULL,
+                                         c,
+                                         NULL,
+                                         c_vector,
+                                         uc,
+                                         NULL,
+                                         uc_vector,
+                                         NULL,
+                                         0.f,
+                                         request->cfg_scale,
+                                         request->cfg_scale,
+                                         request->sample_method,
+                                         sigmas,
+                                         -1,
+                                         NULL,
+                                         NULL,
+                                         rngs,
+                                         batcher,
+                                         on_step);
+    batcher->leave();
+    int64_t t2           = ggml_time_ms();
+    metrics->sampling_ms = (float)(t2 - t1);
+
+    if (x_0 == NULL) {
+        // cancelled or failed, free the work memory now rather than in sd_wait()
+        batcher->release();
+        sd->work_arena.release(work_ctx);
+        if (request->cancelled) {
+            LOG_INFO("request (seed %" PRId64 ") cancelled", request->seed);
+        } else {
+            LOG_ERROR("request (seed %" PRId64 "): sampling failed", request->seed);
+        }
+        return NULL;
+    }
+
+    struct ggml_tensor* img = NULL;
+    {
+        std::lock_guard<std::mutex> lock(sd->model_mutex);
+        img                            = sd->decode_first_stage(work_ctx, x_0);
+        metrics->decode_first_stage_ms = (float)(ggml_time_ms() - t2);
+    }
+    batcher->release();
+
+    sd_image_t* result_image = NULL;
+    if (img != NULL) {
+        result_image = (sd_image_t*)calloc(1, sizeof(sd_image_t));
+    } else {
+        LOG_ERROR("request (seed %" PRId64 "): decode_first_stage failed", request->seed);
+    }
+    if (result_image != NULL) {
+        result_image->width   = request->width;
+        result_image->height  = request->height;
+        result_image->channel = 3;
+        result_image->data    = sd_tensor_to_image(img);
+    }
+    sd->work_arena.release(work_ctx);
+
+    int64_t t3        = ggml_time_ms();
+    metrics->total_ms = (float)(t3 - t0);
+    sd->fill_module_metrics(metrics);
+    LOG_INFO("request (seed %" PRId64 ") completed in %.2fs, sampling %.2fs",
+             request->seed, (t3 - t0) * 1.0f / 1000, (t2 - t1) * 1.0f / 1000);
+    return result_image;
+}
+
+sd_request_t* sd_submit_txt2img(sd_ctx_t* sd_ctx,
+                                const char* prompt_c_str,
+                                const char* negative_prompt_c_str,
+                                int clip_skip,
+                                float cfg_scale,
+                                int width,
+                                int height,
+                                enum sample_method_t sample_method,
+                                int sample_steps,
+                                int64_t seed,
+                                sd_request_progress_cb_t progress_cb,
+                                void* progress_cb_data) {
+    if (sd_ctx == NULL || sd_ctx->sd == NULL) {
+        return NULL;
+    }
+    if (seed < 0) {
+        srand((int)time(NULL));
+        seed = rand();
+    }
+    sd_request_t* request     = new sd_request_t;
+    request->sd_ctx           = sd_ctx;
+    request->prompt           = prompt_c_str;
+    request->negative_prompt  = negative_prompt_c_str;
+    request->clip_skip        = clip_skip;
+    request->cfg_scale        = cfg_scale;
+    request->width            = width;
+    request->height           = height;
+    request->sample_method    = sample_method;
+    request->sample_steps     = sample_steps;
+    request->seed             = seed;
+    request->progress_cb      = progress_cb;
+    request->progress_cb_data = progress_cb_data;
+    request->worker           = std::thread([request]() {
+        request->result = run_txt2img_request(request);
+        request->done   = true;
+    });
+    return request;
+}
+
+bool sd_poll(sd_request_t* request) {
+    return request == NULL || request->done;
+}
+
+bool sd_get_request_metrics(sd_request_t* request, sd_metrics_t* metrics) {
+    if (request == NULL || metrics == NULL || !request->done) {
+        return false;
+    }
+    *metrics = request->metrics;
+    return true;
+}
+
+void sd_cancel(sd_request_t* request) {
+    if (request != NULL) {
+        request->cancelled = true;
+        // it may be waiting for its turn
+        request->sd_ctx->sd->batcher->notify();
+    }
+}
+
+sd_image_t* sd_wait(sd_request_t* request) {
+    if (request == NULL) {
+        return NULL;
+    }
+    request->worker.join();
+    sd_image_t* result = request->result;
+    delete request;
+    return result;
+}
+
+void sd_set_max_batch(sd_ctx_t* sd_ctx, int max_batch) {
+    if (sd_ctx != NULL && sd_ctx->sd != NULL) {
+        sd_ctx->sd->batcher->set_max_batch(max_batch);
+    }
+}
+
+void sd_set_cfg_schedule(sd_ctx_t* sd_ctx, float sigma_min, float sigma_max, float end_fraction, int uncond_interval) {
+    if (sd_ctx != NULL && sd_ctx->sd != NULL) {
+        sd_ctx->sd->cfg_sigma_min       = sigma_min;
+        sd_ctx->sd->cfg_sigma_max       = sigma_max > sigma_min ? sigma_max : 0.f;
+        sd_ctx->sd->cfg_end             = end_fraction > 0 && end_fraction < 1 ? end_fraction : 1.f;
+        sd_ctx->sd->cfg_uncond_interval = std::max(uncond_interval, 1);
+    }
+}
+
+void sd_set_deep_cache(sd_ctx_t* sd_ctx, int interval, int branch) {
+    if (sd_ctx != NULL && sd_ctx->sd != NULL) {
+        sd_ctx->sd->deep_cache_interval = interval > 1 ? interval : 0;
+        sd_ctx->sd->deep_cache_branch   = std::max(branch, 0);
+    }
+}
+
+void sd_set_adaptive_sampling(sd_ctx_t* sd_ctx, float tolerance, int max_nfe) {
+    if (sd_ctx != NULL && sd_ctx->sd != NULL) {
+        sd_ctx->sd->adaptive_rtol    = tolerance > 0 ? tolerance : 0.05f;
+        sd_ctx->sd->adaptive_max_nfe = max_nfe > 0 ? std::max(max_nfe, 3) : 0;
+    }
+}
@@ -42,6 +42,11 @@ enum sample_method_t {
     DPMPP2M,
     DPMPP2Mv2,
     LCM,
+    UNIPC,
+    DPMPP3M_SDE,
+    DEIS,
+    IPNDM,
+    DPM_ADAPTIVE,  // adaptive step size, see sd_set_adaptive_sampling()
     N_SAMPLE_METHODS
 };
 
@@ -99,6 +104,15 @@ typedef void (*sd_progress_cb_t)(int step, int steps, float time, void* data);
 
 SD_API void sd_set_log_callback(sd_log_cb_t sd_log_cb, void* data);
 SD_API void sd_set_progress_callback(sd_progress_cb_t cb, void* data);
+// cache the parsed tensor list of each model file in a "<model path>.sdindex" sidecar
+SD_API void sd_set_model_index_cache(bool enable);
+
+// Records the time, shape and bytes of every graph node computed from now on (nodes are then
+// computed one by one). sd_export_profile() writes a summary per request, sampling step,
+// module and op type as JSON, or every node in Chrome trace event format.
+SD_API void sd_set_profiling(bool enable);
+SD_API bool sd_export_profile(const char* file_path, bool chrome_trace);
+SD_API void sd_clear_profile();
 SD_API int32_t get_num_physical_cores();
 SD_API const char* sd_get_system_info();
 
@@ -111,6 +125,43 @@ typedef struct {
 
 typedef struct sd_ctx_t sd_ctx_t;
 
+enum sd_module_t {
+    SD_MODULE_CLIP,
+    SD_MODULE_CLIP_VISION,  // svd
+    SD_MODULE_UNET,
+    SD_MODULE_VAE,  // or taesd, the one used for decoding
+    SD_MODULE_CONTROL_NET,
+    SD_MODULE_PMID,
+    SD_MODULE_COUNT
+};
+
+#define SD_METRICS_MAX_UNET_EVALS 1024
+
+// Stage timings (ms) and memory of a generation request. The buffer sizes and allocation
+// counts are those of the context at the end of the request.
+typedef struct {
+    float apply_loras_ms;
+    float get_learned_condition_ms;  // including PhotoMaker id stacking
+    float encode_first_stage_ms;     // img2img, img2vid
+    float sampling_ms;
+    float decode_first_stage_ms;
+    float total_ms;
+    // each call of the denoiser (the UNet passes of a step, cond and uncond), all images
+    int n_unet_evals;
+    float unet_eval_ms[SD_METRICS_MAX_UNET_EVALS];  // the first SD_METRICS_MAX_UNET_EVALS
+    size_t compute_buffer_peak[SD_MODULE_COUNT];    // bytes, may be shared between modules
+    int compute_buffer_allocs[SD_MODULE_COUNT];
+    size_t params_buffer_size[SD_MODULE_COUNT];  // 0 if shared with other contexts or not loaded
+    size_t work_mem_high_water;
+    int work_mem_allocs;
+} sd_metrics_t;
+
+// params_mem_budget: 0 keeps all params resident, otherwise the clip/unet/vae params
+// are loaded when first used and the least recently used are evicted to stay within budget (bytes)
+// batch_cfg: evaluate the cond and uncond UNet passes of each step as one batch of 2
+// (faster on GPUs, needs memory for the doubled activations)
+// batch_generation: sample and decode the images of a batch_count > 1 request as one batch,
+// image i still matches the one generated alone with seed + i
 SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             const char* vae_path,
                             const char* taesd_path,
@@ -127,10 +178,89 @@ SD_API sd_ctx_t* new_sd_ctx(const char* model_path,
                             enum schedule_t s,
                             bool keep_clip_on_cpu,
                             bool keep_control_net_cpu,
-                            bool keep_vae_on_cpu);
+                            bool keep_vae_on_cpu,
+                            bool use_mmap,
+                            size_t params_mem_budget,
+                            bool batch_cfg,
+                            bool batch_generation);
+
+// contexts created afterwards with the same model files share one read-only copy of the
+// params (CPU backend only); a context copies the params a LoRA modifies while it is applied
+SD_API void sd_set_weight_sharing(bool enable);
+
+// the most work memory (bytes) a request of the context has used so far; the work buffers are
+// kept between requests and sized for the largest request
+SD_API size_t sd_get_work_mem_high_water(sd_ctx_t* sd_ctx);
 
 SD_API void free_sd_ctx(sd_ctx_t* sd_ctx);
 
+// metrics of the last txt2img/img2img/img2vid call of the context, false if there was none
+SD_API bool sd_get_metrics(sd_ctx_t* sd_ctx, sd_metrics_t* metrics);
+
+typedef struct sd_request_t sd_request_t;
+
+// Called from the request's thread after each sampling step. latent is the current estimate
+// of the denoised latent: channels planes of height rows of width floats, valid during the call.
+typedef void (*sd_request_progress_cb_t)(int step,
+                                         int steps,
+                                         const float* latent,
+                                         int width,
+                                         int height,
+                                         int channels,
+                                         void* data);
+
+// Queues a txt2img request for one image and returns at once; each request runs in its own
+// thread. The UNet evaluations of the requests sampling at the same time are computed in
+// shared batches (same resolution and prompt length): a request joins at the next step and
+// leaves when its own schedule is done. Requests with different LoRAs in the prompt are run
+// one set after the other. No control net or PhotoMaker, don't mix with txt2img/img2img
+// calls on the same context, and wait for every request before free_sd_ctx.
+// progress_cb (may be NULL) is called with progress_cb_data after each step of the request.
+SD_API sd_request_t* sd_submit_txt2img(sd_ctx_t* sd_ctx,
+                                       const char* prompt,
+                                       const char* negative_prompt,
+                                       int clip_skip,
+                                       float cfg_scale,
+                                       int width,
+                                       int height,
+                                       enum sample_method_t sample_method,
+                                       int sample_steps,
+                                       int64_t seed,
+                                       sd_request_progress_cb_t progress_cb,
+                                       void* progress_cb_data);
+
+// true once the request is finished (or cancelled), sd_wait() then returns at once
+SD_API bool sd_poll(sd_request_t* request);
+
+// The request stops at its next sampling step and frees its work memory; sd_wait() must still
+// be called to release it and returns NULL.
+SD_API void sd_cancel(sd_request_t* request);
+
+// metrics of a finished request (sd_poll() returned true), before sd_wait()
+SD_API bool sd_get_request_metrics(sd_request_t* request, sd_metrics_t* metrics);
+
+// waits for the request and releases it, returns its image or NULL on failure
+SD_API sd_image_t* sd_wait(sd_request_t* request);
+
+// max number of UNet evaluations computed in one batch (default: 8)
+SD_API void sd_set_max_batch(sd_ctx_t* sd_ctx, int max_batch);
+
+// CFG schedule, to skip the unconditional UNet pass where guidance matters little: guidance is
+// only applied for sigma in [sigma_min, sigma_max] (sigma_max <= sigma_min for all sigmas) and
+// the first end_fraction of the steps (1 for all), and the unconditional output is computed every
+// uncond_interval steps and reused in between (1 for every step). Default: 0, 0, 1, 1
+SD_API void sd_set_cfg_schedule(sd_ctx_t* sd_ctx, float sigma_min, float sigma_max, float end_fraction, int uncond_interval);
+
+// DeepCache (not with queued requests): the UNet is fully computed every interval steps, and
+// keeps the features below skip connection branch (0 for the outermost, the cheapest steps);
+// the steps in between only compute the blocks above it on the kept features. 0 to disable (default)
+SD_API void sd_set_deep_cache(sd_ctx_t* sd_ctx, int interval, int branch);
+
+// DPM_ADAPTIVE picks its own steps between the first and last sigma of the schedule of
+// sample_steps, keeping the local error of each step within tolerance (relative, default: 0.05).
+// max_nfe > 0 caps the denoiser evaluations per image (at least 3), 0 for no limit (default).
+SD_API void sd_set_adaptive_sampling(sd_ctx_t* sd_ctx, float tolerance, int max_nfe);
+
 SD_API sd_image_t* txt2img(sd_ctx_t* sd_ctx,
                            const char* prompt,
                            const char* negative_prompt,
@@ -191,7 +321,17 @@ SD_API void free_upscaler_ctx(upscaler_ctx_t* upscaler_ctx);
 
 SD_API sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor);
 
-SD_API bool convert(const char* input_path, const char* vae_path, const char* output_path, sd_type_t output_type);
+// tensor_type_rules: optional comma separated "pattern=type" list (pattern is a regex
+// searched in the tensor name, first match wins), e.g. "first_stage_model\.=f16,norm=f16,attn=q4_K"
+// tensor_prefixes: optional comma separated name prefixes of the tensors to convert, one
+// starting with '-' is left out, e.g. "first_stage_model." for the VAE only. Without it, the
+// VAE of the model is left out when vae_path is given.
+SD_API bool convert(const char* input_path,
+                    const char* vae_path,
+                    const char* output_path,
+                    sd_type_t output_type,
+                    const char* tensor_type_rules,
+                    const char* tensor_prefixes);
 
 SD_API uint8_t* preprocess_canny(uint8_t* img,
                                  int width,
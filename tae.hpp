@@ -235,7 +235,7 @@ struct TinyAutoEncoder : public GGMLModule {
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  struct ggml_tensor* z,
                  bool decode_graph,
                  struct ggml_tensor** output,
@@ -244,7 +244,7 @@ struct TinyAutoEncoder : public GGMLModule {
             return build_graph(z, decode_graph);
         };
 
-        GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
     }
 };
 
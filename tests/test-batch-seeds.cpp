@@ -0,0 +1,108 @@
+// With batch generation, the batch_count latents of a request are sampled as one [N, C, H, W]
+// tensor, latent b drawn from its own rng seeded with seed + b. Checks that the batch gives
+// the same latents as N sequential runs with the seeds seed, seed + 1, ..., for the initial
+// noise and the ancestral noise of the samplers. The UNet is replaced by a denoiser that
+// works on every latent on its own, as the UNet does, so this needs no model file.
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "ggml_extend.hpp"
+#include "rng.hpp"
+#include "rng_philox.hpp"
+#include "sampler.hpp"
+
+static std::shared_ptr<RNG> new_rng(rng_type_t rng_type, int64_t seed) {
+    std::shared_ptr<RNG> rng;
+    if (rng_type == CUDA_RNG) {
+        rng = std::make_shared<PhiloxRNG>();
+    } else {
+        rng = std::make_shared<STDDefaultRNG>();
+    }
+    rng->manual_seed(seed);
+    return rng;
+}
+
+// like StableDiffusionGGML::sample(): x_t is filled from rngs (one per latent), then
+// scaled to sigmas[0] and stepped along sigmas
+static ggml_tensor* sample(ggml_context* work_ctx,
+                           sample_method_t method,
+                           const std::vector<float>& sigmas,
+                           const std::vector<std::shared_ptr<RNG>>& rngs) {
+    ggml_tensor* x = ggml_new_tensor_4d(work_ctx, GGML_TYPE_F32, 8, 8, 4, (int64_t)rngs.size());
+    ggml_tensor_set_f32_randn(x, rngs);
+    ggml_tensor_scale(x, sigmas[0]);
+    ggml_tensor* denoised = ggml_dup_tensor(work_ctx, x);
+
+    SamplerContext sampler_ctx;
+    sampler_ctx.work_ctx = work_ctx;
+    sampler_ctx.x        = x;
+    sampler_ctx.denoised = denoised;
+    sampler_ctx.sigmas   = sigmas;
+    sampler_ctx.denoise  = [&](ggml_tensor* input, float sigma, int step) -> bool {
+        // the optimal denoiser of unit variance data
+        float* in  = (float*)input->data;
+        float* out = (float*)denoised->data;
+        for (int64_t i = 0; i < ggml_nelements(input); i++) {
+            out[i] = in[i] / (1.f + sigma * sigma);
+        }
+        return true;
+    };
+    sampler_ctx.set_noise_randn = [&](ggml_tensor* noise) {
+        ggml_tensor_set_f32_randn(noise, rngs);
+    };
+    get_sampler(method)->sample(sampler_ctx);
+    return x;
+}
+
+int main() {
+    const int64_t seed    = 42;
+    const int batch_count = 3;
+    // decreasing to 0, like the schedules
+    const std::vector<float> sigmas = {14.6f, 6.2f, 2.9f, 1.3f, 0.55f, 0.2f, 0.f};
+    // the ancestral and SDE samplers draw noise on every step; the adaptive one is left out,
+    // its step size depends on the error of the whole batch
+    const sample_method_t methods[] = {EULER_A, EULER, DPMPP2S_A, DPMPP2M, LCM, DPMPP3M_SDE};
+    const rng_type_t rng_types[]    = {STD_DEFAULT_RNG, CUDA_RNG};
+
+    struct ggml_init_params params;
+    params.mem_size   = 16 * 1024 * 1024;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+
+    int n_checked = 0;
+    int n_failed  = 0;
+    for (rng_type_t rng_type : rng_types) {
+        for (sample_method_t method : methods) {
+            ggml_context* work_ctx = ggml_init(params);
+
+            std::vector<std::shared_ptr<RNG>> rngs;
+            for (int b = 0; b < batch_count; b++) {
+                rngs.push_back(new_rng(rng_type, seed + b));
+            }
+            ggml_tensor* batched = sample(work_ctx, method, sigmas, rngs);
+
+            for (int b = 0; b < batch_count; b++) {
+                ggml_tensor* single = sample(work_ctx, method, sigmas, {new_rng(rng_type, seed + b)});
+                const float* a      = (const float*)batched->data + b * ggml_nelements(single);
+                const float* s      = (const float*)single->data;
+                float max_diff      = 0.f;
+                for (int64_t i = 0; i < ggml_nelements(single); i++) {
+                    max_diff = std::max(max_diff, fabsf(a[i] - s[i]));
+                }
+                n_checked++;
+                if (!(max_diff <= 1e-5f)) {
+                    printf("FAIL sampler %d, rng %d: latent %d of the batch differs from seed %d by %g\n",
+                           (int)method, (int)rng_type, b, (int)(seed + b), max_diff);
+                    n_failed++;
+                }
+            }
+            ggml_free(work_ctx);
+        }
+    }
+    printf("%d batched latents checked, %d failed\n", n_checked, n_failed);
+    return n_failed == 0 ? 0 : 1;
+}
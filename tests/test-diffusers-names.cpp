@@ -0,0 +1,82 @@
+// Checks convert_diffusers_name_to_compvis() against the names the former std::regex
+// implementation produced, for every rewrite rule and both separators ('.' for diffusers
+// model files, '_' for LoRA files).
+
+#include <stdio.h>
+#include <string>
+
+#include "model.h"
+
+struct NameCase {
+    char seq;
+    const char* diffusers_name;
+    const char* compvis_name;
+};
+
+static const NameCase name_cases[] = {
+    {'.', "unet.conv_in", "model.diffusion_model.input_blocks.0.0"},
+    {'.', "unet.conv_out", "model.diffusion_model.out.2"},
+    {'.', "unet.conv_norm_out", "model.diffusion_model.out.0"},
+    {'.', "unet.time_embedding.linear_1", "model.diffusion_model.time_embed.0"},
+    {'.', "unet.time_embedding.linear_2", "model.diffusion_model.time_embed.2"},
+    {'.', "unet.down_blocks.1.attentions.0.proj_in", "model.diffusion_model.input_blocks.4.1.proj_in"},
+    {'.', "unet.down_blocks.0.resnets.1.conv1", "model.diffusion_model.input_blocks.2.0.in_layers.2"},
+    {'.', "unet.mid_block.attentions.0.transformer_blocks.0.attn1.to_out", "model.diffusion_model.middle_block.1.transformer_blocks.0.attn1.to_out.0"},
+    {'.', "unet.mid_block.resnets.1.time_emb_proj", "model.diffusion_model.middle_block.2.emb_layers.1"},
+    {'.', "unet.up_blocks.2.resnets.2.conv_shortcut", "model.diffusion_model.output_blocks.8.0.skip_connection"},
+    {'.', "unet.up_blocks.3.attentions.1.to_out", "model.diffusion_model.output_blocks.10.1.proj_out"},
+    {'.', "unet.down_blocks.2.downsamplers.0.conv", "model.diffusion_model.input_blocks.9.0.op"},
+    {'.', "unet.up_blocks.0.upsamplers.0.conv", "model.diffusion_model.output_blocks.2.1.conv"},
+    {'.', "unet.up_blocks.1.upsamplers.0.conv", "model.diffusion_model.output_blocks.5.2.conv"},
+    {'.', "te.text_model.encoder.layers.11.mlp.fc1", "cond_stage_model.transformer.text_model.encoder.layers.11.mlp.fc1"},
+    {'.', "te.text_model.final_layer_norm", "cond_stage_model.transformer.text_model.final_layer_norm"},
+    {'.', "vae.decoder.conv_norm_out", "first_stage_model.decoder.norm_out"},
+    {'.', "vae.encoder.mid_block.attentions.0.to_out", "first_stage_model.encoder.mid.attn_1.proj_out"},
+    {'.', "vae.decoder.mid_block.resnets.1.norm1", "first_stage_model.decoder.mid.block_2.norm1"},
+    {'.', "vae.decoder.up_blocks.0.resnets.2.conv_shortcut", "first_stage_model.decoder.up.3.block.2.nin_shortcut"},
+    {'.', "vae.encoder.down_blocks.1.downsamplers.0.conv", "first_stage_model.encoder.down.1.downsample.conv"},
+    {'.', "vae.encoder.down_blocks.2.resnets.0.conv_shortcut", "first_stage_model.encoder.down.2.block.0.nin_shortcut"},
+    {'.', "vae.decoder.up_blocks.1.upsamplers.0.conv", "first_stage_model.decoder.up.2.upsample.conv"},
+    {'.', "vae.quant_conv", "first_stage_model.quant_conv"},
+    {'.', "model.diffusion_model.out.0", "model.diffusion_model.out.0"},
+    {'_', "unet_conv_in", "model_diffusion_model_input_blocks_0_0"},
+    {'_', "unet_conv_out", "model_diffusion_model_out_2"},
+    {'_', "unet_conv_norm_out", "model_diffusion_model_out_0"},
+    {'_', "unet_time_embedding_linear_1", "model_diffusion_model_time_embed_0"},
+    {'_', "unet_time_embedding_linear_2", "model_diffusion_model_time_embed_2"},
+    {'_', "unet_down_blocks_1_attentions_0_proj_in", "model_diffusion_model_input_blocks_4_1_proj_in"},
+    {'_', "unet_down_blocks_0_resnets_1_conv1", "model_diffusion_model_input_blocks_2_0_in_layers_2"},
+    {'_', "unet_mid_block_attentions_0_transformer_blocks_0_attn1_to_out", "model_diffusion_model_middle_block_1_transformer_blocks_0_attn1_to_out_0"},
+    {'_', "unet_mid_block_resnets_1_time_emb_proj", "model_diffusion_model_middle_block_2_emb_layers_1"},
+    {'_', "unet_up_blocks_2_resnets_2_conv_shortcut", "model_diffusion_model_output_blocks_8_0_skip_connection"},
+    {'_', "unet_up_blocks_3_attentions_1_to_out", "model_diffusion_model_output_blocks_10_1_proj_out"},
+    {'_', "unet_down_blocks_2_downsamplers_0_conv", "model_diffusion_model_input_blocks_9_0_op"},
+    {'_', "unet_up_blocks_0_upsamplers_0_conv", "model_diffusion_model_output_blocks_2_1_conv"},
+    {'_', "unet_up_blocks_1_upsamplers_0_conv", "model_diffusion_model_output_blocks_5_2_conv"},
+    {'_', "te_text_model_encoder_layers_11_mlp_fc1", "cond_stage_model_transformer_text_model_encoder_layers_11_mlp_fc1"},
+    {'_', "te_text_model_final_layer_norm", "cond_stage_model_transformer_text_model_final_layer_norm"},
+    {'_', "vae_decoder_conv_norm_out", "first_stage_model_decoder_norm_out"},
+    {'_', "vae_encoder_mid_block_attentions_0_to_out", "first_stage_model_encoder_mid_attn_1_proj_out"},
+    {'_', "vae_decoder_mid_block_resnets_1_norm1", "first_stage_model_decoder_mid_block_2_norm1"},
+    {'_', "vae_decoder_up_blocks_0_resnets_2_conv_shortcut", "first_stage_model_decoder_up_3_block_2_nin_shortcut"},
+    {'_', "vae_encoder_down_blocks_1_downsamplers_0_conv", "first_stage_model_encoder_down_1_downsample_conv"},
+    {'_', "vae_encoder_down_blocks_2_resnets_0_conv_shortcut", "first_stage_model_encoder_down_2_block_0_nin_shortcut"},
+    {'_', "vae_decoder_up_blocks_1_upsamplers_0_conv", "first_stage_model_decoder_up_2_upsample_conv"},
+    {'_', "vae_quant_conv", "first_stage_model_quant_conv"},
+    {'_', "model_diffusion_model_out_0", "model_diffusion_model_out_0"},
+};
+
+int main() {
+    int n_failed = 0;
+    for (const NameCase& name_case : name_cases) {
+        std::string name = convert_diffusers_name_to_compvis(name_case.diffusers_name, name_case.seq);
+        if (name != name_case.compvis_name) {
+            printf("FAIL '%c' %s: got %s, expected %s\n",
+                   name_case.seq, name_case.diffusers_name, name.c_str(), name_case.compvis_name);
+            n_failed++;
+        }
+    }
+    size_t n_cases = sizeof(name_cases) / sizeof(name_cases[0]);
+    printf("%zu diffusers names checked, %d failed\n", n_cases, n_failed);
+    return n_failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+// TensorUploader copies the staged tensor data on its own thread, so a loader worker reads
+// and converts the next tensor while the previous one is uploaded. The tensors live in a
+// mock device buffer (CPU memory, but not a host buffer) whose uploads block until the test
+// lets them finish, which records whether the next tensor got read during an upload.
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "ggml-backend-impl.h"
+#include "model.h"
+
+struct MockUploads {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool gate_open = false;  // uploads block until then, or until the timeout
+    int n_started  = 0;
+    int n_finished = 0;
+    std::thread::id thread_id;
+};
+
+static MockUploads mock;
+static char mock_base[64];
+
+static void* GGML_CALL mock_get_base(ggml_backend_buffer_t buffer) {
+    return mock_base;
+}
+
+static void GGML_CALL mock_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor* tensor, const void* data, size_t offset, size_t size) {
+    std::unique_lock<std::mutex> lock(mock.mutex);
+    mock.n_started++;
+    mock.thread_id = std::this_thread::get_id();
+    mock.cond.notify_all();
+    mock.cond.wait_for(lock, std::chrono::seconds(2), [] { return mock.gate_open; });
+    memcpy((char*)tensor->data + offset, data, size);
+    mock.n_finished++;
+    mock.cond.notify_all();
+}
+
+static void open_gate() {
+    std::lock_guard<std::mutex> lock(mock.mutex);
+    mock.gate_open = true;
+    mock.cond.notify_all();
+}
+
+int main() {
+    const int n_tensors = 4;
+    const int n_ne      = 1024;
+    int n_checks        = 0;
+    int n_failed        = 0;
+    auto check          = [&](bool ok, const char* what) {
+        n_checks++;
+        if (!ok) {
+            printf("FAIL %s\n", what);
+            n_failed++;
+        }
+    };
+
+    ggml_backend_t backend = ggml_backend_cpu_init();
+
+    struct ggml_backend_buffer_type buft;
+    memset(&buft, 0, sizeof(buft));  // is_host == NULL: not a host buffer
+    struct ggml_backend_buffer_i iface;
+    memset(&iface, 0, sizeof(iface));
+    iface.get_base               = mock_get_base;
+    iface.set_tensor             = mock_set_tensor;
+    ggml_backend_buffer_t buffer = ggml_backend_buffer_init(&buft, iface, NULL, sizeof(mock_base));
+
+    struct ggml_init_params params;
+    params.mem_size   = n_tensors * (n_ne * sizeof(float) + ggml_tensor_overhead()) + 1024;
+    params.mem_buffer = NULL;
+    params.no_alloc   = false;
+    ggml_context* ctx = ggml_init(params);
+    std::vector<ggml_tensor*> tensors;
+    for (int i = 0; i < n_tensors; i++) {
+        ggml_tensor* tensor = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_ne);
+        ggml_set_f32(tensor, 0.f);
+        tensor->buffer = buffer;
+        tensors.push_back(tensor);
+    }
+
+    {
+        TensorUploader uploader(backend);
+        TensorUploader::Slot slots[2];
+        // like a loader worker: read the tensor into the slot used two tensors ago, then submit it
+        for (int i = 0; i < n_tensors; i++) {
+            TensorUploader::Slot& slot = slots[i % 2];
+            uploader.wait(slot);
+            slot.data.resize(n_ne * sizeof(float));
+            for (int j = 0; j < n_ne; j++) {
+                ((float*)slot.data.data())[j] = (float)(i + 1);
+            }
+            uploader.submit(slot, tensors[i], slot.data.data(), slot.data.size());
+
+            if (i == 0) {
+                std::unique_lock<std::mutex> lock(mock.mutex);
+                mock.cond.wait_for(lock, std::chrono::seconds(2), [] { return mock.n_started > 0; });
+                check(mock.n_started == 1 && mock.n_finished == 0, "the first upload is not in progress after submit");
+            }
+            if (i == 1) {
+                {
+                    std::lock_guard<std::mutex> lock(mock.mutex);
+                    check(mock.n_finished == 0, "the second tensor was not read while the first one was uploaded");
+                }
+                open_gate();
+            }
+        }
+        // the destructor waits for the queued uploads
+    }
+
+    check(mock.n_finished == n_tensors, "not every tensor was uploaded");
+    check(mock.thread_id != std::this_thread::get_id(), "the uploads ran on the loader thread");
+    for (int i = 0; i < n_tensors; i++) {
+        if (ggml_get_f32_1d(tensors[i], 0) != (float)(i + 1) || ggml_get_f32_1d(tensors[i], n_ne - 1) != (float)(i + 1)) {
+            check(false, "wrong tensor data after the upload");
+        }
+    }
+    printf("%d tensor uploader checks, %d failed\n", n_checks, n_failed);
+
+    ggml_free(ctx);
+    ggml_backend_buffer_free(buffer);
+    ggml_backend_free(backend);
+    return n_failed == 0 ? 0 : 1;
+}
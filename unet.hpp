@@ -371,6 +371,12 @@ public:
         }
     }
 
+    // number of skip connections, one per input block (and output block): input block 0, then
+    // num_res_blocks per level and a downsample between the levels
+    int get_num_skips() {
+        return (int)channel_mult.size() * (num_res_blocks + 1);
+    }
+
     struct ggml_tensor* forward(struct ggml_context* ctx,
                                 struct ggml_tensor* x,
                                 struct ggml_tensor* timesteps,
@@ -379,13 +385,20 @@ public:
                                 struct ggml_tensor* y                     = NULL,
                                 int num_video_frames                      = -1,
                                 std::vector<struct ggml_tensor*> controls = {},
-                                float control_strength                    = 0.f) {
+                                float control_strength                    = 0.f,
+                                int deep_cache_branch                     = -1,
+                                struct ggml_tensor* deep_cache            = NULL,
+                                struct ggml_tensor** deep_feature         = NULL) {
         // x: [N, in_channels, h, w] or [N, in_channels/2, h, w]
         // timesteps: [N,]
         // context: [N, max_position, hidden_size] or [1, max_position, hidden_size]. for example, [N, 77, 768]
         // c_concat: [N, in_channels, h, w] or [1, in_channels, h, w]
         // y: [N, adm_in_channels] or [1, adm_in_channels]
+        // DeepCache (https://arxiv.org/abs/2312.00858): the blocks below skip connection deep_cache_branch
+        // are deep. deep_feature returns their output (the input of the output block of that skip),
+        // with deep_cache given they are skipped and deep_cache is used instead.
         // return: [N, out_channels, h, w]
+        bool shallow = deep_cache != NULL && deep_cache_branch >= 0;
         if (context != NULL) {
             if (context->ne[2] != x->ne[3]) {
                 context = ggml_repeat(ctx, context, ggml_new_tensor_3d(ctx, GGML_TYPE_F32, context->ne[0], context->ne[1], x->ne[3]));
@@ -446,6 +459,10 @@ public:
             int mult = channel_mult[i];
             for (int j = 0; j < num_res_blocks; j++) {
                 input_block_idx += 1;
+                if (shallow && (int)hs.size() > deep_cache_branch) {
+                    hs.push_back(NULL);  // deep
+                    continue;
+                }
                 std::string name = "input_blocks." + std::to_string(input_block_idx) + ".0";
                 h                = resblock_forward(name, ctx, h, emb, num_video_frames);  // [N, mult*model_channels, h, w]
                 if (std::find(attention_resolutions.begin(), attention_resolutions.end(), ds) != attention_resolutions.end()) {
@@ -457,6 +474,10 @@ public:
             if (i != len_mults - 1) {
                 ds *= 2;
                 input_block_idx += 1;
+                if (shallow && (int)hs.size() > deep_cache_branch) {
+                    hs.push_back(NULL);  // deep
+                    continue;
+                }
 
                 std::string name = "input_blocks." + std::to_string(input_block_idx) + ".0";
                 auto block       = std::dynamic_pointer_cast<DownSampleBlock>(blocks[name]);
@@ -468,11 +489,13 @@ public:
         // [N, 4*model_channels, h/8, w/8]
 
         // middle_block
-        h = resblock_forward("middle_block.0", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
-        h = attention_layer_forward("middle_block.1", ctx, h, context, num_video_frames);  // [N, 4*model_channels, h/8, w/8]
-        h = resblock_forward("middle_block.2", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+        if (!shallow) {
+            h = resblock_forward("middle_block.0", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+            h = attention_layer_forward("middle_block.1", ctx, h, context, num_video_frames);  // [N, 4*model_channels, h/8, w/8]
+            h = resblock_forward("middle_block.2", ctx, h, emb, num_video_frames);             // [N, 4*model_channels, h/8, w/8]
+        }
 
-        if (controls.size() > 0) {
+        if (controls.size() > 0 && !shallow) {
             auto cs = ggml_scale_inplace(ctx, controls[controls.size() - 1], control_strength);
             h       = ggml_add(ctx, h, cs);  // middle control
         }
@@ -485,6 +508,23 @@ public:
                 auto h_skip = hs.back();
                 hs.pop_back();
 
+                bool deep = deep_cache_branch >= 0 && (int)hs.size() > deep_cache_branch;
+                if (deep && shallow) {
+                    if (i > 0 && j == num_res_blocks) {
+                        ds /= 2;
+                    }
+                    control_offset--;
+                    output_block_idx += 1;
+                    continue;
+                }
+                if ((int)hs.size() == deep_cache_branch) {
+                    if (shallow) {
+                        h = deep_cache;
+                    } else if (deep_feature != NULL) {
+                        *deep_feature = h;
+                    }
+                }
+
                 if (controls.size() > 0) {
                     auto cs = ggml_scale_inplace(ctx, controls[control_offset], control_strength);
                     h_skip  = ggml_add(ctx, h_skip, cs);  // control net condition
@@ -528,10 +568,28 @@ public:
     }
 };
 
+enum DeepCacheMode {
+    DEEP_CACHE_OFF,
+    DEEP_CACHE_FILL,   // full pass, keeps the deep features
+    DEEP_CACHE_REUSE,  // shallow pass on the kept deep features
+};
+
 struct UNetModel : public GGMLModule {
     SDVersion version = VERSION_1_x;
     UnetModelBlock unet;
 
+    // DeepCache: the deep features of the last full pass of each slot (the cond/uncond passes
+    // have their own), in their own backend buffers, kept between the compute() calls
+    struct DeepCacheSlot {
+        struct ggml_context* ctx     = NULL;
+        ggml_backend_buffer_t buffer = NULL;
+        struct ggml_tensor* feature  = NULL;
+    };
+    std::vector<DeepCacheSlot> deep_cache_slots;
+    DeepCacheMode deep_cache_mode = DEEP_CACHE_OFF;
+    int deep_cache_slot           = 0;
+    int deep_cache_branch         = 0;
+
     UNetModel(ggml_backend_t backend,
               ggml_type wtype,
               SDVersion version = VERSION_1_x)
@@ -539,6 +597,31 @@ struct UNetModel : public GGMLModule {
         unet.init(params_ctx, wtype);
     }
 
+    ~UNetModel() {
+        free_deep_cache();
+    }
+
+    // the mode of the next compute(), reset to DEEP_CACHE_OFF after it
+    void set_deep_cache(DeepCacheMode mode, int slot, int branch) {
+        deep_cache_mode   = mode;
+        deep_cache_slot   = std::max(slot, 0);
+        deep_cache_branch = std::max(0, std::min(branch, unet.get_num_skips() - 1));
+    }
+
+    // true if slot keeps deep features for a batch of n latents
+    bool has_deep_cache(int slot, int64_t n) {
+        return slot >= 0 && (size_t)slot < deep_cache_slots.size() && deep_cache_slots[slot].feature != NULL &&
+               deep_cache_slots[slot].feature->ne[3] == n;
+    }
+
+    void free_deep_cache() {
+        cached_graph = NULL;  // may refer to the features
+        for (DeepCacheSlot& slot : deep_cache_slots) {
+            free_deep_cache_slot(slot);
+        }
+        deep_cache_slots.clear();
+    }
+
     std::string get_desc() {
         return "unet";
     }
@@ -547,6 +630,46 @@ struct UNetModel : public GGMLModule {
         unet.get_param_tensors(tensors, prefix);
     }
 
+    void free_deep_cache_slot(DeepCacheSlot& slot) {
+        if (slot.buffer != NULL) {
+            ggml_backend_buffer_free(slot.buffer);
+        }
+        if (slot.ctx != NULL) {
+            ggml_free(slot.ctx);
+        }
+        slot = DeepCacheSlot();
+    }
+
+    // the slot's feature tensor, (re)allocated if its shape differs from like
+    struct ggml_tensor* get_deep_cache_tensor(int slot_index, struct ggml_tensor* like) {
+        GGML_ASSERT(slot_index >= 0);
+        if (deep_cache_slots.size() <= (size_t)slot_index) {
+            deep_cache_slots.resize(slot_index + 1);
+        }
+        DeepCacheSlot& slot = deep_cache_slots[slot_index];
+        if (slot.feature != NULL && ggml_are_same_shape(slot.feature, like)) {
+            return slot.feature;
+        }
+        free_deep_cache_slot(slot);
+
+        struct ggml_init_params params;
+        params.mem_size   = ggml_tensor_overhead();
+        params.mem_buffer = NULL;
+        params.no_alloc   = true;
+
+        slot.ctx = ggml_init(params);
+        GGML_ASSERT(slot.ctx != NULL);
+        slot.feature = ggml_new_tensor(slot.ctx, GGML_TYPE_F32, 4, like->ne);
+        slot.buffer  = ggml_backend_alloc_ctx_tensors(slot.ctx, backend);
+        if (slot.buffer == NULL) {
+            LOG_ERROR("%s alloc deep cache backend buffer failed", get_desc().c_str());
+            free_deep_cache_slot(slot);
+            return NULL;
+        }
+        LOG_DEBUG("%s deep cache buffer size = %.2f MB", get_desc().c_str(), ggml_nbytes(slot.feature) / 1024.0 / 1024.0);
+        return slot.feature;
+    }
+
     struct ggml_cgraph* build_graph(struct ggml_tensor* x,
                                     struct ggml_tensor* timesteps,
                                     struct ggml_tensor* context,
@@ -565,11 +688,20 @@ struct UNetModel : public GGMLModule {
         context   = to_backend(context);
         y         = to_backend(y);
         timesteps = to_backend(timesteps);
+        c_concat  = to_backend(c_concat);
 
         for (int i = 0; i < controls.size(); i++) {
             controls[i] = to_backend(controls[i]);
         }
 
+        int branch                     = deep_cache_mode != DEEP_CACHE_OFF ? deep_cache_branch : -1;
+        struct ggml_tensor* deep_cache = NULL;
+        if (deep_cache_mode == DEEP_CACHE_REUSE) {
+            GGML_ASSERT(has_deep_cache(deep_cache_slot, x->ne[3]));
+            deep_cache = deep_cache_slots[deep_cache_slot].feature;
+        }
+        struct ggml_tensor* deep_feature = NULL;
+
         struct ggml_tensor* out = unet.forward(compute_ctx,
                                                x,
                                                timesteps,
@@ -578,14 +710,23 @@ struct UNetModel : public GGMLModule {
                                                y,
                                                num_video_frames,
                                                controls,
-                                               control_strength);
-
+                                               control_strength,
+                                               branch,
+                                               deep_cache,
+                                               &deep_feature);
+
+        if (deep_cache_mode == DEEP_CACHE_FILL && deep_feature != NULL) {
+            struct ggml_tensor* feature = get_deep_cache_tensor(deep_cache_slot, deep_feature);
+            if (feature != NULL) {
+                ggml_build_forward_expand(gf, ggml_cpy(compute_ctx, deep_feature, feature));
+            }
+        }
         ggml_build_forward_expand(gf, out);
 
         return gf;
     }
 
-    void compute(int n_threads,
+    bool compute(int n_threads,
                  struct ggml_tensor* x,
                  struct ggml_tensor* timesteps,
                  struct ggml_tensor* context,
@@ -605,7 +746,18 @@ struct UNetModel : public GGMLModule {
             return build_graph(x, timesteps, context, c_concat, y, num_video_frames, controls, control_strength);
         };
 
-        GGMLModule::compute(get_graph, n_threads, false, output, output_ctx);
+        // same shapes on every sampling step, so the graph is built once and only gets new inputs;
+        // in the order build_graph() passes them to to_backend()
+        std::vector<struct ggml_tensor*> inputs = {x, context, y, timesteps, c_concat};
+        inputs.insert(inputs.end(), controls.begin(), controls.end());
+        std::string signature = get_graph_signature(inputs) + format("%d,%f", num_video_frames, control_strength);
+        if (deep_cache_mode != DEEP_CACHE_OFF) {
+            signature += format(",deep_cache:%d,%d,%d", deep_cache_mode, deep_cache_slot, deep_cache_branch);
+        }
+
+        bool ok         = GGMLModule::compute_cached(signature, inputs, get_graph, n_threads, output, output_ctx);
+        deep_cache_mode = DEEP_CACHE_OFF;
+        return ok;
     }
 
     void test() {
@@ -111,6 +111,7 @@ upscaler_ctx_t* new_upscaler_ctx(const char* esrgan_path_c_str,
 }
 
 sd_image_t upscale(upscaler_ctx_t* upscaler_ctx, sd_image_t input_image, uint32_t upscale_factor) {
+    profiler_begin_request();
     return upscaler_ctx->upscaler->upscale(input_image, upscale_factor);
 }
 
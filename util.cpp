@@ -5,6 +5,7 @@
 #include <codecvt>
 #include <fstream>
 #include <locale>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -21,6 +22,8 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #endif
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #include "ggml/ggml.h"
 #include "stable-diffusion.h"
@@ -135,8 +138,56 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+bool MmapFile::open(const std::string& file_path) {
+    close();
+    HANDLE file = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    // PAGE_WRITECOPY keeps the file untouched if tensors are modified in place (e.g. by LoRA)
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+    void* addr = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (addr == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    file_handle_    = file;
+    mapping_handle_ = mapping;
+    data_           = (uint8_t*)addr;
+    size_           = (size_t)file_size.QuadPart;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != NULL) {
+        UnmapViewOfFile(data_);
+        data_ = NULL;
+    }
+    if (mapping_handle_ != NULL) {
+        CloseHandle((HANDLE)mapping_handle_);
+        mapping_handle_ = NULL;
+    }
+    if (file_handle_ != NULL) {
+        CloseHandle((HANDLE)file_handle_);
+        file_handle_ = NULL;
+    }
+    size_ = 0;
+}
+
 #else  // Unix
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 bool file_exists(const std::string& filename) {
@@ -190,8 +241,52 @@ std::vector<std::string> get_files_from_dir(const std::string& dir) {
     return files;
 }
 
+bool MmapFile::open(const std::string& file_path) {
+    close();
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    // MAP_PRIVATE keeps the file untouched if tensors are modified in place (e.g. by LoRA)
+    void* addr = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    data_ = (uint8_t*)addr;
+    size_ = (size_t)st.st_size;
+    return true;
+}
+
+void MmapFile::close() {
+    if (data_ != NULL) {
+        munmap(data_, size_);
+        data_ = NULL;
+    }
+    size_ = 0;
+}
+
 #endif
 
+bool get_file_stat(const std::string& path, size_t& size, int64_t& mtime) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size  = (size_t)st.st_size;
+    mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+MmapFile::~MmapFile() {
+    close();
+}
+
 // get_num_physical_cores is copy from
 // https://github.com/ggerganov/llama.cpp/blob/master/examples/common.cpp
 // LICENSE: https://github.com/ggerganov/llama.cpp/blob/master/LICENSE
@@ -309,7 +404,11 @@ sd_image_t* preprocess_id_image(sd_image_t* img) {
     return resized;
 }
 
+// queued requests report their progress from their own threads
+static std::mutex progress_mutex;
+
 void pretty_progress(int step, int steps, float time) {
+    std::lock_guard<std::mutex> lock(progress_mutex);
     if (sd_progress_cb) {
         sd_progress_cb(step, steps, time, sd_progress_cb_data);
         return;
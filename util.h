@@ -17,10 +17,34 @@ void replace_all_chars(std::string& str, char target, char replacement);
 
 bool file_exists(const std::string& filename);
 bool is_directory(const std::string& path);
+bool get_file_stat(const std::string& path, size_t& size, int64_t& mtime);
 std::string get_full_path(const std::string& dir, const std::string& filename);
 
 std::vector<std::string> get_files_from_dir(const std::string& dir);
 
+// private (copy-on-write) memory mapping of a whole file
+class MmapFile {
+public:
+    MmapFile() = default;
+    ~MmapFile();
+    MmapFile(const MmapFile&) = delete;
+    MmapFile& operator=(const MmapFile&) = delete;
+
+    bool open(const std::string& file_path);
+    void close();
+
+    uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    uint8_t* data_ = NULL;
+    size_t size_   = 0;
+#ifdef _WIN32
+    void* file_handle_    = NULL;
+    void* mapping_handle_ = NULL;
+#endif
+};
+
 std::u32string utf8_to_utf32(const std::string& utf8_str);
 std::string utf32_to_utf8(const std::u32string& utf32_str);
 std::u32string unicode_value_to_utf32(int unicode_value);
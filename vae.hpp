@@ -542,7 +542,7 @@ struct AutoEncoderKL : public GGMLModule {
         return gf;
     }
 
-    void compute(const int n_threads,
+    bool compute(const int n_threads,
                  struct ggml_tensor* z,
                  bool decode_graph,
                  struct ggml_tensor** output,
@@ -552,7 +552,7 @@ struct AutoEncoderKL : public GGMLModule {
         };
         // ggml_set_f32(z, 0.5f);
         // print_ggml_tensor(z);
-        GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
+        return GGMLModule::compute(get_graph, n_threads, true, output, output_ctx);
     }
 
     void test() {